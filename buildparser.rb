@@ -0,0 +1,199 @@
+#!/usr/bin/env ruby
+# buildparser.rb - compile escape code parser state diagrams into tables
+# Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# A table has one row per state and one entry per input, where the last input
+# stands for every code point past the ones before it. Each entry is an action
+# and, if the input changes state, the state entered next. The names are the
+# ones declared in terminix.h.
+class Table
+  attr_reader :prefix, :rows
+
+  def initialize(prefix, states, inputs)
+    @prefix = prefix
+    @inputs = inputs
+    @rows = states.to_h { |state| [state, Array.new(inputs) { [:NOTHING] }] }
+  end
+
+  # Performs action without changing state.
+  def on(states, inputs, action)
+    set(states, inputs, [action])
+  end
+
+  # Performs action and enters target, even if it is the current state.
+  def go(states, inputs, target, action = :NOTHING)
+    set(states, inputs, [action, target])
+  end
+
+  def generate(name)
+    print("\n\nconst unsigned short #{name}[#{prefix}_STATES][#{prefix}_INPUTS] = {")
+
+    @rows.each do |state, row|
+      print("\n\t[#{prefix}_#{state}] = {")
+
+      row.each_with_index do |(action, target), input|
+        print("\n\t\t/* 0x%02X */ " % input) if input % 4 == 0
+        print(target ? "GO(#{prefix}_DO_#{action}, #{prefix}_#{target})," :
+          "#{prefix}_DO_#{action},")
+        print(' ') unless input % 4 == 3 or input == @inputs - 1
+      end
+
+      print("\n\t},")
+    end
+
+    print("\n};")
+  end
+
+  private
+
+  def set(states, inputs, entry)
+    Array(states).each do |state|
+      Array(inputs).each do |input|
+        (input.is_a?(Range) ? input.to_a : [input]).each do |i|
+          @rows.fetch(state)[i] = entry
+        end
+      end
+    end
+  end
+end
+
+# See https://vt100.net/emu/dec_ansi_parser for the diagram this follows.
+def vt100_table
+  states = %i[
+    GROUND ESCAPE ESCAPE_INTERMEDIATE CSI_ENTRY CSI_PARAM CSI_INTERMEDIATE
+    CSI_IGNORE DCS_ENTRY DCS_PARAM DCS_INTERMEDIATE DCS_PASSTHROUGH
+    DCS_IGNORE OSC_STRING SOS_STRING PM_STRING APC_STRING
+  ]
+
+  c0 = [0x00..0x17, 0x19, 0x1C..0x1F]
+  other = 0xA0
+  t = Table.new('VT100', states, other + 1)
+
+  t.on(:GROUND, c0, :EXECUTE)
+  t.on(:GROUND, [0x20..0x9F, other], :PRINT)
+
+  t.on(:ESCAPE, c0, :EXECUTE)
+  t.go(:ESCAPE, 0x20..0x2F, :ESCAPE_INTERMEDIATE, :COLLECT)
+  t.go(:ESCAPE, [0x30..0x4F, 0x51..0x57, 0x59, 0x5A, 0x5C, 0x60..0x7E],
+    :GROUND, :ESC_DISPATCH)
+  t.go(:ESCAPE, 0x50, :DCS_ENTRY)
+  t.go(:ESCAPE, 0x58, :SOS_STRING)
+  t.go(:ESCAPE, 0x5B, :CSI_ENTRY)
+  t.go(:ESCAPE, 0x5D, :OSC_STRING)
+  t.go(:ESCAPE, 0x5E, :PM_STRING)
+  t.go(:ESCAPE, 0x5F, :APC_STRING)
+
+  t.on(:ESCAPE_INTERMEDIATE, c0, :EXECUTE)
+  t.on(:ESCAPE_INTERMEDIATE, 0x20..0x2F, :COLLECT)
+  t.go(:ESCAPE_INTERMEDIATE, 0x30..0x7E, :GROUND, :ESC_DISPATCH)
+
+  t.on(:CSI_ENTRY, c0, :EXECUTE)
+  t.go(:CSI_ENTRY, 0x20..0x2F, :CSI_INTERMEDIATE, :COLLECT)
+  t.go(:CSI_ENTRY, 0x3A, :CSI_IGNORE)
+  t.go(:CSI_ENTRY, [0x30..0x39, 0x3B], :CSI_PARAM, :PARAM)
+  t.go(:CSI_ENTRY, 0x3C..0x3F, :CSI_PARAM, :COLLECT)
+  t.go(:CSI_ENTRY, 0x40..0x7E, :GROUND, :CSI_DISPATCH)
+
+  t.on(:CSI_PARAM, c0, :EXECUTE)
+  t.go(:CSI_PARAM, 0x20..0x2F, :CSI_INTERMEDIATE, :COLLECT)
+  t.on(:CSI_PARAM, [0x30..0x39, 0x3B], :PARAM)
+  t.go(:CSI_PARAM, [0x3A, 0x3C..0x3F], :CSI_IGNORE)
+  t.go(:CSI_PARAM, 0x40..0x7E, :GROUND, :CSI_DISPATCH)
+
+  t.on(:CSI_INTERMEDIATE, c0, :EXECUTE)
+  t.on(:CSI_INTERMEDIATE, 0x20..0x2F, :COLLECT)
+  t.go(:CSI_INTERMEDIATE, 0x30..0x3F, :CSI_IGNORE)
+  t.go(:CSI_INTERMEDIATE, 0x40..0x7E, :GROUND, :CSI_DISPATCH)
+
+  t.on(:CSI_IGNORE, c0, :EXECUTE)
+  t.go(:CSI_IGNORE, 0x40..0x7E, :GROUND)
+
+  # Device control strings are parsed but their contents are thrown away.
+  t.go(:DCS_ENTRY, 0x20..0x2F, :DCS_INTERMEDIATE, :COLLECT)
+  t.go(:DCS_ENTRY, 0x3A, :DCS_IGNORE)
+  t.go(:DCS_ENTRY, [0x30..0x39, 0x3B], :DCS_PARAM, :PARAM)
+  t.go(:DCS_ENTRY, 0x3C..0x3F, :DCS_PARAM, :COLLECT)
+  t.go(:DCS_ENTRY, 0x40..0x7E, :DCS_PASSTHROUGH)
+
+  t.go(:DCS_PARAM, 0x20..0x2F, :DCS_INTERMEDIATE, :COLLECT)
+  t.on(:DCS_PARAM, [0x30..0x39, 0x3B], :PARAM)
+  t.go(:DCS_PARAM, [0x3A, 0x3C..0x3F], :DCS_IGNORE)
+  t.go(:DCS_PARAM, 0x40..0x7E, :DCS_PASSTHROUGH)
+
+  t.on(:DCS_INTERMEDIATE, 0x20..0x2F, :COLLECT)
+  t.go(:DCS_INTERMEDIATE, 0x30..0x3F, :DCS_IGNORE)
+  t.go(:DCS_INTERMEDIATE, 0x40..0x7E, :DCS_PASSTHROUGH)
+
+  t.go(:OSC_STRING, 0x07, :GROUND, :OSC_END)
+  t.on(:OSC_STRING, [0x20..0x9F, other], :OSC_PUT)
+
+  # These apply in every state.
+  t.go(states, 0x18, :GROUND)
+  t.go(states, 0x1A, :GROUND, :SUBSTITUTE)
+  t.go(states, 0x1B, :ESCAPE)
+  t.on(states, [0x84, 0x85, 0x88, 0x8D, 0x8E, 0x8F, 0x9A], :EXECUTE)
+  t.go(states, 0x90, :DCS_ENTRY)
+  t.go(states, 0x98, :SOS_STRING)
+  t.go(states, 0x9B, :CSI_ENTRY)
+  t.go(states, 0x9C, :GROUND)
+  t.go(states, 0x9D, :OSC_STRING)
+  t.go(states, 0x9E, :PM_STRING)
+  t.go(states, 0x9F, :APC_STRING)
+
+  # Leaving an operating system command through ESC or ST completes it.
+  t.go(:OSC_STRING, 0x1B, :ESCAPE, :OSC_END)
+  t.go(:OSC_STRING, 0x9C, :GROUND, :OSC_END)
+
+  t
+end
+
+def vt52_table
+  states = %i[GROUND ESCAPE DCA1 DCA2 SETFG SETBG]
+  other = 0x80
+  t = Table.new('VT52', states, other + 1)
+
+  t.on(:GROUND, [0x00..0x1F, 0x7F], :EXECUTE)
+  t.on(:GROUND, [0x20..0x7E, other], :PRINT)
+  t.go(:GROUND, 0x1B, :ESCAPE)
+
+  t.go(:ESCAPE, 0x00..other, :GROUND, :ESC_DISPATCH)
+  t.go(:ESCAPE, 0x59, :DCA1)
+  t.go(:ESCAPE, 0x62, :SETFG)
+  t.go(:ESCAPE, 0x63, :SETBG)
+
+  t.go(:DCA1, 0x00..other, :DCA2, :ROW)
+  t.go(:DCA2, 0x00..other, :GROUND, :COLUMN)
+  t.go(:SETFG, 0x00..other, :GROUND, :FOREGROUND)
+  t.go(:SETBG, 0x00..other, :GROUND, :BACKGROUND)
+
+  t
+end
+
+if $0 == __FILE__
+  Dir.chdir(File.dirname($0))
+
+  $stdout.reopen("src/vtparse.c", "wb")
+  print("// This file is autogenerated by buildparser.rb\n\n")
+  print("#include \"terminix.h\"\n\n")
+  print("#define GO(action, state) ((action) | ((state) + 1) << 8)")
+
+  vt100_table.generate('vt100_transitions')
+  vt52_table.generate('vt52_transitions')
+  print("\n")
+
+  $stdout.close
+end
+
+# vim: set ts=8 sts=2 sw=2 et:
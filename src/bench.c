@@ -0,0 +1,413 @@
+// bench.c - measuring how fast output is parsed and drawn
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "terminix.h"
+
+// The benchmark replays canned output through the same parser and software
+// renderer terminix uses, without a window or a child, either generated or
+// from a recording made with terminix --record. A frame is drawn after every
+// FRAME_BYTES of output, which is about what one pass of the main loop takes in
+// when a program floods the terminal.
+#define FRAME_BYTES 16384
+
+struct workload {
+	const char	*name;
+	void		(*generate)(void);
+};
+
+static void generate_ascii(void);
+static void generate_sgr(void);
+static void generate_cjk(void);
+static void generate_vim(void);
+static void generate_scroll(void);
+
+static const struct workload workloads[] = {
+	{ "ascii", generate_ascii },
+	{ "sgr", generate_sgr },
+	{ "cjk", generate_cjk },
+	{ "vim", generate_vim },
+	{ "scroll", generate_scroll },
+	{ NULL, NULL }
+};
+
+static int columns = 80, rows = 24;
+static size_t target_size = 16 << 20;
+static unsigned char *output;
+static size_t output_size, output_capacity;
+static uint32_t seed;
+static const char *recording;
+
+// The one session there is, which stands in for a window columns by rows cells
+// big.
+static struct session bench_session;
+static struct canvas canvas;
+
+static void parse_command_line(int, char **);
+static const struct workload *find_workload(const char *);
+static void run(const struct workload *);
+static void run_replay(struct replay *);
+static long draw_frame(struct snapshot *);
+static void emit(const char *, ...) __attribute__((format(printf, 1, 2)));
+static void emit_utf8(long);
+static unsigned pick(unsigned);
+
+int
+main(int argc, char **argv)
+{
+	const struct workload *workload;
+	struct replay *replay;
+	int i;
+
+	parse_command_line(argc, argv);
+
+	// Any misspelled name should stop the run before it starts, and so
+	// should a recording that isn't one.
+	for (i = optind; i < argc; i++)
+		find_workload(argv[i]);
+
+	session = sessions = &bench_session;
+	init_history();
+	init_search();
+	init_screen();
+	resize(columns, rows);
+	reset();
+	session->window_width = columns * CHARWIDTH;
+	session->window_height = rows * CHARHEIGHT;
+	init_raster();
+
+	replay = recording ? open_replay(recording, 0) : NULL;
+
+	printf("%-8s %10s %10s %10s\n", "workload", "MB/s", "ns/byte",
+		"frames/s");
+
+	if (replay)
+		run_replay(replay);
+	else if (optind == argc)
+		for (workload = workloads; workload->name; workload++)
+			run(workload);
+
+	for (i = optind; i < argc; i++)
+		run(find_workload(argv[i]));
+
+	deinit_canvas(&canvas);
+	deinit_search();
+	deinit_screen();
+	deinit_history();
+	free(output);
+	return EXIT_SUCCESS;
+}
+
+static void
+parse_command_line(int argc, char **argv)
+{
+	enum { SIZE = 1, MEGABYTES, REPLAY };
+
+	static const struct option options[] = {
+		{ "size", required_argument, 0, SIZE },
+		{ "megabytes", required_argument, 0, MEGABYTES },
+		{ "replay", required_argument, 0, REPLAY },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt;
+
+	while ((opt = getopt_long_only(argc, argv, "", options, NULL)) != -1)
+		switch (opt) {
+		case SIZE:
+			if (sscanf(optarg, "%dx%d", &columns, &rows) != 2 ||
+				columns < 8 || rows < 2)
+				die("size must be COLUMNSxROWS");
+			break;
+		case MEGABYTES:
+			if (!(target_size = atof(optarg) * (1 << 20)))
+				die("megabytes must be a positive number");
+			break;
+		case REPLAY:
+			recording = optarg;
+			break;
+		default:
+			die("usage: bench [-size COLUMNSxROWS] [-megabytes N] "
+				"[-replay FILE] [workload...]");
+		}
+}
+
+static const struct workload *
+find_workload(const char *name)
+{
+	const struct workload *workload;
+
+	for (workload = workloads; workload->name; workload++)
+		if (!strcmp(name, workload->name))
+			return workload;
+
+	errx(EXIT_FAILURE, "no workload named %s", name);
+}
+
+// Generates a workload and feeds it to the terminal, timing the parser and the
+// renderer separately.
+static void
+run(const struct workload *workload)
+{
+	struct snapshot frame;
+	uint64_t start, parse_time, render_time;
+	size_t offset, n;
+	long frames;
+
+	output_size = 0;
+	seed = 1;
+
+	while (output_size < target_size)
+		workload->generate();
+
+	reset();
+	memset(&frame, 0, sizeof(frame));
+	parse_time = render_time = 0;
+	frames = 0;
+
+	for (offset = 0; offset < output_size; offset += n) {
+		if ((n = output_size - offset) > FRAME_BYTES)
+			n = FRAME_BYTES;
+
+		start = monotonic_time();
+		vtinterp_buf(&output[offset], n);
+		parse_time += monotonic_time() - start;
+		render_time += draw_frame(&frame);
+		frames++;
+	}
+
+	deinit_snapshot(&frame);
+
+	printf("%-8s %10.1f %10.2f %10.0f\n", workload->name,
+		output_size * 1000.0 / (parse_time ? parse_time : 1),
+		(double)parse_time / output_size,
+		frames * 1000000000.0 / (render_time ? render_time : 1));
+}
+
+// Plays a recording from the start as fast as it goes, at the sizes it was
+// recorded at, drawing a frame after each time round instead of every
+// FRAME_BYTES.
+static void
+run_replay(struct replay *replay)
+{
+	struct snapshot frame;
+	uint64_t start, parse_time, render_time;
+	size_t size, n;
+	long frames;
+
+	seek_replay(replay, 0);
+	memset(&frame, 0, sizeof(frame));
+	parse_time = render_time = size = 0;
+	frames = 0;
+
+	for (;;) {
+		start = monotonic_time();
+		n = play_replay(replay, 0);
+		parse_time += monotonic_time() - start;
+
+		if (!n && !replay_deadline(replay))
+			break;
+
+		size += n;
+		render_time += draw_frame(&frame);
+		frames++;
+	}
+
+	deinit_snapshot(&frame);
+	close_replay(replay);
+
+	printf("%-8s %10.1f %10.2f %10.0f\n", "replay",
+		size * 1000.0 / (parse_time ? parse_time : 1),
+		size ? (double)parse_time / size : 0.0,
+		frames * 1000000000.0 / (render_time ? render_time : 1));
+}
+
+// Draws a frame of the screen as it is, which may have been resized since the
+// last one, and returns how long that took in ns.
+static long
+draw_frame(struct snapshot *frame)
+{
+	uint64_t start;
+
+	start = monotonic_time();
+	session->window_width = term->width * CHARWIDTH;
+	session->window_height = term->height * CHARHEIGHT;
+	take_snapshot(frame);
+	frame->window_width = session->window_width;
+	frame->window_height = session->window_height;
+	frame->timer_count = timer_count;
+	frame->time = current_time;
+	rasterize(&canvas, frame);
+	canvas.upload_top = canvas.upload_bottom = 0;
+	return monotonic_time() - start;
+}
+
+// A flood of plain text, such as cat or a build log.
+static void
+generate_ascii()
+{
+	unsigned length, i;
+
+	length = pick(columns);
+
+	for (i = 0; i < length; i++)
+		emit("%c", 0x20 + pick(0x5F));
+
+	emit("\r\n");
+}
+
+// Text broken up by a change of color every few characters, such as ls --color
+// or a syntax-highlighted diff.
+static void
+generate_sgr()
+{
+	unsigned length, run, i;
+
+	for (length = 0; length < (unsigned)columns; length += run) {
+		switch (pick(4)) {
+		case 0:
+			emit("\33[%um", 30 + pick(8));
+			break;
+		case 1:
+			emit("\33[1;%u;%um", 30 + pick(8), 40 + pick(8));
+			break;
+		case 2:
+			emit("\33[38;5;%um", pick(256));
+			break;
+		case 3:
+			emit("\33[48;2;%u;%u;%um", pick(256), pick(256),
+				pick(256));
+			break;
+		}
+
+		for (run = 1 + pick(6), i = 0; i < run; i++)
+			emit("%c", 0x21 + pick(0x5E));
+	}
+
+	emit("\33[m\r\n");
+}
+
+// Lines of double-width ideographs mixed with kana, after switching to UTF-8.
+static void
+generate_cjk()
+{
+	unsigned length, i;
+
+	if (!output_size)
+		emit("\33%%G");
+
+	length = pick(columns / 2);
+
+	for (i = 0; i < length; i++)
+		emit_utf8(pick(4) ? 0x4E00 + pick(0x5200) :
+			0x3041 + pick(0x56));
+
+	emit("\r\n");
+}
+
+// What a full-screen editor sends while scrolling through a file: each line is
+// addressed, written, and erased to its end, with the status line in reverse
+// video at the bottom.
+static void
+generate_vim()
+{
+	unsigned y, length, i;
+
+	for (y = 1; y < (unsigned)rows; y++) {
+		emit("\33[%u;1H\33[33m%4u \33[m", y, pick(10000));
+		length = pick(columns - 5);
+
+		for (i = 0; i < length; i++)
+			emit("%c", 0x20 + pick(0x5F));
+
+		emit("\33[K");
+	}
+
+	emit("\33[%u;1H\33[7m\"bench.c\" line %u\33[K\33[m\33[%u;%uH", rows,
+		pick(10000), 1 + pick(rows - 1), 1 + pick(columns));
+}
+
+// Output confined to a scroll region, such as a pager or a split-pane
+// multiplexer, going both ways.
+static void
+generate_scroll()
+{
+	unsigned top, bottom, i, length;
+
+	top = 1 + pick(rows / 2);
+	bottom = rows - pick(rows / 2);
+	emit("\33[%u;%ur", top, bottom);
+
+	for (i = 0; i < 16; i++) {
+		if (pick(4))
+			emit("\33[%u;1H\n", bottom);
+		else
+			emit("\33[%u;1H\33M", top);
+
+		length = pick(columns);
+
+		while (length--)
+			emit("%c", 0x20 + pick(0x5F));
+	}
+
+	emit("\33[r");
+}
+
+static void
+emit(const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	if (output_capacity - output_size < 256) {
+		output_capacity = output_capacity ? output_capacity * 2 : 1 << 20;
+
+		if (!(output = realloc(output, output_capacity)))
+			pdie("failed to allocate workload memory");
+	}
+
+	va_start(ap, format);
+	n = vsnprintf((char *)&output[output_size], 256, format, ap);
+	va_end(ap);
+	output_size += n;
+}
+
+static void
+emit_utf8(long code_point)
+{
+	if (code_point < 0x80)
+		emit("%c", (int)code_point);
+	else if (code_point < 0x800)
+		emit("%c%c", (int)(0xC0 | code_point >> 6),
+			(int)(0x80 | (code_point & 0x3F)));
+	else
+		emit("%c%c%c", (int)(0xE0 | code_point >> 12),
+			(int)(0x80 | (code_point >> 6 & 0x3F)),
+			(int)(0x80 | (code_point & 0x3F)));
+}
+
+// Returns a number below limit. Every run of a workload is made from the same
+// sequence of them, so that runs can be compared with each other.
+static unsigned
+pick(unsigned limit)
+{
+	seed = seed * 1103515245 + 12345;
+	return limit ? (seed >> 8) % limit : 0;
+}
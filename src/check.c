@@ -0,0 +1,265 @@
+// check.c - feeding damaged recordings to the replay
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "terminix.h"
+
+// The check records a keyframe of a small screen, then plays back copies of it
+// that were cut short or had one of their numbers made far too big, each in a
+// child of its own. A damaged keyframe must make the child die as corrupt, or
+// at worst be taken as some other screen, which the child then prints onto;
+// anything else, such as the address sanitizer catching a write out of bounds,
+// is a failure. OUTPUT_SIZE is enough output for the recorder to want a
+// keyframe once it has been parsed.
+#define MAGIC "terminix recording 1\n"
+#define OUTPUT_SIZE (4 << 20)
+
+// Numbers put in place of the keyframe's: one that is negative as a short,
+// one that is negative as an int, and the biggest there is.
+static const uint64_t huge_numbers[] = { 0xFFF0, 0xFFFFFFFF, UINT64_MAX };
+
+static struct session check_session;
+static char path[] = "/tmp/terminix-check-XXXXXX";
+static unsigned char *keyframe;
+static size_t keyframe_size;
+static int failures;
+
+static void record_keyframe(void);
+static void find_keyframe(const unsigned char *, size_t);
+static void made_room(void *);
+static bool try_keyframe(const unsigned char *, size_t);
+static _Noreturn void replay_keyframe(void);
+
+int
+main()
+{
+	unsigned char *damaged, *p;
+	size_t start, end, i;
+	int fd, tried;
+
+	if ((fd = mkstemp(path)) < 0)
+		pdie("failed to create recording");
+
+	close(fd);
+	session = sessions = &check_session;
+	init_history();
+	init_search();
+	init_screen();
+	resize(8, 3);
+	reset();
+	record_keyframe();
+
+	if (!(damaged = malloc(keyframe_size + MAX_NUMBER_SIZE)))
+		pdie("failed to allocate check memory");
+
+	tried = 1;
+
+	if (!try_keyframe(keyframe, keyframe_size)) {
+		warnx("the keyframe as it was recorded is not taken");
+		failures++;
+	}
+
+	for (i = 0; i < keyframe_size; i++, tried++)
+		if (try_keyframe(keyframe, i)) {
+			warnx("a keyframe cut off after %zu bytes is taken", i);
+			failures++;
+		}
+
+	// Every byte without its top bit set ends a number, or a byte that is
+	// not one, and either is replaced by each of the huge numbers.
+	for (start = 0; start < keyframe_size; start = end) {
+		end = start;
+
+		while (end < keyframe_size && keyframe[end++] & 0x80)
+			;
+
+		for (i = 0; i < sizeof(huge_numbers) / sizeof(*huge_numbers);
+			i++, tried++) {
+			memcpy(damaged, keyframe, start);
+			p = put_number(&damaged[start], huge_numbers[i]);
+			memcpy(p, &keyframe[end], keyframe_size - end);
+			try_keyframe(damaged,
+				p - damaged + keyframe_size - end);
+		}
+	}
+
+	unlink(path);
+	free(damaged);
+	free(keyframe);
+	printf("%d of %d keyframes went wrong\n", failures, tried);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Records OUTPUT_SIZE bytes of output, with colors and wide characters, and a
+// keyframe of the screen they leave, which ends part way through an escape
+// code so that the parser's state is kept too.
+static void
+record_keyframe()
+{
+	static const char tail[] = "\33[1;35m\xe4\xb8\x80x\33[4;1";
+
+	struct recorder *recorder;
+	unsigned char *output, *p, *end;
+	struct stat st;
+	int fd, line;
+
+	if (!(output = malloc(OUTPUT_SIZE)))
+		pdie("failed to allocate check memory");
+
+	end = output + OUTPUT_SIZE - (sizeof(tail) - 1);
+	p = output + sprintf((char *)output, "\33%%G");
+
+	for (line = 0; end - p > 32; line++)
+		p += sprintf((char *)p, "\33[3%dm%c\xe4\xb8\x80\r\n",
+			line % 8, 'a' + line % 26);
+
+	memset(p, 'z', end - p);
+	memcpy(end, tail, sizeof(tail) - 1);
+
+	recorder = start_recording(path, made_room, NULL);
+	vtinterp_buf(output, OUTPUT_SIZE);
+	record_output(recorder, output, OUTPUT_SIZE);
+	record_screen(recorder, OUTPUT_SIZE);
+	stop_recording(recorder);
+	free(output);
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st))
+		pdie("failed to open recording");
+
+	if (!(output = malloc(st.st_size)) ||
+		read(fd, output, st.st_size) != st.st_size)
+		pdie("failed to read recording");
+
+	close(fd);
+	find_keyframe(output, st.st_size);
+	free(output);
+}
+
+// Copies the keyframe out of a recording made by record_keyframe().
+static void
+find_keyframe(const unsigned char *data, size_t size)
+{
+	const unsigned char *p, *end;
+	size_t length;
+
+	p = data + sizeof(MAGIC) - 1;
+	end = data + size;
+	get_number(&p);
+	get_number(&p);
+
+	while (p < end) {
+		switch (*p++) {
+		case 'o':
+			get_number(&p);
+			p += get_number(&p);
+			break;
+		case 'k':
+			get_number(&p);
+			get_number(&p);
+			length = get_number(&p);
+
+			if (!(keyframe = malloc(length)))
+				pdie("failed to allocate check memory");
+
+			memcpy(keyframe, p, length);
+			keyframe_size = length;
+			return;
+		default:
+			die("unexpected record in recording");
+		}
+	}
+
+	die("no keyframe was recorded");
+}
+
+static void
+made_room(void *unused __attribute__((unused)))
+{
+}
+
+// Writes a recording of one byte of output and then the given keyframe, and
+// plays it back in a child. Returns whether the keyframe was taken, and counts
+// a failure if the child neither got through it nor died of a corrupt one.
+static bool
+try_keyframe(const unsigned char *data, size_t size)
+{
+	unsigned char header[sizeof(MAGIC) + 4 * MAX_NUMBER_SIZE + 8], *p;
+	int fd, status;
+	pid_t child;
+
+	memcpy(header, MAGIC, sizeof(MAGIC) - 1);
+	p = put_number(&header[sizeof(MAGIC) - 1], 8);
+	p = put_number(p, 3);
+	*p++ = 'o';
+	p = put_number(p, 0);
+	p = put_number(p, 1);
+	*p++ = 'x';
+	*p++ = 'k';
+	p = put_number(p, 0);
+	p = put_number(p, 1);
+	p = put_number(p, size);
+
+	if ((fd = open(path, O_WRONLY|O_TRUNC)) < 0 ||
+		write(fd, header, p - header) != p - header ||
+		write(fd, data, size) != (ssize_t)size || close(fd))
+		pdie("failed to write recording");
+
+	switch ((child = fork())) {
+	case -1:
+		pdie("failed to fork");
+	case 0:
+		replay_keyframe();
+	}
+
+	if (waitpid(child, &status, 0) < 0)
+		pdie("failed to wait for child");
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		return true;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_FAILURE) {
+		warnx("a keyframe of %zu bytes crashed the replay", size);
+		failures++;
+	}
+
+	return false;
+}
+
+// Seeks to the keyframe and prints over the screen it gives, which is where a
+// cursor or scroll region out of bounds would write past the lines.
+static void
+replay_keyframe()
+{
+	static const char text[] = "abc\r\n\33[Kdef\33[2;3Hg\33[10Mh\33[L"
+		"\xe4\xb8\x80\33Dij\33Mk\b\tl";
+
+	struct replay *replay;
+	int fd;
+
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+		dup2(fd, 2);
+
+	replay = open_replay(path, 0);
+	seek_replay(replay, UINT64_MAX);
+	vtinterp_buf((const unsigned char *)text, sizeof(text) - 1);
+	close_replay(replay);
+	_exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,829 @@
+// history.c - scrollback history
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#define _GNU_SOURCE // memmem
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "terminix.h"
+
+// Lines that scroll off the screen are kept as they were in a ring of recent
+// lines, which takes up at most a quarter of the budget. Once the ring is full
+// its oldest lines are packed into a block, and the oldest blocks are freed
+// whenever everything together takes up more than history_budget bytes.
+//
+// If spill_budget is set, blocks are written out to segment files instead of
+// being freed, and are read back through a read-only mapping of the whole
+// segment so that the page cache decides how much of it stays in memory. The
+// oldest segment is deleted when there are more than fit in spill_budget, or
+// as soon as none of its blocks are left unless it is still being filled.
+// Segment files are unlinked as soon as they are made, so that none are left
+// behind however we exit.
+#define RECENT_LINES 256
+#define BLOCK_LINES 64
+#define SEGMENT_SIZE (16 << 20)
+#define SEGMENT_NAME "/terminix-history-XXXXXX"
+#define FILTER_WORDS 32
+
+// A packed line is its dimensions, its width, and how many of its cells come
+// before the blank ones at the end. Then comes the code point of each of those
+// cells, the length and style of each run of them that share a style, and a
+// zero length. Every number but the dimensions is written by put_number().
+//
+// Styles are numbered within their block, and a copy of each style used is
+// kept with the packed lines.
+//
+// A block's image is the offset of each packed line, its styles, and the packed
+// lines. image is set while the image is in memory and segment while it is in
+// a segment file, at position; either way the other pointers point into it.
+//
+// filter has a bit set for every pair of neighbouring code points in the block,
+// so that searches can skip the blocks that cannot hold what they look for
+// without reading their images again. It is only made the first time a search
+// reaches the block, so that packing lines that are never searched does not pay
+// for it, and is left out of memory_used, since it is small next to the image.
+struct block {
+	long			 first;
+	uint64_t		*filter;
+	int			 count, style_count;
+	size_t			 size;
+	unsigned char		*image;
+	long			 segment;
+	size_t			 position;
+	const uint32_t		*offsets;
+	const struct style	*styles;
+	const unsigned char	*data;
+};
+
+// Segments are numbered in the order they were made, and the blocks in them
+// refer to them by that number.
+struct segment {
+	long		 number;
+	int		 fd;
+	unsigned char	*map;
+	size_t		 size;
+};
+
+// Number of cells pack_line() checks for blanks at once.
+#define BLANK_CHUNK 16
+
+size_t history_budget = 16 << 20, spill_budget;
+
+// Each session has a history of its own, which takes up at most the budgets.
+// Lines are numbered in the order they were pushed, starting from zero, and
+// total is the number of the next one. The recent ring holds the last
+// recent_count of them and blocks holds older ones, oldest first.
+//
+// The search thread reads blocks while holding lock, so it is held whenever
+// blocks are added, moved, or freed. The first spilled_count blocks are in
+// segments, which are oldest first. spill_failed is set once a segment could
+// not be made or written, after which this history frees blocks instead.
+struct history {
+	char		 *recent;
+	int		  recent_width, recent_capacity, recent_first;
+	int		  recent_count;
+	struct block	**blocks;
+	int		  block_capacity, block_first, block_count;
+	long		  total;
+	size_t		  memory_used;
+	pthread_mutex_t	  lock;
+	struct segment	 *segments;
+	int		  segment_count, spilled_count;
+	long		  segment_number;
+	bool		  spill_failed;
+};
+
+struct history *history;
+
+// The styles of the block being packed.
+static struct style_numbering block_styles;
+
+static const struct cell blank_chunk[BLANK_CHUNK];
+
+static void resize_recent(void);
+static struct line *recent_line(int);
+static void pack_recent(int);
+static void add_block(struct block *);
+static void drop_block(void);
+static bool spill_block(struct block *);
+static bool add_segment(void);
+static void drop_segment(void);
+static void release_segments(void);
+static void locate_block(struct block *, const unsigned char *);
+static struct block *block_at(const struct history *, int);
+static struct block *find_block(const struct history *, long);
+static unsigned char *pack_line(unsigned char *, const struct line *, int);
+static void unpack_line(const struct block *, const unsigned char *,
+	struct line *);
+static void make_filter(struct block *);
+static bool filter_passes(const uint64_t *, const uint32_t *, int);
+static void set_pair(uint64_t *, uint32_t, uint32_t);
+static uint32_t pair_bit(uint32_t, uint32_t);
+
+void
+init_history()
+{
+	if (!(history = session->history = calloc(1, sizeof(*history))))
+		pdie("failed to allocate history memory");
+
+	if ((errno = pthread_mutex_init(&history->lock, NULL)))
+		pdie("failed to create history lock");
+}
+
+// Frees the current session's history. The search thread must be done with it.
+void
+deinit_history()
+{
+	if (!history)
+		return;
+
+	while (history->segment_count)
+		drop_segment();
+
+	while (history->block_count)
+		drop_block();
+
+	free(history->blocks);
+	free(history->segments);
+	free(history->recent);
+	pthread_mutex_destroy(&history->lock);
+	free(history);
+	history = session->history = NULL;
+}
+
+// Saves a line that is about to scroll off the screen.
+void
+push_history(const struct line *line)
+{
+	if (!history_budget)
+		return;
+
+	if (!history->recent || history->recent_width != term->width)
+		resize_recent();
+
+	if (history->recent_count == history->recent_capacity)
+		pack_recent(history->recent_count < BLOCK_LINES ?
+			history->recent_count : BLOCK_LINES);
+
+	memcpy(recent_line(history->recent_count), line,
+		LINE_SIZE(history->recent_width));
+	history->recent_count++;
+	history->total++;
+}
+
+// Returns the number the next line pushed will get. The screen's lines follow
+// on from the history, so row y is line history_end() + y.
+long
+history_end()
+{
+	return history->total;
+}
+
+long
+history_size()
+{
+	return history->total - (history->block_count ?
+		block_at(history, 0)->first :
+		history->total - history->recent_count);
+}
+
+// Copies the line n lines back from the newest one, which is line 1, into
+// line, cutting it off or filling it out with blanks to the screen width.
+void
+history_line(long n, struct line *line)
+{
+	const struct line *saved;
+	struct block *block;
+	long number;
+	int i, width;
+
+	memset(line, 0, LINE_SIZE(term->width));
+	number = history->total - n;
+
+	if (number >= history->total - history->recent_count) {
+		saved = recent_line(history->recent_count - n);
+		width = history->recent_width < term->width ?
+			history->recent_width : term->width;
+		line->dimensions = saved->dimensions;
+		memcpy(line->cells, saved->cells, width * sizeof(struct cell));
+	} else if ((block = find_block(history, number))) {
+		i = number - block->first;
+		unpack_line(block, &block->data[block->offsets[i]], line);
+	}
+}
+
+// Hands check the code points of every recent line, newest first, and returns
+// the number of the oldest, which is where search_history() carries on from.
+long
+search_recent(void (*check)(long, const uint32_t *, int))
+{
+	const struct line *saved;
+	uint32_t *code_points;
+	int i, x;
+
+	if (!history->recent_count)
+		return history->total;
+
+	if (!(code_points = malloc(history->recent_width * sizeof(uint32_t))))
+		pdie("failed to allocate search memory");
+
+	for (i = history->recent_count - 1; i >= 0; i--) {
+		saved = recent_line(i);
+
+		for (x = 0; x < history->recent_width; x++)
+			code_points[x] = saved->cells[x].code_point;
+
+		check(history->total - history->recent_count + i, code_points,
+			history->recent_width);
+	}
+
+	free(code_points);
+	return history->total - history->recent_count;
+}
+
+// Hands check the code points of the lines numbered below before in the newest
+// block holding any, newest first and filled out to their width with zeros,
+// leaving out lines that cannot hold the query. Returns the number of the
+// oldest line in the block, which is what to pass next time, or -1 once there
+// are no blocks left. The search thread calls this, so it only touches the
+// blocks of the history it is given.
+long
+search_history(struct history *h, const uint32_t *query, int length,
+	long before, void (*check)(long, const uint32_t *, int))
+{
+	unsigned char needle[64], *end;
+	const unsigned char *p, *stop;
+	struct block *block;
+	uint32_t *code_points, width, used, x;
+	int i, start, run, longest, n;
+	long oldest;
+
+	pthread_mutex_lock(&h->lock);
+
+	if (!(block = find_block(h, before - 1))) {
+		pthread_mutex_unlock(&h->lock);
+		return -1;
+	}
+
+	oldest = block->first;
+
+	if (!block->filter)
+		make_filter(block);
+
+	if (!filter_passes(block->filter, query, length)) {
+		pthread_mutex_unlock(&h->lock);
+		return oldest;
+	}
+
+	// Lines are only decoded if the longest part of the query with no
+	// spaces in it, written the way code points are packed, turns up.
+	for (longest = run = 0, start = i = 0; i < length; i++)
+		if (query[i] == 0x20)
+			run = 0;
+		else if (++run > longest)
+			start = i + 1 - (longest = run);
+
+	if (longest > (int)sizeof(needle) / 5)
+		longest = sizeof(needle) / 5;
+
+	for (end = needle, i = 0; i < longest; i++)
+		end = put_number(end, query[start + i]);
+
+	code_points = NULL;
+	stop = (const unsigned char *)block->offsets + block->size;
+
+	for (n = before - block->first - 1; n >= 0; n--) {
+		p = &block->data[block->offsets[n]];
+
+		if (end > needle && !memmem(p, (n + 1 < block->count ?
+			&block->data[block->offsets[n + 1]] : stop) - p,
+			needle, end - needle))
+			continue;
+
+		p++;
+		width = get_number(&p);
+		used = get_number(&p);
+
+		if (!(code_points = realloc(code_points,
+			width * sizeof(uint32_t))))
+			pdie("failed to allocate search memory");
+
+		for (x = 0; x < used; x++)
+			code_points[x] = get_number(&p);
+
+		memset(&code_points[used], 0, (width - used) * sizeof(uint32_t));
+		check(block->first + n, code_points, width);
+	}
+
+	free(code_points);
+	pthread_mutex_unlock(&h->lock);
+	return oldest;
+}
+
+// Marks the styles of the recent lines as used, for collect_styles(). Packed
+// lines keep their own copies.
+void
+mark_history_styles(bool *used)
+{
+	struct line *line;
+	int i, x;
+
+	for (i = 0; i < history->recent_count; i++)
+		for (line = recent_line(i), x = 0; x < history->recent_width;
+			x++)
+			used[line->cells[x].style] = true;
+}
+
+// Packs away whatever is in the ring and makes a new one for lines as wide as
+// the screen is now.
+static void
+resize_recent()
+{
+	size_t size;
+	int capacity;
+
+	while (history->recent_count)
+		pack_recent(history->recent_count < BLOCK_LINES ?
+			history->recent_count : BLOCK_LINES);
+
+	history->memory_used -= history->recent_capacity *
+		LINE_SIZE(history->recent_width);
+	free(history->recent);
+
+	size = LINE_SIZE(term->width);
+	capacity = history_budget / 4 / size;
+
+	if (capacity > RECENT_LINES) capacity = RECENT_LINES;
+	if (capacity < 1) capacity = 1;
+
+	if (!(history->recent = malloc(capacity * size)))
+		pdie("failed to allocate history memory");
+
+	history->recent_width = term->width;
+	history->recent_capacity = capacity;
+	history->recent_first = 0;
+	history->memory_used += capacity * size;
+}
+
+// Returns the ith line of the ring, counting from the oldest.
+static struct line *
+recent_line(int i)
+{
+	return (struct line *)&history->recent[(history->recent_first + i) %
+		history->recent_capacity * LINE_SIZE(history->recent_width)];
+}
+
+// Packs the oldest count lines of the ring into a new block.
+static void
+pack_recent(int count)
+{
+	static unsigned char *buffer;
+	static size_t buffer_size;
+	uint32_t offsets[BLOCK_LINES];
+	struct block *block;
+	unsigned char *end;
+	size_t size;
+	int i;
+
+	// The worst case is five bytes for every number.
+	size = count * (16 + history->recent_width * 15);
+
+	if (size > buffer_size) {
+		if (!(buffer = realloc(buffer, size)))
+			pdie("failed to allocate history memory");
+
+		buffer_size = size;
+	}
+
+	start_numbering(&block_styles);
+
+	for (end = buffer, i = 0; i < count; i++) {
+		offsets[i] = end - buffer;
+		end = pack_line(end, recent_line(i), history->recent_width);
+	}
+
+	size = end - buffer;
+
+	if (!(block = malloc(sizeof(struct block))))
+		pdie("failed to allocate history memory");
+
+	block->first = history->total - history->recent_count;
+	block->filter = NULL;
+	block->count = count;
+	block->style_count = block_styles.count;
+	block->size = count * sizeof(uint32_t) +
+		block_styles.count * sizeof(struct style) + size;
+
+	if (!(block->image = malloc(block->size)))
+		pdie("failed to allocate history memory");
+
+	memcpy(block->image, offsets, count * sizeof(uint32_t));
+	memcpy(&block->image[count * sizeof(uint32_t)], block_styles.styles,
+		block_styles.count * sizeof(struct style));
+	memcpy(&block->image[block->size - size], buffer, size);
+	locate_block(block, block->image);
+
+	history->recent_first = (history->recent_first + count) %
+		history->recent_capacity;
+	history->recent_count -= count;
+	add_block(block);
+}
+
+// Appends a block and frees the oldest ones until the budget is kept.
+static void
+add_block(struct block *block)
+{
+	struct block **array;
+	int capacity, i;
+
+	pthread_mutex_lock(&history->lock);
+
+	if (history->block_count == history->block_capacity) {
+		capacity = history->block_capacity ?
+			history->block_capacity * 2 : 64;
+
+		if (!(array = malloc(capacity * sizeof(*array))))
+			pdie("failed to allocate history memory");
+
+		for (i = 0; i < history->block_count; i++)
+			array[i] = block_at(history, i);
+
+		free(history->blocks);
+		history->blocks = array;
+		history->block_capacity = capacity;
+		history->block_first = 0;
+	}
+
+	history->blocks[(history->block_first + history->block_count++) %
+		history->block_capacity] = block;
+	history->memory_used += sizeof(struct block) + block->size;
+
+	// Spilled blocks still take up a little memory, so once none are left
+	// in memory the oldest are freed after all.
+	while (history->block_count && history->memory_used > history_budget)
+		if (history->spilled_count == history->block_count ||
+			!spill_block(block_at(history, history->spilled_count)))
+			drop_block();
+
+	release_segments();
+	pthread_mutex_unlock(&history->lock);
+}
+
+// Frees the oldest block.
+static void
+drop_block()
+{
+	struct block *block;
+
+	block = block_at(history, 0);
+	history->memory_used -= sizeof(struct block);
+
+	if (block->image) {
+		history->memory_used -= block->size;
+		free(block->image);
+	} else {
+		history->spilled_count--;
+	}
+
+	free(block->filter);
+	free(block);
+	history->block_first = (history->block_first + 1) %
+		history->block_capacity;
+	history->block_count--;
+}
+
+// Moves the image of a block out to the newest segment. Returns false if
+// spilling is off or the block could not be written.
+static bool
+spill_block(struct block *block)
+{
+	struct segment *segment;
+	size_t position;
+
+	if (!spill_budget || history->spill_failed ||
+		block->size > SEGMENT_SIZE)
+		return false;
+
+	// Images are kept aligned for their offsets.
+	position = history->segment_count ?
+		(history->segments[history->segment_count - 1].size + 7) &
+		~(size_t)7 : 0;
+
+	if (!history->segment_count || position + block->size > SEGMENT_SIZE) {
+		if (!add_segment())
+			return false;
+
+		position = 0;
+	}
+
+	segment = &history->segments[history->segment_count - 1];
+
+	if (pwrite(segment->fd, block->image, block->size, position) !=
+		(ssize_t)block->size) {
+		warn("failed to write history segment; no longer spilling");
+		history->spill_failed = true;
+		return false;
+	}
+
+	segment->size = position + block->size;
+	block->segment = segment->number;
+	block->position = position;
+	locate_block(block, &segment->map[position]);
+	free(block->image);
+	block->image = NULL;
+	history->memory_used -= block->size;
+	history->spilled_count++;
+	return true;
+}
+
+// Starts a new segment file, deleting the oldest one if there are too many.
+static bool
+add_segment()
+{
+	struct segment *segment;
+	const char *directory;
+	char *path;
+	int limit;
+
+	limit = spill_budget / SEGMENT_SIZE;
+
+	if (limit < 2)
+		limit = 2;
+
+	while (history->segment_count >= limit)
+		drop_segment();
+
+	if (!(history->segments = realloc(history->segments,
+		(history->segment_count + 1) * sizeof(struct segment))))
+		pdie("failed to allocate history memory");
+
+	segment = &history->segments[history->segment_count];
+
+	if (!(directory = getenv("XDG_RUNTIME_DIR")) && !(directory =
+		getenv("TMPDIR")))
+		directory = "/tmp";
+
+	if (!(path = malloc(strlen(directory) + sizeof(SEGMENT_NAME))))
+		pdie("failed to allocate history memory");
+
+	sprintf(path, "%s" SEGMENT_NAME, directory);
+
+	if ((segment->fd = mkstemp(path)) < 0) {
+		warn("failed to create history segment; no longer spilling");
+		free(path);
+		history->spill_failed = true;
+		return false;
+	}
+
+	// The file lives on only as long as it is open.
+	unlink(path);
+	free(path);
+
+	// Mapping past the end of the file is fine as long as nothing past it
+	// is read, and nothing is until it has been written.
+	if ((segment->map = mmap(NULL, SEGMENT_SIZE, PROT_READ, MAP_SHARED,
+		segment->fd, 0)) == MAP_FAILED) {
+		warn("failed to map history segment; no longer spilling");
+		close(segment->fd);
+		history->spill_failed = true;
+		return false;
+	}
+
+	segment->number = history->segment_number++;
+	segment->size = 0;
+	history->segment_count++;
+	return true;
+}
+
+// Deletes the oldest segment along with the blocks in it.
+static void
+drop_segment()
+{
+	struct segment *segment;
+
+	segment = &history->segments[0];
+
+	while (history->spilled_count &&
+		block_at(history, 0)->segment == segment->number)
+		drop_block();
+
+	munmap(segment->map, SEGMENT_SIZE);
+	close(segment->fd);
+	memmove(&history->segments[0], &history->segments[1],
+		--history->segment_count * sizeof(struct segment));
+}
+
+// Deletes the oldest segments while none of their blocks are left, but keeps
+// the newest one if blocks are still being spilled into it.
+static void
+release_segments()
+{
+	int keep;
+
+	keep = spill_budget && !history->spill_failed;
+
+	while (history->segment_count > keep && (!history->spilled_count ||
+		block_at(history, 0)->segment != history->segments[0].number))
+		drop_segment();
+}
+
+// Points the parts of a block at an image of it.
+static void
+locate_block(struct block *block, const unsigned char *image)
+{
+	block->offsets = (const uint32_t *)image;
+	block->styles = (const struct style *)&image[block->count *
+		sizeof(uint32_t)];
+	block->data = &image[block->count * sizeof(uint32_t) +
+		block->style_count * sizeof(struct style)];
+}
+
+static struct block *
+block_at(const struct history *h, int i)
+{
+	return h->blocks[(h->block_first + i) % h->block_capacity];
+}
+
+// Returns the block holding the line with the given number, if one does.
+static struct block *
+find_block(const struct history *h, long number)
+{
+	struct block *block;
+	int low, high, middle;
+
+	low = 0;
+	high = h->block_count - 1;
+
+	while (low <= high) {
+		middle = (low + high) / 2;
+		block = block_at(h, middle);
+
+		if (number < block->first)
+			high = middle - 1;
+		else if (number >= block->first + block->count)
+			low = middle + 1;
+		else
+			return block;
+	}
+
+	return NULL;
+}
+
+static unsigned char *
+pack_line(unsigned char *p, const struct line *line, int width)
+{
+	static uint16_t run_lengths[UINT16_MAX], run_styles[UINT16_MAX];
+	const struct cell *cells;
+	int used, x, start, runs;
+
+	cells = line->cells;
+
+	// Most lines end in a long stretch of blanks, so skip it a chunk at a
+	// time first. Erased cells are all zero bytes, and cells that only look
+	// different because of their padding are just kept.
+	for (used = width; used >= BLANK_CHUNK; used -= BLANK_CHUNK)
+		if (memcmp(&cells[used - BLANK_CHUNK], blank_chunk,
+			sizeof(blank_chunk)))
+			break;
+
+	for (; used; used--)
+		if (cells[used - 1].code_point || cells[used - 1].style)
+			break;
+
+	*p++ = line->dimensions;
+	p = put_number(p, width);
+	p = put_number(p, used);
+
+	// Runs are collected while the code points are written and added after.
+	for (runs = 0, start = 0, x = 0; x < used; x++) {
+		if (cells[x].code_point < 0x80)
+			*p++ = cells[x].code_point;
+		else
+			p = put_number(p, cells[x].code_point);
+
+		if (x + 1 == used || cells[x + 1].style != cells[start].style) {
+			run_lengths[runs] = x + 1 - start;
+			run_styles[runs++] = number_style(&block_styles,
+				cells[start].style);
+			start = x + 1;
+		}
+	}
+
+	for (x = 0; x < runs; x++) {
+		p = put_number(p, run_lengths[x]);
+		p = put_number(p, run_styles[x]);
+	}
+
+	*p++ = 0;
+	return p;
+}
+
+static void
+unpack_line(const struct block *block, const unsigned char *p,
+	struct line *line)
+{
+	uint32_t length, used, x;
+	uint16_t style;
+
+	line->dimensions = *p++;
+	get_number(&p);
+	used = get_number(&p);
+
+	for (x = 0; x < used; x++) {
+		if (x < (uint32_t)term->width) {
+			line->cells[x].code_point = get_number(&p);
+			line->cells[x].wide =
+				char_width(line->cells[x].code_point) == 2;
+		} else {
+			get_number(&p);
+		}
+	}
+
+	for (x = 0; (length = get_number(&p)); ) {
+		style = intern_style(&block->styles[get_number(&p)]);
+
+		for (; length; length--, x++)
+			if (x < (uint32_t)term->width)
+				line->cells[x].style = style;
+	}
+}
+
+// Blanks are left as they are, since searches skip pairs with spaces.
+static void
+make_filter(struct block *block)
+{
+	const unsigned char *p;
+	uint32_t used, x, previous, code_point;
+	int i;
+
+	if (!(block->filter = calloc(FILTER_WORDS, sizeof(uint64_t))))
+		pdie("failed to allocate search memory");
+
+	for (i = 0; i < block->count; i++) {
+		p = &block->data[block->offsets[i]] + 1;
+		get_number(&p);
+		used = get_number(&p);
+
+		for (previous = 0, x = 0; x < used; x++) {
+			code_point = get_number(&p);
+
+			if (x)
+				set_pair(block->filter, previous, code_point);
+
+			previous = code_point;
+		}
+	}
+}
+
+// Returns whether a block with the given filter might hold the query.
+static bool
+filter_passes(const uint64_t *filter, const uint32_t *query, int length)
+{
+	uint32_t bit;
+	int i;
+
+	// A space in the query might be a blank in the block, so pairs with
+	// spaces in them are not looked for.
+	for (i = 1; i < length; i++) {
+		if (query[i - 1] == 0x20 || query[i] == 0x20)
+			continue;
+
+		bit = pair_bit(query[i - 1], query[i]);
+
+		if (!(filter[bit / 64] & (uint64_t)1 << bit % 64))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+set_pair(uint64_t *filter, uint32_t first, uint32_t second)
+{
+	uint32_t bit;
+
+	bit = pair_bit(first, second);
+	filter[bit / 64] |= (uint64_t)1 << bit % 64;
+}
+
+static uint32_t
+pair_bit(uint32_t first, uint32_t second)
+{
+	return (first * 37 + second) % (FILTER_WORDS * 64);
+}
@@ -13,18 +13,79 @@
 // ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+#define _GNU_SOURCE // pipe2
 #include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
 #include "terminix.h"
 
+// OpenGL ES 3.0 names that GLES2/gl2.h does not have
+#define GL_PIXEL_UNPACK_BUFFER		0x88EC
+#define GL_MAP_WRITE_BIT		0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT	0x0008
+#define GL_PROGRAM_BINARY_LENGTH_OES	0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS_OES 0x87FE
+
+// From EGL_MESA_platform_surfaceless and EGL_KHR_partial_update, which
+// EGL/egl.h does not have
+#define EGL_PLATFORM_SURFACELESS_MESA	0x31DD
+#define EGL_BUFFER_AGE_KHR		0x313D
+
+// How many frames back the rows each one changed are remembered, which is as
+// old a back buffer as can be brought up to date without drawing all of it.
+#define DAMAGE_FRAMES 4
+
+// The glyph atlas is a grid of 16x16 slots. Slot 0 stays blank and the
+// decorations drawn over glyphs are kept in the slots after it.
+#define ATLAS_COLUMNS 128
+#define ATLAS_SIZE (ATLAS_COLUMNS * 16)
+#define ATLAS_SLOTS (ATLAS_COLUMNS * ATLAS_COLUMNS)
+#define ATLAS_HASH_SIZE (ATLAS_SLOTS * 2)
+enum { SLOT_BLANK, SLOT_UNDERLINE, SLOT_CROSSED_OUT, SLOT_OVERLINE, SLOT_FIRST };
+
+// Bits of struct instance's flags; the lowest two are the line dimensions.
+enum {
+	CELL_WIDE	= 1 <<  2, // Glyph covers this cell and the next.
+	CELL_HIDDEN	= 1 <<  3, // Covered by the double-width glyph before it.
+	CELL_BOLD	= 1 <<  4,
+	CELL_FAINT	= 1 <<  5,
+	CELL_UNDERLINE	= 1 <<  6, // Single underline; with the next, double.
+	CELL_UNDERLINE2	= 1 <<  7,
+	CELL_CROSSED_OUT= 1 <<  8,
+	CELL_OVERLINE	= 1 <<  9,
+	CELL_BLINK_SLOW	= 1 << 10,
+	CELL_BLINK_FAST	= 1 << 11,
+	CELL_CURSOR	= 1 << 12,
+	CELL_SPAN	= 1 << 13  // Background of as many blanks as slot says.
+};
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+// Number of pixel buffer objects uploads rotate through so that filling one
+// does not have to wait for the GPU to finish reading the last.
+#define PBO_COUNT 3
+
+// The glow is a blur of the lit pixels at half the size of the window, spread
+// out by GLOW_SIGMA of its pixels and cut off after GLOW_TAPS on either side.
+#define GLOW_SIGMA 2.0
+#define GLOW_TAPS 7
+
 static const char *vertex_shader =
 	"#version 300 es\n"
 	"\n"
-	"in  vec2 vertex;\n"
-	"in  vec2 texcoords_in;\n"
+	"layout(location = 0) in vec2 vertex;\n"
+	"layout(location = 1) in vec2 texcoords_in;\n"
 	"out vec2 texcoords;\n"
 	"\n"
 	"void main() {\n"
@@ -32,12 +93,14 @@ static const char *vertex_shader =
 	"	texcoords = texcoords_in;\n"
 	"}\n";
 
-// TODO : _amount_ of glow, static, and glow line
+// Draws the frame to the window, adding the glow and the other effects to it.
+// TODO : _amount_ of static and glow line
 static const char *fragment_shader =
 	"#version 300 es\n"
 	"\n"
 	"precision mediump   float;\n"
 	"uniform   sampler2D image;\n"
+	"uniform   sampler2D glow_image;\n"
 	"uniform   float     time;\n"
 	"uniform   float     opacity;\n"
 	"uniform   float     glow;\n"
@@ -47,24 +110,7 @@ static const char *fragment_shader =
 	"in        vec2      texcoords;\n"
 	"out       vec4      fragment_color;\n"
 	"\n"
-	"float gaussian_weight(float i) {\n"
-	"	return exp(-i * i / (2.0 * glow * glow)) * (1.0 / 2.5066282746310002 * glow);\n"
-	"}\n"
-	"\n"
-	"vec3 gaussian_blur(vec3 source) {\n"
-	"	float step = 1.0 / float(textureSize(image, 0).x);\n"
-	"	for (float i = 1.0; i < 32.0; i++) {\n"
-	"		float weight = gaussian_weight(i);\n"
-	"		vec4 color = texture(image, texcoords + vec2(step * i, 0.0));\n"
-	"		if (color.a == 1.0) source += color.rgb * weight;\n"
-	"		color = texture(image, texcoords - vec2(step * i, 0.0));\n"
-	"		if (color.a == 1.0) source += color.rgb * weight;\n"
-	"	}\n"
-	"	return source;\n"
-	"}\n"
-	"\n"
 	"vec3 noisify(vec3 source) {\n"
-	"	if (static_ == 0.0) return source;\n"
 	"	return source * (1.0 + fract(sin(texcoords.x * texcoords.y * time) * 42000.0));\n"
 	"}\n"
 	"\n"
@@ -78,49 +124,556 @@ static const char *fragment_shader =
 	"void main() {\n"
 	"	vec4 source = texture(image, texcoords);\n"
 	"	vec3 result = source.rgb;\n"
-	"	if (glow      != 0.0) result = gaussian_blur(result);\n"
+	"	if (glow      != 0.0) result += texture(glow_image, texcoords).rgb * glow;\n"
 	"	if (static_   != 0.0) result = noisify(result);\n"
 	"	if (glow_line != 0.0) result = scanning_artifact(result);\n"
 	"	fragment_color = vec4(result, source.a == 0.0 ? opacity : 1.0);\n"
 	"}\n";
 
+// The glow is worked out in three passes over textures half the size of the
+// window: the lit pixels of the frame are averaged down into one, which is then
+// blurred across into the other and back down into the first. Each pass draws
+// one fragment per pixel of the texture it draws into, so gl_FragCoord gives
+// the pixel, and the rows stay in the same order as the frame's.
+static const char *shrink_shader =
+	"#version 300 es\n"
+	"\n"
+	"precision mediump   float;\n"
+	"uniform   sampler2D image;\n"
+	"out       vec4      fragment_color;\n"
+	"\n"
+	"vec3 lit(ivec2 p) {\n"
+	"	vec4 color = texelFetch(image, min(p, textureSize(image, 0) - 1), 0);\n"
+	"	return color.a == 1.0 ? color.rgb : vec3(0.0);\n"
+	"}\n"
+	"\n"
+	"void main() {\n"
+	"	ivec2 p = ivec2(gl_FragCoord.xy) * 2;\n"
+	"	fragment_color = vec4((lit(p) + lit(p + ivec2(1, 0)) +\n"
+	"		lit(p + ivec2(0, 1)) + lit(p + ivec2(1, 1))) / 4.0, 1.0);\n"
+	"}\n";
+
+static const char *blur_shader =
+	"#version 300 es\n"
+	"\n"
+	"precision mediump   float;\n"
+	"uniform   sampler2D image;\n"
+	"uniform   ivec2     direction;\n"
+	"uniform   float     weights[" XSTR(GLOW_TAPS) "];\n"
+	"out       vec4      fragment_color;\n"
+	"\n"
+	"vec3 tap(ivec2 p) {\n"
+	"	ivec2 size = textureSize(image, 0);\n"
+	"	if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))\n"
+	"		return vec3(0.0);\n"
+	"	return texelFetch(image, p, 0).rgb;\n"
+	"}\n"
+	"\n"
+	"void main() {\n"
+	"	ivec2 p = ivec2(gl_FragCoord.xy);\n"
+	"	vec3 sum = tap(p) * weights[0];\n"
+	"	for (int i = 1; i < " XSTR(GLOW_TAPS) "; i++)\n"
+	"		sum += (tap(p + direction * i) + tap(p - direction * i)) * weights[i];\n"
+	"	fragment_color = vec4(sum, 1.0);\n"
+	"}\n";
+
+// The instanced renderer draws one quad per cell, or per run of blanks,
+// straight into the texture the effects shader reads. Everything a cell needs
+// is in its instance record, and the shader does the work render_cell() and
+// render_glyph() do on the CPU.
+static const char *cell_vertex_shader =
+	"#version 300 es\n"
+	"\n"
+	"uniform vec2 window;\n"
+	"layout(location = 0) in vec2 corner;\n"
+	"layout(location = 1) in vec4 cell;\n"
+	"layout(location = 2) in vec4 fg_in;\n"
+	"layout(location = 3) in vec4 bg_in;\n"
+	"out vec2 local;\n"
+	"flat out vec4 fg, bg;\n"
+	"flat out int slot, flags;\n"
+	"\n"
+	"void main() {\n"
+	"	flags = int(cell.w);\n"
+	"	float sx = (flags & 3) != 0 ? 2.0 : 1.0;\n"
+	"	vec2 size = vec2(8.0 * sx * ((flags & 4) != 0 ? 2.0 : 1.0), 16.0);\n"
+	"	if ((flags & 8) != 0) size = (flags & 4096) != 0 ? vec2(8.0 * sx, 16.0) : vec2(0.0);\n"
+	"	if ((flags & 8192) != 0) size.x *= cell.z;\n"
+	"	local = corner * size;\n"
+	"	vec2 position = vec2(cell.x * 8.0 * sx, cell.y * 16.0) + local;\n"
+	"	gl_Position = vec4(position / window * 2.0 - 1.0, 0.0, 1.0);\n"
+	"	fg = fg_in;\n"
+	"	bg = bg_in;\n"
+	"	slot = int(cell.z);\n"
+	"}\n";
+
+static const char *cell_fragment_shader =
+	"#version 300 es\n"
+	"\n"
+	"precision highp     float;\n"
+	"uniform   sampler2D atlas;\n"
+	"uniform   int       blink;\n"
+	"uniform   vec3      cursor_color;\n"
+	"uniform   vec3      background;\n"
+	"in        vec2      local;\n"
+	"flat in   vec4      fg, bg;\n"
+	"flat in   int       slot, flags;\n"
+	"out       vec4      fragment_color;\n"
+	"\n"
+	"bool lit(int s, vec2 offset, int width) {\n"
+	"	int dim = flags & 3;\n"
+	"	vec2 scale = vec2(dim != 0 ? 2.0 : 1.0, dim >= 2 ? 2.0 : 1.0);\n"
+	"	ivec2 p = ivec2(floor((local + offset) / scale));\n"
+	"	int top = dim == 3 ? 8 : 0, bottom = dim == 2 ? 8 : 16;\n"
+	"	p.y += top;\n"
+	"	if (p.x < 0 || p.x >= width || p.y < top || p.y >= bottom) return false;\n"
+	"	ivec2 origin = ivec2(s % " XSTR(ATLAS_COLUMNS) ", s / "
+		XSTR(ATLAS_COLUMNS) ") * 16;\n"
+	"	return texelFetch(atlas, origin + p, 0).r > 0.5;\n"
+	"}\n"
+	"\n"
+	"bool decoration(int s, vec2 offset) {\n"
+	"	float half_ = (flags & 3) != 0 ? 16.0 : 8.0;\n"
+	"	if ((flags & 4) != 0 && local.x >= half_) offset.x -= half_;\n"
+	"	return lit(s, offset, 8);\n"
+	"}\n"
+	"\n"
+	"vec4 opaque_unless_background(vec3 color) {\n"
+	"	return vec4(color,\n"
+	"		all(lessThan(abs(color - background), vec3(0.5 / 255.0))) ? 0.0 : 1.0);\n"
+	"}\n"
+	"\n"
+	"void main() {\n"
+	"	bool cursor = (flags & 4096) != 0 && blink / 2 % 2 == 0;\n"
+	"	if ((flags & 8) != 0) {\n"
+	"		if (!cursor) discard;\n"
+	"		fragment_color = opaque_unless_background(cursor_color);\n"
+	"		return;\n"
+	"	}\n"
+	"	if ((flags & 8192) != 0) {\n"
+	"		fragment_color = opaque_unless_background(bg.rgb);\n"
+	"		return;\n"
+	"	}\n"
+	"	vec3 color = bg.rgb;\n"
+	"	int width = (flags & 4) != 0 ? 16 : 8;\n"
+	"	bool on = !((flags & 1024) != 0 && blink / 2 % 2 != 0) &&\n"
+	"		!((flags & 2048) != 0 && blink % 2 != 0);\n"
+	"	if (on && (lit(slot, vec2(0.0), width) ||\n"
+	"		((flags & 16) != 0 && lit(slot, vec2(-1.0, 0.0), width)) ||\n"
+	"		((flags & 64) != 0 && decoration(1, vec2(0.0))) ||\n"
+	"		((flags & 128) != 0 && decoration(1, vec2(0.0, 2.0))) ||\n"
+	"		((flags & 256) != 0 && decoration(2, vec2(0.0))) ||\n"
+	"		((flags & 512) != 0 && decoration(3, vec2(0.0)))))\n"
+	"		color = (flags & 32) != 0 ? floor(fg.rgb * 127.5) / 255.0 : fg.rgb;\n"
+	"	if (cursor && local.x < ((flags & 3) != 0 ? 16.0 : 8.0))\n"
+	"		color = cursor_color;\n"
+	"	fragment_color = opaque_unless_background(color);\n"
+	"}\n";
+
+struct instance {
+	uint16_t	column, row, slot, flags;
+	uint8_t		fg[4], bg[4];
+};
+
+// Every session's window has a view, which holds what the render thread keeps
+// from one of its frames to the next. gldraw() fills in frame on the main
+// thread and sets drawing, after which frame belongs to the render thread until
+// it clears drawing again, signals frame_done and wakes the main loop through
+// done_pipe. glclose() sets closing, and the render thread lets go of the
+// view's surface and objects and sets closed. Those, blinked, output_time and
+// key_time are only touched under frame_lock; output_time is when the oldest
+// output in frame was parsed and key_time when the key it echoes was pressed,
+// if any. Everything else belongs to the render thread, which makes surface
+// for window the first time it draws the view.
+struct view {
+	struct view	*next;
+	struct snapshot	 frame;
+	EGLNativeWindowType window;
+	EGLSurface	 surface;
+	int		 number;
+	bool		 drawing, closing, closed, blinked;
+	uint64_t	 output_time, key_time;
+
+	// Set once the render thread has made the view's objects.
+	bool		 ready, frame_blinks;
+	GLuint		 texture, pbos[PBO_COUNT];
+	int		 next_pbo, texture_width, texture_height;
+
+	// In low-latency mode, only the rows that changed are presented, if
+	// EGL has a way to say which. damage_top and damage_bottom are the band
+	// of rows of the window this frame changed and past_damage the bands
+	// of the frames before it, newest first.
+	int		 damage_top, damage_bottom;
+	int		 past_damage[DAMAGE_FRAMES][2];
+
+	// Without a window, frames are drawn into screen_texture, bound to unit
+	// 4, through screen_fbo instead, and read back from there into shots[0]
+	// to be written out. shots[1] holds the last frame written, if
+	// shot_kept is set, to compare against.
+	GLuint		 screen_texture, screen_fbo;
+	unsigned char	*shots[2];
+	long		 frames_written;
+	bool		 shot_kept;
+
+	// The glow is only worked out again once the frame it was made from
+	// changes. Its textures are bound to units 2 and 3, each with a
+	// framebuffer object of its own to draw into it.
+	GLuint		 glow_textures[2], glow_fbos[2];
+	int		 glow_width, glow_height;
+	bool		 glow_stale;
+
+	// State for the instanced renderer. The instance buffer has room for
+	// a record per cell of the screen in row-major order, and each line
+	// fills instance_counts of its records from the start of its row.
+	// Blanks take one record a run and covered cells none, so the rest are
+	// left out of the draw. Only damaged lines are rebuilt, unless the
+	// atlas was flushed since atlas_generation. It remembers where it put
+	// the cursor and which blink phase it drew, so that it can tell when
+	// those change.
+	GLuint		 cell_vao, instance_vbo, fbo;
+	struct instance	*instances;
+	int		*instance_counts;
+	int		 instance_columns, instance_rows, upload_first,
+			 upload_last, blink_phase;
+	unsigned long	 atlas_generation;
+	short		 cursor_x, cursor_y;
+	bool		 cursor_drawn;
+
+	// The software renderer's pixels.
+	struct canvas	 canvas;
+};
+
+// Frames are drawn on render_thread, which has the EGL context to itself and
+// takes the views with a frame to draw in turn. views, stopping and notified
+// are only touched under frame_lock. drawn is what the render thread counted
+// while drawing the frame in hand, and finished what it counted since glpoll()
+// last looked.
+static pthread_t render_thread;
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frame_done = PTHREAD_COND_INITIALIZER;
+static struct view *views;
+static bool started, stopping, notified;
+static int done_pipe[2];
+static struct frame_stats drawn, finished;
+
+// The view the render thread is drawing, and its frame.
+static struct view *view;
+static struct snapshot *frame;
+
+// The render thread connects EGL to native_display before anything else, so
+// that the windows can go up in the meantime. Without a window, every view
+// draws with the same pbuffer surface current, which only has to exist;
+// everything is drawn into screen_fbo then.
+static EGLNativeDisplayType native_display;
 static EGLDisplay egl_display;
+static EGLConfig egl_config;
 static EGLContext egl_context;
-static EGLSurface egl_surface;
-static GLuint vao, vbo, texture;
+static EGLSurface pbuffer, current_surface;
+static GLuint program, vao, vbo;
+static GLint time_uniform, opacity_uniform, glow_uniform, static_uniform,
+	glow_line_uniform, glow_line_speed_uniform;
+static bool shared_ready;
+
+static EGLBoolean (*swapBuffersWithDamage)(EGLDisplay, EGLSurface,
+	const EGLint *, EGLint);
+static EGLBoolean (*setDamageRegion)(EGLDisplay, EGLSurface, EGLint *, EGLint);
+
+static GLuint shrink_program, blur_program;
+static GLint blur_image_uniform, direction_uniform;
+
+// The instanced renderer's program and glyph atlas are shared by every view.
+// atlas_generation counts the times the atlas was flushed, which leaves the
+// slots every view's instances point at holding other glyphs, and
+// atlas_flushed is set if it was flushed during the frame in hand.
+static GLuint cell_program, corner_vbo, atlas;
+static GLint window_uniform, blink_uniform, cursor_color_uniform,
+	background_uniform;
+static int32_t atlas_keys[ATLAS_HASH_SIZE];
+static uint16_t atlas_values[ATLAS_HASH_SIZE], next_slot;
+static unsigned long atlas_generation;
+static bool atlas_flushed;
 
 static void (*genVertexArrays)(GLsizei, GLuint *);
 static void (*bindVertexArray)(GLuint);
-
-static void init_egl(EGLNativeDisplayType, EGLNativeWindowType);
+static void (*deleteVertexArrays)(GLsizei, const GLuint *);
+static void *(*mapBufferRange)(GLenum, GLintptr, GLsizeiptr, GLbitfield);
+static GLboolean (*unmapBuffer)(GLenum);
+static void (*vertexAttribDivisor)(GLuint, GLuint);
+static void (*drawArraysInstanced)(GLenum, GLint, GLsizei, GLsizei);
+static void (*getProgramBinary)(GLuint, GLsizei, GLsizei *, GLenum *, void *);
+static void (*programBinary)(GLuint, GLenum, const void *, GLint);
+
+static void init_egl(EGLNativeDisplayType);
+static EGLDisplay headless_display(void);
+static void free_view(struct view *);
+static void *render(void *);
+static struct view *next_view(void);
+static void make_current(EGLSurface);
+static void init_view(void);
+static void close_view(void);
+static void draw_frame(void);
+static void note_damage(int, int);
+static void limit_damage(void);
+static void swap(void);
+static bool frame_mode(long);
+static void damage_cells(int, int, int);
+static void damage_frame(void);
 static void init_gl(void);
 static void init_shaders(void);
+static void init_instancing(void);
+static void init_glow(void);
+static void init_program_cache(void);
+static GLuint link_program(const char *, const char *);
 static GLuint compile_shader(GLenum, const char *);
-static int render_cell(unsigned char *, int, int, char, struct cell *);
-static void render_glyph(unsigned char *, struct color, int, int, char, bool,
-	const unsigned char *);
-static void put_pixel(unsigned char *, int, int, struct color);
+static bool find_cached_program(char *, const char *, const char *);
+static GLuint load_program(const char *);
+static void save_program(GLuint, const char *);
+static void resize_texture(void);
+static void resize_screen(void);
+static void write_frame(void);
+static void resize_glow(void);
+static void draw_glow(void);
+static void draw_instances(void);
+static void resize_instances(void);
+static void shift_instances(void);
+static void build_line(int);
+static int style_flags(const struct style *);
+static void add_instance(int, int, int, int, struct color, struct color);
+static void draw_rows(void);
+static int glyph_slot(long);
+static void flush_atlas(void);
+static void load_glyph(int, const unsigned char *);
+static void upload(void);
+
+// Starts the render thread, which sets up what every session shares while the
+// windows are made. It makes the programs and the atlas once it has a surface
+// to make the context current with.
+void
+glinit(EGLNativeDisplayType display)
+{
+	native_display = display;
+
+	if (pipe2(done_pipe, O_CLOEXEC))
+		pdie("failed to create render pipe");
 
+	if ((errno = pthread_create(&render_thread, NULL, render, NULL)))
+		pdie("failed to start render thread");
+
+	started = true;
+}
+
+// Gives the current session a view, drawn into window, or into the pbuffer
+// when there is no window.
 void
-glinit(EGLNativeDisplayType display, EGLNativeWindowType window)
+glopen(EGLNativeWindowType window)
 {
-	init_egl(display, window);
-	init_gl();
-	init_shaders();
+	struct view *v;
+
+	if (!(v = calloc(1, sizeof(*v))))
+		pdie("failed to allocate view memory");
+
+	v->window = window;
+	v->surface = EGL_NO_SURFACE;
+	v->number = session->number;
+	session->view = v;
+
+	pthread_mutex_lock(&frame_lock);
+	v->next = views;
+	views = v;
+	pthread_mutex_unlock(&frame_lock);
+}
+
+// Has the render thread let go of the current session's view and frees it. The
+// window must not go away before this returns.
+void
+glclose()
+{
+	struct view *v, **p;
+
+	if (!(v = session->view))
+		return;
+
+	pthread_mutex_lock(&frame_lock);
+
+	// Once the render thread is stopped, or if it is exiting itself, there
+	// is nothing to wait for.
+	if (started && !pthread_equal(pthread_self(), render_thread)) {
+		v->closing = true;
+		pthread_cond_signal(&frame_ready);
+
+		while (!v->closed)
+			pthread_cond_wait(&frame_done, &frame_lock);
+	}
+
+	for (p = &views; *p != v; p = &(*p)->next)
+		;
+
+	*p = v->next;
+	pthread_mutex_unlock(&frame_lock);
+
+	free_view(v);
+	session->view = NULL;
+}
+
+// Waits for the frame being drawn, if any, and stops the render thread. This
+// has to happen before the windows go away.
+void
+glstop()
+{
+	if (!started || pthread_equal(pthread_self(), render_thread))
+		return;
+
+	pthread_mutex_lock(&frame_lock);
+	stopping = true;
+	pthread_cond_signal(&frame_ready);
+	pthread_mutex_unlock(&frame_lock);
+	pthread_join(render_thread, NULL);
+	started = false;
+}
+
+// Draws whatever is left to draw of the current session and waits for it, so
+// that a run without a window does not lose the last of the output when the
+// shell exits.
+void
+glflush()
+{
+	struct view *v;
+	int i;
+
+	if (!started || !(v = session->view) ||
+		pthread_equal(pthread_self(), render_thread))
+		return;
+
+	for (i = 0; i < 2; i++) {
+		pthread_mutex_lock(&frame_lock);
+
+		while (v->drawing)
+			pthread_cond_wait(&frame_done, &frame_lock);
+
+		pthread_mutex_unlock(&frame_lock);
+		glpoll();
+
+		if (i || !session->redraw || !gldraw())
+			break;
+	}
 }
 
 void
 glkill()
 {
+	glstop();
 	egl_display ? eglTerminate(egl_display) : 0;
 }
 
+void
+glprepare(struct pollfd *pfd)
+{
+	pfd->fd = started ? done_pipe[0] : -1;
+	pfd->events = POLLIN;
+}
+
+// Returns whether gldraw() would hand over a frame of the current session
+// right now.
+bool
+glidle()
+{
+	bool idle;
+
+	pthread_mutex_lock(&frame_lock);
+	idle = !session->view || !session->view->drawing;
+	pthread_mutex_unlock(&frame_lock);
+
+	return idle;
+}
+
+// Takes note of the last frames the render thread finished.
+void
+glpoll()
+{
+	struct session *s;
+	char byte;
+
+	pthread_mutex_lock(&frame_lock);
+
+	if (notified) {
+		if (read(done_pipe[0], &byte, 1) < 0)
+			pdie("failed to read render pipe");
+
+		notified = false;
+
+		for (s = sessions; s; s = s->next)
+			if (s->view && !s->view->drawing)
+				s->blinking = s->view->blinked;
+
+		count_frames(&finished);
+		memset(&finished, 0, sizeof(finished));
+	}
+
+	pthread_mutex_unlock(&frame_lock);
+}
+
+// Hands a snapshot of the current session's screen to the render thread,
+// unless it is still busy with the last one, in which case the damage is left
+// for the next call. Returns whether it did.
+bool
+gldraw()
+{
+	struct view *v;
+	bool busy;
+
+	if (!(v = session->view))
+		return false;
+
+	pthread_mutex_lock(&frame_lock);
+	busy = v->drawing;
+	pthread_mutex_unlock(&frame_lock);
+
+	if (busy)
+		return false;
+
+	prepare_hud();
+	take_snapshot(&v->frame);
+	draw_hud(&v->frame);
+	v->output_time = session->output_time;
+	session->output_time = 0;
+	v->key_time = session->echoed ? session->key_time : 0;
+
+	if (session->echoed)
+		session->key_time = 0;
+
+	session->echoed = false;
+	v->frame.window_width = session->window_width;
+	v->frame.window_height = session->window_height;
+	v->frame.timer_count = timer_count;
+	v->frame.time = current_time;
+	session->redraw = false;
+
+	pthread_mutex_lock(&frame_lock);
+	v->drawing = true;
+	pthread_cond_signal(&frame_ready);
+	pthread_mutex_unlock(&frame_lock);
+
+	return true;
+}
+
 static void
-init_egl(EGLNativeDisplayType display, EGLNativeWindowType window)
+init_egl(EGLNativeDisplayType display)
 {
-	static const EGLint cfg_attrs[] = {
+	static const EGLint ctx_attrs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 2,
+		EGL_NONE
+	};
+
+	static const EGLint pbuffer_attrs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
+		EGL_NONE
+	};
+
+	const EGLint cfg_attrs[] = {
 		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_SURFACE_TYPE, headless ? EGL_PBUFFER_BIT : EGL_WINDOW_BIT,
 		EGL_RED_SIZE, 8,
 		EGL_GREEN_SIZE, 8,
 		EGL_BLUE_SIZE, 8,
@@ -128,42 +681,93 @@ init_egl(EGLNativeDisplayType display, EGLNativeWindowType window)
 		EGL_NONE
 	};
 
-	static const EGLint ctx_attrs[] = {
-		EGL_CONTEXT_MAJOR_VERSION, 2,
-		EGL_NONE
-	};
-
-	EGLConfig config;
 	EGLint num_config;
+	const char *extensions;
 
-	if ((egl_display = eglGetDisplay(display)) == EGL_NO_DISPLAY)
+	if ((egl_display = headless ? headless_display() :
+		eglGetDisplay(display)) == EGL_NO_DISPLAY)
 		die("failed to get EGL display");
 
 	if (!eglInitialize(egl_display, NULL, NULL))
 		die("failed to initialize EGL");
 
-	if (!eglChooseConfig(egl_display, cfg_attrs, &config, 1, &num_config))
+	if (!eglChooseConfig(egl_display, cfg_attrs, &egl_config, 1,
+		&num_config))
 		die("failed to find compatible EGL configuration");
 
 	if (num_config != 1)
 		die("failed to find compatible EGL configuration: none found");
 
-	if ((egl_surface = eglCreateWindowSurface(egl_display, config, window, NULL)) == EGL_NO_SURFACE)
+	if (headless && (pbuffer = eglCreatePbufferSurface(egl_display,
+		egl_config, pbuffer_attrs)) == EGL_NO_SURFACE)
 		die("failed to create EGL surface");
 
-	if ((egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, ctx_attrs)) == EGL_NO_CONTEXT)
+	if ((egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, ctx_attrs)) == EGL_NO_CONTEXT)
 		die("failed to create EGL context");
 
-	if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
-		die("failed to make EGL context current");
-
 	if (!(genVertexArrays = (void *)eglGetProcAddress("glGenVertexArrays")))
 		die("required routine glGenVertexArrays not supported");
 
 	if (!(bindVertexArray = (void *)eglGetProcAddress("glBindVertexArray")))
 		die("required routine glBindVertexArray not supported");
+
+	if (!(deleteVertexArrays =
+		(void *)eglGetProcAddress("glDeleteVertexArrays")))
+		die("required routine glDeleteVertexArrays not supported");
+
+	// Without these we upload straight from the framebuffer instead.
+	mapBufferRange = (void *)eglGetProcAddress("glMapBufferRange");
+	unmapBuffer = (void *)eglGetProcAddress("glUnmapBuffer");
+
+	if (!low_latency || headless ||
+		!(extensions = eglQueryString(egl_display, EGL_EXTENSIONS)))
+		return;
+
+	if (strstr(extensions, "EGL_KHR_partial_update"))
+		setDamageRegion = (void *)eglGetProcAddress(
+			"eglSetDamageRegionKHR");
+
+	if (strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+		swapBuffersWithDamage = (void *)eglGetProcAddress(
+			"eglSwapBuffersWithDamageKHR");
+	else if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		swapBuffersWithDamage = (void *)eglGetProcAddress(
+			"eglSwapBuffersWithDamageEXT");
 }
 
+// Uses the surfaceless platform if EGL has it, so that no display server is
+// needed at all, and otherwise whatever display EGL picks by default.
+static EGLDisplay
+headless_display()
+{
+	EGLDisplay (*get_platform_display)(EGLenum, void *, const EGLint *);
+	const char *extensions;
+
+	extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+	if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless") &&
+		(get_platform_display =
+		(void *)eglGetProcAddress("eglGetPlatformDisplayEXT")))
+		return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+			EGL_DEFAULT_DISPLAY, NULL);
+
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+// Frees what the main thread can of a view the render thread is done with.
+static void
+free_view(struct view *v)
+{
+	deinit_canvas(&v->canvas);
+	deinit_snapshot(&v->frame);
+	free(v->instances);
+	free(v->instance_counts);
+	free(v->shots[0]);
+	free(v->shots[1]);
+	free(v);
+}
+
+// Makes the programs and buffers the views share. The context is current.
 static void
 init_gl()
 {
@@ -178,20 +782,152 @@ init_gl()
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+	init_program_cache();
+	init_shaders();
+
+	if (renderer == RENDERER_INSTANCED)
+		init_instancing();
+	else
+		init_raster();
+
+	if (glow)
+		init_glow();
+
+	shared_ready = true;
+}
+
+static void
+init_shaders()
+{
+	program = link_program(vertex_shader, fragment_shader);
+	time_uniform = glGetUniformLocation(program, "time");
+	opacity_uniform = glGetUniformLocation(program, "opacity");
+	glow_uniform = glGetUniformLocation(program, "glow");
+	static_uniform = glGetUniformLocation(program, "static_");
+	glow_line_uniform = glGetUniformLocation(program, "glow_line");
+	glow_line_speed_uniform =
+		glGetUniformLocation(program, "glow_line_speed");
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "glow_image"), 2);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+		4 * sizeof(GLfloat), NULL);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+		4 * sizeof(GLfloat), (void *)(2 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+}
+
+static void
+init_instancing()
+{
+	static const GLfloat corners[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+
+	unsigned char *blank;
+
+	if (!(vertexAttribDivisor = (void *)eglGetProcAddress("glVertexAttribDivisor")))
+		die("required routine glVertexAttribDivisor not supported");
+
+	if (!(drawArraysInstanced = (void *)eglGetProcAddress("glDrawArraysInstanced")))
+		die("required routine glDrawArraysInstanced not supported");
+
+	cell_program = link_program(cell_vertex_shader, cell_fragment_shader);
+	window_uniform = glGetUniformLocation(cell_program, "window");
+	blink_uniform = glGetUniformLocation(cell_program, "blink");
+	cursor_color_uniform = glGetUniformLocation(cell_program, "cursor_color");
+	background_uniform = glGetUniformLocation(cell_program, "background");
+	glUseProgram(cell_program);
+	glUniform1i(glGetUniformLocation(cell_program, "atlas"), 1);
+
+	glGenBuffers(1, &corner_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, corner_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+
+	// The atlas lives on texture unit 1 so the frame stays bound to 0.
+	if (!(blank = calloc(ATLAS_SIZE, ATLAS_SIZE)))
+		pdie("failed to allocate glyph atlas memory");
+
+	glActiveTexture(GL_TEXTURE1);
+	glGenTextures(1, &atlas);
+	glBindTexture(GL_TEXTURE_2D, atlas);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, ATLAS_SIZE, ATLAS_SIZE, 0,
+		GL_LUMINANCE, GL_UNSIGNED_BYTE, blank);
+	glActiveTexture(GL_TEXTURE0);
+	free(blank);
+	flush_atlas();
+	init_spans();
+
+	glUseProgram(program);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 }
 
+// Sets up the programs for the glow, which are left out entirely when there
+// isn't any.
 static void
-init_shaders()
+init_glow()
+{
+	GLfloat weights[GLOW_TAPS], sum;
+	int i;
+
+	shrink_program = link_program(vertex_shader, shrink_shader);
+	blur_program = link_program(vertex_shader, blur_shader);
+	blur_image_uniform = glGetUniformLocation(blur_program, "image");
+	direction_uniform = glGetUniformLocation(blur_program, "direction");
+
+	for (sum = 0, i = 0; i < GLOW_TAPS; i++) {
+		weights[i] = exp(-i * i / (2 * GLOW_SIGMA * GLOW_SIGMA));
+		sum += i ? weights[i] * 2 : weights[i];
+	}
+
+	for (i = 0; i < GLOW_TAPS; i++)
+		weights[i] /= sum;
+
+	glUseProgram(blur_program);
+	glUniform1fv(glGetUniformLocation(blur_program, "weights"), GLOW_TAPS,
+		weights);
+	glUseProgram(program);
+}
+
+// Looks for GL_OES_get_program_binary, without which every program is
+// compiled from source each time.
+static void
+init_program_cache()
+{
+	const char *extensions;
+	GLint formats;
+
+	if (!(extensions = (const char *)glGetString(GL_EXTENSIONS)) ||
+		!strstr(extensions, "GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+
+	if (formats < 1)
+		return;
+
+	getProgramBinary = (void *)eglGetProcAddress("glGetProgramBinaryOES");
+	programBinary = (void *)eglGetProcAddress("glProgramBinaryOES");
+}
+
+// Takes the program from the cache if an earlier run left it there, and
+// otherwise compiles it and leaves it there for the next run.
+static GLuint
+link_program(const char *vertex_source, const char *fragment_source)
 {
 	GLuint vertex, fragment, program;
 	GLint status;
+	char path[PATH_MAX];
+	bool cached;
 
-	vertex = compile_shader(GL_VERTEX_SHADER, vertex_shader);
-	fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_shader);
+	if ((cached = find_cached_program(path, vertex_source,
+		fragment_source)) && (program = load_program(path)))
+		return program;
+
+	vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+	fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
 
 	if (!(program = glCreateProgram()))
 		die("failed to create shader program");
@@ -204,16 +940,13 @@ init_shaders()
 	if (!status)
 		die("failed to link shader program");
 
-	glUseProgram(program);
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
 
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
-		4 * sizeof(GLfloat), NULL);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
-		4 * sizeof(GLfloat), (void *)(2 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
+	if (cached)
+		save_program(program, path);
+
+	return program;
 }
 
 static GLuint
@@ -238,149 +971,1110 @@ compile_shader(GLenum type, const char *source)
 	return shader;
 }
 
-void
-gldraw()
+// Works out where in $XDG_CACHE_HOME the program made from the given sources
+// by this driver would be cached, making the directory if need be, and returns
+// whether there is anywhere at all. The name is a 64-bit FNV-1a hash of the
+// driver's name and version and both sources. The driver refuses binaries that
+// a build other than its own wrote, so they are never trusted beyond that.
+static bool
+find_cached_program(char *path, const char *vertex_source,
+	const char *fragment_source)
 {
-	unsigned char buffer[window_width * window_height * 4];
-	int x, y;
-
-	for (y = screen_height - 1; y >= 0; y--)
-		for (x = 0; x < screen_width;)
-			x += render_cell(buffer,
-				x * CHARWIDTH * (lines[y]->dimensions ? 2 : 1),
-				y * CHARHEIGHT, lines[y]->dimensions,
-				&lines[y]->cells[x]);
-
-	if (getmode(DECTCEM) && !(timer_count / 2 % 2))
-		render_glyph(buffer, default_attrs.fg_truecolor ?
-			default_attrs.foreground : palette[default_attrs.foreground.r],
-			cursor.x * CHARWIDTH * (lines[cursor.y]->dimensions ? 2 : 1),
-			cursor.y * CHARHEIGHT, lines[cursor.y]->dimensions,
-			false, find_glyph(0x2588));
-
-	glUniform1f(1, current_time / 1000000000.0);
-	glUniform1f(2, opacity);
-	glUniform1f(3, glow);
-	glUniform1f(4, static_);
-	glUniform1f(5, glow_line);
-	glUniform1f(6, glow_line_speed);
-	glViewport(0, 0, window_width, window_height);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, window_width, window_height, 0,
-		GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	eglSwapBuffers(egl_display, egl_surface);
+	const char *strings[4], *directory, *p;
+	char parent[PATH_MAX];
+	uint64_t hash;
+	int i;
+
+	if (!getProgramBinary || !programBinary)
+		return false;
+
+	if ((directory = getenv("XDG_CACHE_HOME")) && *directory)
+		snprintf(parent, sizeof(parent), "%s", directory);
+	else if ((directory = getenv("HOME")) && *directory)
+		snprintf(parent, sizeof(parent), "%s/.cache", directory);
+	else
+		return false;
+
+	strings[0] = (const char *)glGetString(GL_RENDERER);
+	strings[1] = (const char *)glGetString(GL_VERSION);
+	strings[2] = vertex_source;
+	strings[3] = fragment_source;
+
+	for (hash = 14695981039346656037u, i = 0; i < 4; i++)
+		for (p = strings[i] ? strings[i] : ""; ; p++) {
+			hash = (hash ^ (unsigned char)*p) * 1099511628211u;
+
+			if (!*p)
+				break;
+		}
+
+	mkdir(parent, 0700);
+
+	if (snprintf(path, PATH_MAX, "%s/terminix", parent) >= PATH_MAX ||
+		(mkdir(path, 0700) && errno != EEXIST))
+		return false;
+
+	return snprintf(path, PATH_MAX, "%s/terminix/%016lx.bin", parent,
+		(unsigned long)hash) < PATH_MAX;
 }
 
-static int
-render_cell(unsigned char *buffer, int px, int py, char dim, struct cell *cell)
+// Makes a program from the binary at path, which starts with the format it is
+// in, or returns 0 if there is none or the driver will not take it.
+static GLuint
+load_program(const char *path)
 {
-	const unsigned char *glyph;
-	bool dbl;
-	struct color bg, fg, swap;
+	struct stat st;
+	GLenum format;
+	GLuint program;
+	GLint status;
+	void *binary;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size <= (off_t)sizeof(format) ||
+		!(binary = malloc(st.st_size))) {
+		close(fd);
+		return 0;
+	}
+
+	if (read(fd, binary, st.st_size) != st.st_size) {
+		free(binary);
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+	memcpy(&format, binary, sizeof(format));
+
+	if ((program = glCreateProgram())) {
+		programBinary(program, format, (char *)binary + sizeof(format),
+			st.st_size - sizeof(format));
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+		if (!status) {
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+
+	free(binary);
+	return program;
+}
+
+// Writes the program's binary to path, by way of a file renamed into place so
+// that another run loading it never sees half of one.
+static void
+save_program(GLuint program, const char *path)
+{
+	char temporary[PATH_MAX];
+	GLenum format;
+	GLsizei size;
+	GLint length;
+	void *binary;
+	bool saved;
+	int fd;
+
+	// A path too long to take the suffix is simply not cached.
+	if ((size_t)snprintf(temporary, sizeof(temporary), "%s.%ld", path,
+		(long)getpid()) >= sizeof(temporary))
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+
+	if (length < 1 || !(binary = malloc(sizeof(format) + length)))
+		return;
+
+	getProgramBinary(program, length, &size, &format,
+		(char *)binary + sizeof(format));
+	memcpy(binary, &format, sizeof(format));
+
+	if ((fd = open(temporary, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+		0600)) < 0) {
+		free(binary);
+		return;
+	}
 
-	glyph = find_glyph(cell->code_point ? cell->code_point : 0x20);
+	saved = size > 0 && write(fd, binary, sizeof(format) + size) ==
+		(ssize_t)(sizeof(format) + size);
+	saved = !close(fd) && saved;
 
-	dbl = glyph[0] == 2;
-	bg = cell->bg_truecolor ? cell->background : palette[cell->background.r];
-	fg = cell->fg_truecolor ? cell->foreground : palette[cell->foreground.r];
+	if (!saved || rename(temporary, path))
+		unlink(temporary);
 
-	if (getmode(DECSCNM) ^ cell->negative) {
-		swap = bg;
-		bg = fg;
-		fg = swap;
+	free(binary);
+}
+
+// Runs on the render thread.
+static void *
+render(void *unused __attribute__((unused)))
+{
+	char byte;
+
+	init_egl(native_display);
+	pthread_mutex_lock(&frame_lock);
+
+	for (;;) {
+		while (!stopping && !(view = next_view()))
+			pthread_cond_wait(&frame_ready, &frame_lock);
+
+		if (stopping)
+			break;
+
+		pthread_mutex_unlock(&frame_lock);
+		frame = &view->frame;
+
+		if (view->closing) {
+			close_view();
+			pthread_mutex_lock(&frame_lock);
+			view->drawing = false;
+			view->closed = true;
+			pthread_cond_broadcast(&frame_done);
+			continue;
+		}
+
+		if (view->surface == EGL_NO_SURFACE && (view->surface =
+			headless ? pbuffer : eglCreateWindowSurface(egl_display,
+			egl_config, view->window, NULL)) == EGL_NO_SURFACE)
+			die("failed to create EGL surface");
+
+		make_current(view->surface);
+
+		if (!shared_ready)
+			init_gl();
+
+		if (!view->ready)
+			init_view();
+
+		draw_frame();
+		pthread_mutex_lock(&frame_lock);
+
+		view->drawing = false;
+		view->blinked = view->frame_blinks;
+		finished.frames += drawn.frames;
+		finished.cells += drawn.cells;
+		finished.pixels += drawn.pixels;
+		finished.upload_bytes += drawn.upload_bytes;
+		finished.swap_time += drawn.swap_time;
+		finished.latency = drawn.latency;
+		finished.key_latency = drawn.key_latency;
+		pthread_cond_broadcast(&frame_done);
+
+		if (!notified) {
+			byte = 0;
+
+			if (write(done_pipe[1], &byte, 1) < 0)
+				pdie("failed to write render pipe");
+
+			notified = true;
+		}
+	}
+
+	pthread_mutex_unlock(&frame_lock);
+	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		EGL_NO_CONTEXT);
+
+	return NULL;
+}
+
+// Picks the next view with a frame to draw or that is closing, and moves it to
+// the end of the list, so that one busy session cannot keep the others from
+// being drawn. Called under frame_lock.
+static struct view *
+next_view()
+{
+	struct view **p, *v;
+
+	for (p = &views; *p && !(*p)->drawing && !((*p)->closing &&
+		!(*p)->closed); p = &(*p)->next)
+		;
+
+	if (!(v = *p))
+		return NULL;
+
+	*p = v->next;
+	v->next = NULL;
+
+	for (; *p; p = &(*p)->next)
+		;
+
+	*p = v;
+	return v;
+}
+
+static void
+make_current(EGLSurface surface)
+{
+	if (surface == current_surface)
+		return;
+
+	if (!eglMakeCurrent(egl_display, surface, surface, egl_context))
+		die("failed to make EGL context current");
+
+	current_surface = surface;
+}
+
+// Makes the textures and buffers a view draws with, which leaves them bound.
+static void
+init_view()
+{
+	int i;
+
+	// Swapping waits for the display to refresh, and the main thread keeps
+	// parsing into the next frame in the meantime. In low-latency mode a
+	// frame goes up as soon as it is drawn instead.
+	if (!headless && !eglSwapInterval(egl_display, low_latency ? 0 : 1))
+		warnx("failed to set EGL swap interval");
+
+	glGenTextures(1, &view->texture);
+	glBindTexture(GL_TEXTURE_2D, view->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	if (mapBufferRange && unmapBuffer)
+		glGenBuffers(PBO_COUNT, view->pbos);
+
+	if (renderer == RENDERER_INSTANCED) {
+		genVertexArrays(1, &view->cell_vao);
+		bindVertexArray(view->cell_vao);
+
+		glBindBuffer(GL_ARRAY_BUFFER, corner_vbo);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+		glEnableVertexAttribArray(0);
+
+		glGenBuffers(1, &view->instance_vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, view->instance_vbo);
+		glVertexAttribPointer(1, 4, GL_UNSIGNED_SHORT, GL_FALSE,
+			sizeof(struct instance),
+			(void *)offsetof(struct instance, column));
+		glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			sizeof(struct instance),
+			(void *)offsetof(struct instance, fg));
+		glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			sizeof(struct instance),
+			(void *)offsetof(struct instance, bg));
+		glEnableVertexAttribArray(1);
+		glEnableVertexAttribArray(2);
+		glEnableVertexAttribArray(3);
+		vertexAttribDivisor(1, 1);
+		vertexAttribDivisor(2, 1);
+		vertexAttribDivisor(3, 1);
+
+		glGenFramebuffers(1, &view->fbo);
+		bindVertexArray(vao);
+		view->atlas_generation = atlas_generation;
+	}
+
+	if (glow) {
+		glGenTextures(2, view->glow_textures);
+		glGenFramebuffers(2, view->glow_fbos);
+
+		for (i = 0; i < 2; i++) {
+			glActiveTexture(GL_TEXTURE2 + i);
+			glBindTexture(GL_TEXTURE_2D, view->glow_textures[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+		}
+
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	view->ready = true;
+}
+
+// Deletes the objects of a view that is closing and lets go of its surface,
+// which the main thread destroys the window of next.
+static void
+close_view()
+{
+	if (view->ready) {
+		make_current(view->surface);
+		glDeleteTextures(1, &view->texture);
+
+		if (view->pbos[0])
+			glDeleteBuffers(PBO_COUNT, view->pbos);
+
+		if (view->screen_fbo) {
+			glDeleteTextures(1, &view->screen_texture);
+			glDeleteFramebuffers(1, &view->screen_fbo);
+		}
+
+		if (view->glow_fbos[0]) {
+			glDeleteTextures(2, view->glow_textures);
+			glDeleteFramebuffers(2, view->glow_fbos);
+		}
+
+		if (view->cell_vao) {
+			deleteVertexArrays(1, &view->cell_vao);
+			glDeleteBuffers(1, &view->instance_vbo);
+			glDeleteFramebuffers(1, &view->fbo);
+		}
+	}
+
+	if (view->surface == EGL_NO_SURFACE)
+		return;
+
+	if (view->surface == current_surface) {
+		eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+		current_surface = EGL_NO_SURFACE;
+	}
+
+	if (view->surface != pbuffer)
+		eglDestroySurface(egl_display, view->surface);
+}
+
+static void
+draw_frame()
+{
+	uint64_t start;
+	int i;
+
+	memset(&drawn, 0, sizeof(drawn));
+	drawn.frames = 1;
+	view->damage_top = view->damage_bottom = 0;
+
+	// The units the view's textures are bound to were last bound by
+	// whichever view drew before it.
+	glBindTexture(GL_TEXTURE_2D, view->texture);
+
+	for (i = 0; glow && i < 2; i++) {
+		glActiveTexture(GL_TEXTURE2 + i);
+		glBindTexture(GL_TEXTURE_2D, view->glow_textures[i]);
 	}
 
-	render_glyph(buffer, bg, px, py, dim, dbl, find_glyph(0x2588));
+	glActiveTexture(GL_TEXTURE0);
 
-	if (cell->blink == BLINK_SLOW && timer_count / 2 % 2)
-		return glyph[0] == 1 ? 1 : 2;
+	if (view->texture_width != frame->window_width ||
+		view->texture_height != frame->window_height)
+		resize_texture();
 
-	if (cell->blink == BLINK_FAST && timer_count % 2)
-		return glyph[0] == 1 ? 1 : 2;
+	view->frame_blinks = false;
 
-	if (cell->intensity == INTENSITY_FAINT) {
-		fg.r /= 2;
-		fg.g /= 2;
-		fg.b /= 2;
+	if (renderer == RENDERER_INSTANCED) {
+		draw_instances();
+	} else {
+		view->frame_blinks = rasterize(&view->canvas, frame);
+		drawn.cells = cells_drawn;
+		drawn.pixels = pixels_drawn;
+		cells_drawn = pixels_drawn = 0;
+		upload();
 	}
 
-	render_glyph(buffer, fg, px, py, dim, false, glyph);
+	if (glow && view->glow_stale)
+		draw_glow();
+
+	// The effects cover everything, changed or not.
+	if (glow || static_ || glow_line)
+		note_damage(0, frame->window_height);
+
+	glUniform1f(time_uniform, frame->time / 1000000000.0);
+	glUniform1f(opacity_uniform, opacity);
+	glUniform1f(glow_uniform, glow);
+	glUniform1f(static_uniform, static_);
+	glUniform1f(glow_line_uniform, glow_line);
+	glUniform1f(glow_line_speed_uniform, glow_line_speed);
+	glBindFramebuffer(GL_FRAMEBUFFER, view->screen_fbo);
+	glViewport(0, 0, frame->window_width, frame->window_height);
+	limit_damage();
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDisable(GL_SCISSOR_TEST);
 
-	if (cell->intensity == INTENSITY_BOLD)
-		render_glyph(buffer, fg, px + 1, py, dim, false, glyph);
+	// Without a window, writing the frame out stands in for the swap.
+	start = monotonic_time();
 
-	if (cell->underline)
-		render_glyph(buffer, fg, px, py, dim, dbl, find_glyph(0x0332));
+	if (headless)
+		write_frame();
+	else
+		swap();
 
-	if (cell->underline == UNDERLINE_DOUBLE)
-		render_glyph(buffer, fg, px, py + 2, dim, dbl, find_glyph(0x0332));
+	drawn.swap_time = monotonic_time() - start;
 
-	if (cell->crossed_out)
-		render_glyph(buffer, fg, px, py, dim, dbl, find_glyph(0x2015));
+	if (view->output_time)
+		drawn.latency = monotonic_time() - view->output_time;
 
-	if (cell->overline)
-		render_glyph(buffer, fg, px, py, dim, dbl, find_glyph(0x0305));
+	if (view->key_time)
+		drawn.key_latency = monotonic_time() - view->key_time;
+}
 
-	return dbl ? 2 : 1;
+// Adds rows [top, bottom) of the window to what this frame changed.
+static void
+note_damage(int top, int bottom)
+{
+	if (view->damage_top >= view->damage_bottom) {
+		view->damage_top = top;
+		view->damage_bottom = bottom;
+	} else {
+		if (top < view->damage_top) view->damage_top = top;
+		if (bottom > view->damage_bottom) view->damage_bottom = bottom;
+	}
 }
 
+// Tells EGL which rows of the back buffer are about to be drawn, and keeps
+// drawing to those, if it can be told. The back buffer may be a few frames old,
+// so whatever changed since it was last shown has to be drawn again as well.
 static void
-render_glyph(unsigned char *buffer, struct color color, int px, int py,
-	char dim, bool double_wide_glyph, const unsigned char *glyph)
+limit_damage()
 {
-	int i, imax, j, rx, ry, rxmax;
+	EGLint rect[4], age;
+	int top, bottom, i, *band;
+
+	memmove(view->past_damage[1], view->past_damage[0],
+		(DAMAGE_FRAMES - 1) * sizeof(view->past_damage[0]));
+	view->past_damage[0][0] = view->damage_top;
+	view->past_damage[0][1] = view->damage_bottom;
 
-	if (!glyph)
+	if (!setDamageRegion)
 		return;
 
-	if (double_wide_glyph)
-		render_glyph(buffer, color, px + (dim ? 16 : 8), py, dim, false,
-			glyph);
+	if (!eglQuerySurface(egl_display, view->surface, EGL_BUFFER_AGE_KHR,
+		&age) || age < 1 || age > DAMAGE_FRAMES) {
+		top = 0;
+		bottom = frame->window_height;
+	} else {
+		top = frame->window_height;
+		bottom = 0;
 
-	i = 1;
-	imax = glyph[0] == 1 ? 17 : 33;
+		for (i = 0; i < age; i++) {
+			band = view->past_damage[i];
 
-	if (dim) {
-		switch (dim) {
-		case DOUBLE_HEIGHT_TOP: imax = imax / 2 + 1; break;
-		case DOUBLE_HEIGHT_BOTTOM: i = imax / 2 + 1; break;
+			if (band[0] >= band[1])
+				continue;
+
+			if (band[0] < top) top = band[0];
+			if (band[1] > bottom) bottom = band[1];
 		}
+
+		if (top >= bottom)
+			top = bottom = 0;
+	}
+
+	// EGL counts rows from the bottom.
+	rect[0] = 0;
+	rect[1] = frame->window_height - bottom;
+	rect[2] = frame->window_width;
+	rect[3] = bottom - top;
+	setDamageRegion(egl_display, view->surface, rect, 1);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(rect[0], rect[1], rect[2], rect[3]);
+}
+
+// Shows the frame, telling the display which rows changed if it will listen.
+static void
+swap()
+{
+	EGLint rect[4];
+
+	if (!swapBuffersWithDamage) {
+		eglSwapBuffers(egl_display, view->surface);
+		return;
 	}
 
-	rxmax = (glyph[0] == 1 ? 8 : 16) * (dim ? 2 : 1) - 1;
+	rect[0] = 0;
+	rect[1] = frame->window_height - view->damage_bottom;
+	rect[2] = frame->window_width;
+	rect[3] = view->damage_bottom - view->damage_top;
+	swapBuffersWithDamage(egl_display, view->surface, rect, 1);
+}
 
-	for (rx = 0, ry = 0; i < imax; i++) {
-		for (j = 0; j < 8; j++) {
-			if ((glyph[i] << j) & 0x80) {
-				put_pixel(buffer, px + rx, py + ry, color);
+static bool
+frame_mode(long flag)
+{
+	return frame->mode & flag;
+}
 
-				if (dim) {
-					put_pixel(buffer, px + rx + 1, py + ry, color);
+static void
+damage_cells(int y, int start, int end)
+{
+	damage_line(frame->lines[y], frame->width, start, end);
+}
 
-					if (dim > DOUBLE_WIDTH) {
-						put_pixel(buffer, px + rx, py + ry + 1, color);
-						put_pixel(buffer, px + rx + 1, py + ry + 1, color);
-					}
-				}
-			}
+static void
+damage_frame()
+{
+	int y;
+
+	for (y = 0; y < frame->height; y++)
+		damage_cells(y, 0, frame->width);
+
+	frame->shift = 0;
+}
+
+static void
+resize_texture()
+{
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame->window_width,
+		frame->window_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	view->texture_width = frame->window_width;
+	view->texture_height = frame->window_height;
+	damage_frame();
+	note_damage(0, frame->window_height);
+
+	if (glow)
+		resize_glow();
+
+	if (headless)
+		resize_screen();
+
+	if (view->fbo) {
+		glBindFramebuffer(GL_FRAMEBUFFER, view->fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, view->texture, 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+			GL_FRAMEBUFFER_COMPLETE)
+			die("failed to attach texture to framebuffer object");
+
+		// Cells never cover what is left over past the last
+		// column and row.
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+}
+
+static void
+resize_screen()
+{
+	size_t size;
+
+	if (!view->screen_fbo) {
+		glGenTextures(1, &view->screen_texture);
+		glGenFramebuffers(1, &view->screen_fbo);
+	}
+
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, view->screen_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame->window_width,
+		frame->window_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glActiveTexture(GL_TEXTURE0);
+	glBindFramebuffer(GL_FRAMEBUFFER, view->screen_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		GL_TEXTURE_2D, view->screen_texture, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		die("failed to attach screen to framebuffer object");
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	size = (size_t)frame->window_width * frame->window_height * 4;
+	free(view->shots[0]);
+	free(view->shots[1]);
+
+	if (!(view->shots[0] = malloc(size)) ||
+		!(view->shots[1] = malloc(size)))
+		pdie("failed to allocate frame memory");
+
+	view->shot_kept = false;
+}
+
+// Reads back the frame just drawn and writes it to dump_directory, unless only
+// frames that changed are wanted and this one did not.
+static void
+write_frame()
+{
+	char path[4096];
+	unsigned char *swap;
+	size_t size, row;
+
+	if (!dump_directory)
+		return;
+
+	size = (size_t)frame->window_width * frame->window_height * 4;
+	row = (size_t)frame->window_width * 4;
+	glReadPixels(0, 0, frame->window_width, frame->window_height, GL_RGBA,
+		GL_UNSIGNED_BYTE, view->shots[0]);
+
+	if (dump_changed && view->shot_kept &&
+		!memcmp(view->shots[0], view->shots[1], size))
+		return;
+
+	// The first session's frames keep the names they had before there
+	// could be more than one.
+	if (view->number)
+		snprintf(path, sizeof(path), "%s/%d-%06ld.png", dump_directory,
+			view->number, view->frames_written++);
+	else
+		snprintf(path, sizeof(path), "%s/%06ld.png", dump_directory,
+			view->frames_written++);
+	write_png(path, &view->shots[0][size - row], frame->window_width,
+		frame->window_height, -(long)row);
+	swap = view->shots[0];
+	view->shots[0] = view->shots[1];
+	view->shots[1] = swap;
+	view->shot_kept = true;
+}
+
+static void
+resize_glow()
+{
+	int i;
+
+	view->glow_width = (frame->window_width + 1) / 2;
+	view->glow_height = (frame->window_height + 1) / 2;
+
+	for (i = 0; i < 2; i++) {
+		glActiveTexture(GL_TEXTURE2 + i);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, view->glow_width,
+			view->glow_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindFramebuffer(GL_FRAMEBUFFER, view->glow_fbos[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, view->glow_textures[i], 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+			GL_FRAMEBUFFER_COMPLETE)
+			die("failed to attach glow to framebuffer object");
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	view->glow_stale = true;
+}
+
+// Shrinks the lit pixels of the frame into the first glow texture and blurs
+// them across into the second and back down into the first.
+static void
+draw_glow()
+{
+	glViewport(0, 0, view->glow_width, view->glow_height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, view->glow_fbos[0]);
+	glUseProgram(shrink_program);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, view->glow_fbos[1]);
+	glUseProgram(blur_program);
+	glUniform1i(blur_image_uniform, 2);
+	glUniform2i(direction_uniform, 1, 0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, view->glow_fbos[0]);
+	glUniform1i(blur_image_uniform, 3);
+	glUniform2i(direction_uniform, 0, 1);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glUseProgram(program);
+	view->glow_stale = false;
+}
+
+static void
+draw_instances()
+{
+	const struct color *cursor_color;
+	int y;
+	bool shown;
+
+	if (view->instance_columns != frame->width ||
+		view->instance_rows != frame->height)
+		resize_instances();
+
+	if (frame->shift)
+		shift_instances();
+
+	// Both the cell the cursor left and the one it is on need new flags,
+	// but only when it moves or is shown or hidden; the shader blinks it.
+	shown = frame_mode(DECTCEM) && !frame->scrolled_back;
+
+	if (view->cursor_x != frame->cursor_x ||
+		view->cursor_y != frame->cursor_y ||
+		view->cursor_drawn != shown) {
+		if (view->cursor_y < frame->height)
+			damage_cells(view->cursor_y, view->cursor_x,
+				view->cursor_x + 1);
+
+		damage_cells(frame->cursor_y, frame->cursor_x,
+			frame->cursor_x + 1);
+		view->cursor_x = frame->cursor_x;
+		view->cursor_y = frame->cursor_y;
+		view->cursor_drawn = shown;
+	}
+
+	// If another view flushed the atlas since this one was last drawn,
+	// every line points at slots that now hold other glyphs.
+	if (view->atlas_generation != atlas_generation)
+		damage_frame();
+
+	atlas_flushed = false;
+
+	for (y = 0; y < frame->height; y++)
+		if (frame->lines[y]->damage_start < frame->lines[y]->damage_end)
+			build_line(y);
+
+	// The same goes for lines built before it filled up part way through.
+	if (atlas_flushed)
+		for (y = 0; y < frame->height; y++)
+			build_line(y);
+
+	view->atlas_generation = atlas_generation;
+
+	for (y = 0; y < frame->height; y++)
+		if (frame->lines[y]->blinks)
+			view->frame_blinks = true;
+
+	// The texture is left as it is unless a cell or the blink phase
+	// changed.
+	if (view->upload_first > view->upload_last &&
+		view->blink_phase == frame->timer_count % 4)
+		return;
+
+	if (view->upload_first <= view->upload_last) {
+		glBindBuffer(GL_ARRAY_BUFFER, view->instance_vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, view->upload_first *
+			frame->width * sizeof(struct instance),
+			(view->upload_last - view->upload_first + 1) *
+			frame->width * sizeof(struct instance),
+			&view->instances[view->upload_first * frame->width]);
+		drawn.upload_bytes += (view->upload_last -
+			view->upload_first + 1) * frame->width *
+			sizeof(struct instance);
+		note_damage(view->upload_first * CHARHEIGHT,
+			(view->upload_last + 1) * CHARHEIGHT);
+		view->upload_first = frame->height;
+		view->upload_last = -1;
+	}
+
+	if (view->blink_phase != frame->timer_count % 4)
+		note_damage(0, frame->window_height);
+
+	view->blink_phase = frame->timer_count % 4;
+	cursor_color = default_attrs.fg_truecolor ? &default_attrs.foreground :
+		&frame->palette[default_attrs.foreground.r];
+
+	glBindFramebuffer(GL_FRAMEBUFFER, view->fbo);
+	glViewport(0, 0, frame->window_width, frame->window_height);
+	glUseProgram(cell_program);
+	bindVertexArray(view->cell_vao);
+	glUniform2f(window_uniform, frame->window_width, frame->window_height);
+	glUniform1i(blink_uniform, frame->timer_count % 4);
+	glUniform3f(cursor_color_uniform, cursor_color->r / 255.0,
+		cursor_color->g / 255.0, cursor_color->b / 255.0);
+	glUniform3f(background_uniform, frame->palette[0].r / 255.0,
+		frame->palette[0].g / 255.0, frame->palette[0].b / 255.0);
+	draw_rows();
+	drawn.pixels = frame->window_width * frame->window_height;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glUseProgram(program);
+	bindVertexArray(vao);
+	view->glow_stale = true;
+}
+
+static void
+resize_instances()
+{
+	free(view->instances);
+	free(view->instance_counts);
+
+	if (!(view->instances = calloc(frame->width * frame->height,
+		sizeof(struct instance))) ||
+		!(view->instance_counts = calloc(frame->height, sizeof(int))))
+		pdie("failed to allocate cell instance memory");
+
+	glBindBuffer(GL_ARRAY_BUFFER, view->instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, frame->width * frame->height *
+		sizeof(struct instance), NULL, GL_DYNAMIC_DRAW);
+
+	view->instance_columns = frame->width;
+	view->instance_rows = frame->height;
+	view->upload_first = frame->height;
+	view->upload_last = -1;
+	damage_frame();
+}
+
+// Moves the instances of the lines the screen scrolled, which only have to
+// be told which row they are on now.
+static void
+shift_instances()
+{
+	int top, size, count, rows, *counts, x, y;
+
+	top = frame->shift_top * frame->width;
+	size = (frame->shift_bottom - frame->shift_top + 1) * frame->width;
+	count = frame->shift * frame->width;
+	counts = &view->instance_counts[frame->shift_top];
+	rows = frame->shift_bottom - frame->shift_top + 1;
+
+	if (count > 0) {
+		memmove(&view->instances[top], &view->instances[top + count],
+			(size - count) * sizeof(struct instance));
+		memmove(counts, &counts[frame->shift],
+			(rows - frame->shift) * sizeof(int));
+	} else {
+		memmove(&view->instances[top - count], &view->instances[top],
+			(size + count) * sizeof(struct instance));
+		memmove(&counts[-frame->shift], counts,
+			(rows + frame->shift) * sizeof(int));
+	}
+
+	for (y = frame->shift_top; y <= frame->shift_bottom; y++)
+		for (x = 0; x < view->instance_counts[y]; x++)
+			view->instances[y * frame->width + x].row = y;
+
+	if (frame->shift_top < view->upload_first)
+		view->upload_first = frame->shift_top;
+
+	if (frame->shift_bottom > view->upload_last)
+		view->upload_last = frame->shift_bottom;
+
+	follow_shift(frame, &view->cursor_y);
+}
 
-			if ((rx += dim ? 2 : 1) > rxmax) {
-				rx = 0;
-				ry += dim > DOUBLE_WIDTH ? 2 : 1;
+// Rebuilds the instance records of a whole line, a span of cells in the same
+// style at a time. Lines are short enough that this is cheaper than working out
+// which cells a double-width glyph covers. A run of blanks is one record, and a
+// covered cell gets one only if the cursor is on it.
+static void
+build_line(int y)
+{
+	struct line *line;
+	struct cell *cells;
+	const struct style *style;
+	struct color bg, fg;
+	int cursor, x, end, n, flags;
+	bool *highlights;
+
+	line = frame->lines[y];
+	cells = line->cells;
+	line->blinks = false;
+	highlights = snapshot_highlights(frame, y);
+	view->instance_counts[y] = 0;
+	cursor = frame_mode(DECTCEM) && !frame->scrolled_back &&
+		y == frame->cursor_y ? frame->cursor_x : -1;
+
+	for (x = 0; x < frame->width; x = end) {
+		end = span_end(line, highlights, x, frame->width);
+		style = &frame->styles[cells[x].style];
+		span_colors(frame, style, highlights[x], &fg, &bg);
+		flags = line->dimensions | style_flags(style);
+
+		if (style->blink)
+			line->blinks = true;
+
+		for (; x < end; x += n) {
+			n = cell_columns(&cells[x]);
+
+			if (x != cursor && blank_cell(&cells[x], style)) {
+				for (; x + n < end && x + n != cursor &&
+					blank_cell(&cells[x + n], style); n++)
+					;
+
+				add_instance(y, x, line->dimensions|CELL_SPAN,
+					n, fg, bg);
+				continue;
 			}
+
+			add_instance(y, x, flags | (n > 1 ? CELL_WIDE : 0) |
+				(x == cursor ? CELL_CURSOR : 0),
+				glyph_slot(cells[x].code_point ?
+				cells[x].code_point : 0x20), fg, bg);
+
+			if (n > 1 && x + 1 == cursor)
+				add_instance(y, x + 1, line->dimensions|
+					CELL_HIDDEN|CELL_CURSOR, 0, fg, bg);
 		}
 	}
+
+	line->damage_start = line->damage_end = 0;
+
+	if (y < view->upload_first) view->upload_first = y;
+	if (y > view->upload_last) view->upload_last = y;
+}
+
+static int
+style_flags(const struct style *style)
+{
+	int flags;
+
+	flags = 0;
+
+	if (style->intensity == INTENSITY_BOLD) flags |= CELL_BOLD;
+	if (style->intensity == INTENSITY_FAINT) flags |= CELL_FAINT;
+	if (style->underline) flags |= CELL_UNDERLINE;
+	if (style->underline == UNDERLINE_DOUBLE) flags |= CELL_UNDERLINE2;
+	if (style->crossed_out) flags |= CELL_CROSSED_OUT;
+	if (style->overline) flags |= CELL_OVERLINE;
+	if (style->blink == BLINK_SLOW) flags |= CELL_BLINK_SLOW;
+	if (style->blink == BLINK_FAST) flags |= CELL_BLINK_FAST;
+
+	return flags;
+}
+
+// Adds a record to the end of line y's, for the cell in column x.
+static void
+add_instance(int y, int x, int flags, int slot, struct color fg,
+	struct color bg)
+{
+	struct instance *instance;
+
+	instance = &view->instances[y * frame->width +
+		view->instance_counts[y]++];
+	instance->column = x;
+	instance->row = y;
+	instance->slot = slot;
+	instance->flags = flags;
+	instance->fg[0] = fg.r;
+	instance->fg[1] = fg.g;
+	instance->fg[2] = fg.b;
+	instance->fg[3] = 255;
+	instance->bg[0] = bg.r;
+	instance->bg[1] = bg.g;
+	instance->bg[2] = bg.b;
+	instance->bg[3] = 255;
+}
+
+// Draws each row's records, pointing the instanced attributes at the start of
+// its row since there is no way to start a draw at a given instance.
+static void
+draw_rows()
+{
+	size_t offset;
+	int y;
+
+	glBindBuffer(GL_ARRAY_BUFFER, view->instance_vbo);
+	drawn.cells = 0;
+
+	for (y = 0; y < frame->height; y++) {
+		if (!view->instance_counts[y])
+			continue;
+
+		offset = (size_t)y * frame->width * sizeof(struct instance);
+		glVertexAttribPointer(1, 4, GL_UNSIGNED_SHORT, GL_FALSE,
+			sizeof(struct instance),
+			(void *)(offset + offsetof(struct instance, column)));
+		glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			sizeof(struct instance),
+			(void *)(offset + offsetof(struct instance, fg)));
+		glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			sizeof(struct instance),
+			(void *)(offset + offsetof(struct instance, bg)));
+		drawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4,
+			view->instance_counts[y]);
+		drawn.cells += view->instance_counts[y];
+	}
+}
+
+// Returns the atlas slot holding a glyph, loading it on first use.
+static int
+glyph_slot(long code_point)
+{
+	const unsigned char *glyph;
+	unsigned long i;
+
+	i = (unsigned long)code_point * 2654435761u % ATLAS_HASH_SIZE;
+
+	for (; atlas_keys[i] != -1; i = (i + 1) % ATLAS_HASH_SIZE)
+		if (atlas_keys[i] == code_point)
+			return atlas_values[i];
+
+	if (!(glyph = find_glyph(code_point)) || !glyph[0])
+		return SLOT_BLANK;
+
+	if (next_slot == ATLAS_SLOTS) {
+		// More glyphs than slots on one screen; give up on the rest.
+		if (atlas_flushed)
+			return SLOT_BLANK;
+
+		flush_atlas();
+		atlas_flushed = true;
+		i = (unsigned long)code_point * 2654435761u % ATLAS_HASH_SIZE;
+	}
+
+	atlas_keys[i] = code_point;
+	atlas_values[i] = next_slot;
+	load_glyph(next_slot, glyph);
+
+	return next_slot++;
+}
+
+static void
+flush_atlas()
+{
+	memset(atlas_keys, 0xFF, sizeof(atlas_keys));
+	next_slot = SLOT_FIRST;
+	atlas_generation++;
+
+	load_glyph(SLOT_UNDERLINE, find_glyph(0x0332));
+	load_glyph(SLOT_CROSSED_OUT, find_glyph(0x2015));
+	load_glyph(SLOT_OVERLINE, find_glyph(0x0305));
+}
+
+static void
+load_glyph(int slot, const unsigned char *glyph)
+{
+	unsigned char pixels[16 * 16];
+	int x, y, width;
+
+	memset(pixels, 0, sizeof(pixels));
+
+	if (glyph && glyph[0]) {
+		width = glyph[0] == 1 ? 8 : 16;
+
+		for (y = 0; y < 16; y++)
+			for (x = 0; x < width; x++)
+				if ((glyph[1 + y * width / 8 + x / 8] << x % 8) & 0x80)
+					pixels[y * 16 + x] = 255;
+	}
+
+	glActiveTexture(GL_TEXTURE1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, slot % ATLAS_COLUMNS * 16,
+		slot / ATLAS_COLUMNS * 16, 16, 16, GL_LUMINANCE,
+		GL_UNSIGNED_BYTE, pixels);
+	drawn.upload_bytes += sizeof(pixels);
+	glActiveTexture(GL_TEXTURE0);
 }
 
+// Copies the rows that changed this frame into the texture, through the next
+// pixel buffer object in the ring if we have them.
 static void
-put_pixel(unsigned char *buffer, int x, int y, struct color color)
-{
-	size_t i;
-	if (x < 0 || x >= window_width || y < 0 || y >= window_height) return;
-	i = (x + y * window_width) * 4;
-	buffer[i++] = color.r;
-	buffer[i++] = color.g;
-	buffer[i++] = color.b;
-	// TODO : determine background color much more flexibly
-	buffer[i  ] = memcmp(&color, palette, sizeof(color)) ? 255 : 0;
-}
\ No newline at end of file
+upload()
+{
+	struct canvas *canvas;
+	const unsigned char *rows;
+	size_t size;
+	void *mapping;
+
+	canvas = &view->canvas;
+
+	if (canvas->upload_top >= canvas->upload_bottom)
+		return;
+
+	rows = &canvas->pixels[canvas->upload_top * frame->window_width * 4];
+	size = (canvas->upload_bottom - canvas->upload_top) *
+		frame->window_width * 4;
+	drawn.upload_bytes += size;
+	note_damage(canvas->upload_top, canvas->upload_bottom);
+
+	if (view->pbos[0]) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER,
+			view->pbos[view->next_pbo]);
+		view->next_pbo = (view->next_pbo + 1) % PBO_COUNT;
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			GL_STREAM_DRAW);
+
+		if ((mapping = mapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT))) {
+			memcpy(mapping, rows, size);
+			unmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			rows = NULL;
+		} else {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+	}
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, canvas->upload_top,
+		frame->window_width, canvas->upload_bottom - canvas->upload_top,
+		GL_RGBA, GL_UNSIGNED_BYTE, rows);
+	view->glow_stale = true;
+
+	if (!rows)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	canvas->upload_top = canvas->upload_bottom = 0;
+}
@@ -0,0 +1,159 @@
+// png.c - writing frames out as PNG images
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "terminix.h"
+
+// Frames are written without compression, as stored deflate blocks, which
+// keeps this quick and saves depending on zlib. Each block holds at most
+// BLOCK_SIZE bytes.
+#define BLOCK_SIZE 65535
+
+static uint32_t crc_table[256];
+
+static void put32(unsigned char *, uint32_t);
+static uint32_t crc(uint32_t, const unsigned char *, size_t);
+static void write_chunk(FILE *, const char *, const unsigned char *, size_t);
+
+// Writes width by height RGBA pixels to path. pixels points at the top row and
+// stride is how far apart rows are, which is negative for images kept with the
+// bottom row first.
+void
+write_png(const char *path, const unsigned char *pixels, int width,
+	int height, long stride)
+{
+	static const unsigned char signature[] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+	};
+
+	unsigned char header[13], *data, *p;
+	size_t raw_size, size, n, i;
+	uint32_t a, b;
+	FILE *file;
+	int y;
+
+	raw_size = (size_t)height * (1 + width * 4);
+	size = 2 + raw_size + (raw_size / BLOCK_SIZE + 1) * 5 + 4;
+
+	if (!(data = malloc(size)))
+		pdie("failed to allocate image memory");
+
+	// The scanlines, each led by a 0 for no filter, are laid out at the end
+	// and then moved forward block by block to make room for the headers.
+	p = &data[size - 4 - raw_size];
+
+	for (y = 0; y < height; y++) {
+		*p++ = 0;
+		memcpy(p, pixels + y * stride, width * 4);
+		p += width * 4;
+	}
+
+	a = 1;
+	b = 0;
+	p = &data[size - 4 - raw_size];
+
+	for (i = 0; i < raw_size; i++) {
+		a = (a + p[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	data[0] = 0x78;
+	data[1] = 0x01;
+	p = &data[2];
+
+	for (i = 0; i < raw_size; i += n) {
+		n = raw_size - i < BLOCK_SIZE ? raw_size - i : BLOCK_SIZE;
+		memmove(p + 5, &data[size - 4 - raw_size + i], n);
+		p[0] = i + n == raw_size;
+		p[1] = n;
+		p[2] = n >> 8;
+		p[3] = ~n;
+		p[4] = ~n >> 8;
+		p += 5 + n;
+	}
+
+	put32(p, b << 16 | a);
+
+	put32(&header[0], width);
+	put32(&header[4], height);
+	header[8] = 8;	// bits per channel
+	header[9] = 6;	// RGBA
+	header[10] = header[11] = header[12] = 0;
+
+	if (!(file = fopen(path, "wb")))
+		err(EXIT_FAILURE, "failed to open %s", path);
+
+	fwrite(signature, 1, sizeof(signature), file);
+	write_chunk(file, "IHDR", header, sizeof(header));
+	write_chunk(file, "IDAT", data, p + 4 - data);
+	write_chunk(file, "IEND", NULL, 0);
+
+	if (ferror(file) | fclose(file))
+		err(EXIT_FAILURE, "failed to write %s", path);
+
+	free(data);
+}
+
+static void
+put32(unsigned char *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+// Continues a CRC-32 across more bytes, starting from zero.
+static uint32_t
+crc(uint32_t sum, const unsigned char *bytes, size_t size)
+{
+	uint32_t c;
+	int i, j;
+
+	if (!crc_table[1]) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = c & 1 ? 0xEDB88320 ^ c >> 1 : c >> 1;
+
+			crc_table[i] = c;
+		}
+	}
+
+	sum = ~sum;
+
+	while (size--)
+		sum = crc_table[(sum ^ *bytes++) & 0xFF] ^ sum >> 8;
+
+	return ~sum;
+}
+
+static void
+write_chunk(FILE *file, const char *type, const unsigned char *data,
+	size_t size)
+{
+	unsigned char word[4];
+
+	put32(word, size);
+	fwrite(word, 1, 4, file);
+	fwrite(type, 1, 4, file);
+
+	if (size)
+		fwrite(data, 1, size, file);
+
+	put32(word, crc(crc(0, (const unsigned char *)type, 4), data, size));
+	fwrite(word, 1, 4, file);
+}
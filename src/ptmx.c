@@ -14,80 +14,250 @@
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define _XOPEN_SOURCE 600 // pseudoterminals
-#define _GNU_SOURCE // vasprintf
+#define _GNU_SOURCE // pipe2
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
-#include <stdarg.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "terminix.h"
 
-#define pdiec(message) (pdie("[child] " message))
+// The child of a process with threads may only call async-signal-safe
+// functions before it executes the shell, so it reports failures with write
+// and leaves with _exit.
+#define pdiec(message) (child_say(message, NULL), _exit(EXIT_FAILURE))
 
-static int ptmx = -1;
-static unsigned char write_buffer[1024];
-static size_t write_buffer_size;
+// The child's output is read on a thread of its own into ring, so that it can
+// keep writing while the main thread parses and draws. The reader only ever
+// moves ring_head and the main thread only ever moves ring_tail; both count
+// bytes from the start and are taken modulo RING_SIZE to index the ring, so the
+// ring is empty when they are equal and full when they are RING_SIZE apart.
+//
+// The reader stops reading while the ring is full or output is paused, which
+// leaves the child blocked on a full pseudoterminal until there is room again.
+// Each side wakes the other through a pipe, but only if the other said it was
+// about to wait, so that a steady stream of output costs no extra system calls.
+#define RING_SIZE (1 << 22)
+
+// What is written to the child waits in queue, which is also a ring, until the
+// pseudoterminal will take it. It starts out with QUEUE_SIZE bytes and doubles
+// whenever something doesn't fit, so nothing is ever thrown away.
+#define QUEUE_SIZE 4096
+
+// In low-latency mode, the main thread waits up to ECHO_TIMEOUT ns for the echo
+// of what was just typed, so that it can go into the next frame.
+#define ECHO_TIMEOUT 2000000
+
+enum { RUNNING, HUNG_UP, BROKEN };
+
+// Each session has a pseudoterminal of its own, read by a thread of its own.
+// The reader counts its own reads and ptpump() adds what it counted since
+// counted_reads and counted_bytes to stats. stopping is set when ptkill() wants
+// the reader to finish.
+//
+// While output is recorded, the reader hands recorder what it read straight
+// from the ring, and does not read over it again until it was written out.
+// pumping is set while ptpump() parses, since resizes the output itself asks
+// for come back with it on playback. A session that plays back a recording
+// has replay instead of a shell, reader or ring.
+struct pty {
+	int		 ptmx, main_pipe[2], reader_pipe[2], reader_errno;
+	unsigned char	*ring;
+	atomic_size_t	 ring_head, ring_tail;
+	atomic_bool	 main_waiting, reader_waiting, paused, stopping;
+	atomic_int	 reader_state;
+	atomic_ulong	 reads, read_bytes;
+	unsigned long	 counted_reads, counted_bytes;
+	unsigned char	*queue;
+	size_t		 queue_size, queue_start, queue_length;
+	bool		 held, echo_due, pumping;
+	pthread_t	 thread;
+	struct recorder	*recorder;
+	struct replay	*replay;
+};
+
+struct pty *pty;
 
 static void set_nonblock(void);
-static _Noreturn void init_child(const char *);
-static void read_ptmx(void);
+static void close_pipe(int *);
+static const char *find_shell(void);
+static char **child_environment(void);
+static _Noreturn void init_child(const char *, const char *, const char *,
+	char **);
+static void child_say(const char *, const char *);
+static void count_reads(void);
+static void start_reader(void);
+static void *read_ptmx(void *);
+static size_t ring_room(struct pty *, size_t);
+static void wake(int);
+static void drain(int);
+static void grow_queue(size_t);
 static void flush_ptmx(void);
+static void wait_for_echo(void);
+static void made_room(void *);
+static void pump_replay(void);
 
+// Opens a pseudoterminal for the current session and starts the shell on it,
+// in directory if it is set. The first session plays back replay_path instead,
+// if it is set, and is recorded to record_path if that is.
 void
-ptinit()
+ptinit(const char *directory)
 {
-	const char *pts;
+	const char *pts, *shell;
+	char **environment;
+
+	if (!(pty = session->pty = calloc(1, sizeof(*pty))))
+		pdie("failed to allocate pseudoterminal memory");
+
+	pty->ptmx = -1;
+	pty->main_pipe[0] = pty->main_pipe[1] = -1;
+	pty->reader_pipe[0] = pty->reader_pipe[1] = -1;
+
+	if (replay_path && !session->number) {
+		pty->replay = open_replay(replay_path, replay_speed);
+		seek_replay(pty->replay, replay_from);
+		return;
+	}
 
-	if ((ptmx = posix_openpt(O_RDWR|O_NOCTTY)) < 0)
+	if (!(pty->ring = malloc(RING_SIZE)))
+		pdie("failed to allocate pseudoterminal memory");
+
+	if ((pty->ptmx = posix_openpt(O_RDWR|O_NOCTTY)) < 0)
 		pdie("failed to open parent pseudoterminal");
 
 	set_nonblock();
 
-	if (grantpt(ptmx))
+	if (grantpt(pty->ptmx))
 		pdie("failed to set permissions on child pseudoterminal");
 
-	if (unlockpt(ptmx))
+	if (unlockpt(pty->ptmx))
 		pdie("failed to unlock child pseudoterminal");
 
-	if (!(pts = ptsname(ptmx)))
+	if (!(pts = ptsname(pty->ptmx)))
 		pdie("failed to get name of child pseudoterminal");
 
+	ptresize();
+	shell = find_shell();
+	environment = child_environment();
+
 	switch (fork()) {
 	case -1:
 		pdie("failed to create child process");
 	case 0:
-		init_child(pts);
+		init_child(pts, directory, shell, environment);
 	}
+
+	free(environment);
+
+	if (record_path && !session->number)
+		pty->recorder = start_recording(record_path, made_room, pty);
+
+	start_reader();
 }
 
+// The other sessions' shells must not hold on to this pseudoterminal, or it
+// would never hang up on its own shell once the session closes.
 static void
 set_nonblock()
 {
 	int flags;
 
-	if ((flags = fcntl(ptmx, F_GETFL)) < 0)
+	if ((flags = fcntl(pty->ptmx, F_GETFL)) < 0)
 		pdie("failed to get pseudoterminal flags");
 
-	if ((fcntl(ptmx, F_SETFL, flags|O_NONBLOCK)) == -1)
+	if ((fcntl(pty->ptmx, F_SETFL, flags|O_NONBLOCK)) == -1)
 		pdie("failed to set pseudoterminal flags to non-blocking");
+
+	if (fcntl(pty->ptmx, F_SETFD, FD_CLOEXEC) == -1)
+		pdie("failed to set pseudoterminal to close on exec");
 }
 
-static void
-init_child(const char *pts)
+// Finds the shell to start: $SHELL, or the user's login shell, or /bin/sh.
+static const char *
+find_shell()
 {
 	const struct passwd *passwd;
 	const char *shell;
 
+	if ((shell = getenv("SHELL")))
+		return shell;
+
+	errno = 0;
+
+	if (!(passwd = getpwuid(getuid()))) {
+		if (errno)
+			warn("failed to get user's default shell");
+		else
+			warn("you don't exist");
+
+		return "/bin/sh";
+	}
+
+	return passwd->pw_shell[0] ? passwd->pw_shell : "/bin/sh";
+}
+
+// Builds the shell's environment out of ours, less the variables that describe
+// some other terminal, and with TERM set to the one we emulate. The strings
+// are shared with ours, so only the array is for the caller to free.
+static char **
+child_environment()
+{
+	static const char *const dropped[] = {
+		"COLUMNS=", "LINES=", "SHELL=", "TERMCAP=", "TERM="
+	};
+	static char term_variable[] = "TERM=vt100";
+	char **environment;
+	size_t count, i, j;
+
+	for (count = 0; environ[count]; count++)
+		;
+
+	if (!(environment = malloc((count + 2) * sizeof(*environment))))
+		pdie("failed to allocate environment memory");
+
+	for (count = i = 0; environ[i]; i++) {
+		for (j = 0; j < sizeof(dropped) / sizeof(*dropped); j++)
+			if (!strncmp(environ[i], dropped[j],
+				strlen(dropped[j])))
+				break;
+
+		if (j == sizeof(dropped) / sizeof(*dropped))
+			environment[count++] = environ[i];
+	}
+
+	environment[count++] = term_variable;
+	environment[count] = NULL;
+	return environment;
+}
+
+static void
+init_child(const char *pts, const char *directory, const char *shell,
+	char **environment)
+{
+	char *argv[2];
+
 	if (setsid() < 0) pdiec("failed to create session");
 
+	// The parent leaves its children for the system to reap, which the
+	// shell must not inherit.
+	if (signal(SIGCHLD, SIG_DFL) == SIG_ERR)
+		pdiec("failed to restore child signal handler");
+
+	if (directory && chdir(directory))
+		child_say("failed to change directory to ", directory);
+
 	if (close(0)) pdiec("failed to close standard input");
 	if (close(1)) pdiec("failed to close standard output");
 	if (close(2)) pdiec("failed to close standard error");
-	if (close(ptmx)) pdiec("failed to close parent pseudoterminal");
+	if (close(pty->ptmx)) pdiec("failed to close parent pseudoterminal");
 
 	if (open(pts, O_RDWR) < 0)
 		pdiec("failed to open pseudoterminal");
@@ -95,37 +265,102 @@ init_child(const char *pts)
 	if (dup(0) < 0) pdiec("failed to dup pseudoterminal (1)");
 	if (dup(0) < 0) pdiec("failed to dup pseudoterminal (2)");
 
-	if (!(shell = getenv("SHELL"))) {
-		errno = 0;
-
-		if (!(passwd = getpwuid(getuid()))) {
-			if (errno)
-				warn("failed to get user's default shell");
-			else
-				warn("you don't exist");
+	argv[0] = (char *)shell;
+	argv[1] = NULL;
+	execve(shell, argv, environment);
+	child_say("failed to execute ", shell);
+	_exit(EXIT_FAILURE);
+}
 
-			shell = "/bin/sh";
-		} else {
-			shell = passwd->pw_shell[0]?passwd->pw_shell:"/bin/sh";
-		}
+// Writes message, and then subject if it is set, to the child's standard
+// error with nothing that is unsafe to call between fork and exec.
+static void
+child_say(const char *message, const char *subject)
+{
+	struct iovec parts[4];
+	int count;
+
+	count = 0;
+	parts[count].iov_base = "[child] ";
+	parts[count++].iov_len = 8;
+	parts[count].iov_base = (char *)message;
+	parts[count++].iov_len = strlen(message);
+
+	if (subject) {
+		parts[count].iov_base = (char *)subject;
+		parts[count++].iov_len = strlen(subject);
 	}
 
-	unsetenv("COLUMNS");
-	unsetenv("LINES");
-	unsetenv("SHELL");
-	unsetenv("TERMCAP");
-
-	setenv("TERM", "vt100", 1);
+	parts[count].iov_base = "\n";
+	parts[count++].iov_len = 1;
 
-	execl(shell, shell, NULL);
-	err(EXIT_FAILURE, "[child] failed to execute %s", shell);
+	if (writev(2, parts, count) < 0)
+		return;
 }
 
+// Stops the reader and closes the current session's pseudoterminal, which
+// hangs up on the shell. On the reader thread itself, which only happens when
+// something dies on it, the pseudoterminal is just closed.
 void
 ptkill()
 {
-	if (ptmx >= 0 && close(ptmx))
+	if (!pty)
+		return;
+
+	if (pthread_equal(pthread_self(), pty->thread)) {
+		close(pty->ptmx);
+		return;
+	}
+
+	if (pty->main_pipe[0] >= 0) {
+		atomic_store(&pty->stopping, true);
+		wake(pty->reader_pipe[1]);
+		pthread_join(pty->thread, NULL);
+	}
+
+	if (pty->recorder)
+		stop_recording(pty->recorder);
+
+	if (pty->replay)
+		close_replay(pty->replay);
+
+	if (pty->ptmx >= 0 && close(pty->ptmx))
 		warn("failed to close parent pseudoterminal");
+
+	close_pipe(pty->main_pipe);
+	close_pipe(pty->reader_pipe);
+	free(pty->ring);
+	free(pty->queue);
+	free(pty);
+	pty = session->pty = NULL;
+}
+
+static void
+close_pipe(int *fds)
+{
+	if (fds[0] >= 0) close(fds[0]);
+	if (fds[1] >= 0) close(fds[1]);
+}
+
+// Tells the child how big the screen is, which sends it SIGWINCH.
+void
+ptresize()
+{
+	struct winsize size;
+
+	if (!pty || pty->ptmx < 0)
+		return;
+
+	size.ws_row = term->height;
+	size.ws_col = term->width;
+	size.ws_xpixel = term->width * CHARWIDTH;
+	size.ws_ypixel = term->height * CHARHEIGHT;
+
+	if (ioctl(pty->ptmx, TIOCSWINSZ, &size))
+		warn("failed to set pseudoterminal size");
+
+	if (pty->recorder && !pty->pumping)
+		record_resize(pty->recorder, atomic_load(&pty->ring_tail));
 }
 
 void
@@ -134,100 +369,466 @@ ptbreak(bool shift)
 	warnx("TODO : BREAK for %s seconds +/- 10%%", shift ? "3.5" : "0.2333");
 }
 
+// Stops reading the child's output, or starts again.
+void
+ptpause()
+{
+	if (pty->replay)
+		return;
+
+	atomic_store(&pty->paused, !atomic_load(&pty->paused));
+	wake(pty->reader_pipe[1]);
+}
+
+// Holds back what is typed until released, for XOFF and XON from the host.
 void
-ptwrite(const char *format, ...)
+pthold(bool hold)
+{
+	if (!(pty->held = hold) && pty->queue_length)
+		flush_ptmx();
+}
+
+// Fills in pfd[0] to wake up for output and pfd[1] for room to write, and
+// returns whether output is already waiting, in which case the caller must not
+// block.
+bool
+ptprepare(struct pollfd *pfd)
 {
-	va_list args;
-	char *buffer;
-	int i, bufsize;
+	if (pty->replay) {
+		pfd[0].fd = pfd[1].fd = -1;
+		return false;
+	}
+
+	pfd[0].fd = pty->main_pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pty->queue_length && !pty->held ? pty->ptmx : -1;
+	pfd[1].events = POLLOUT;
 
-	va_start(args, format);
+	atomic_store(&pty->main_waiting, true);
 
-	if ((bufsize = vasprintf(&buffer, format, args)) == -1)
-		pdie("failed to format string");
+	return atomic_load(&pty->ring_head) != atomic_load(&pty->ring_tail) ||
+		atomic_load(&pty->reader_state) != RUNNING;
+}
 
-	va_end(args);
+// Queues size bytes of data to be written to the child. They are written when
+// ptpump() is next called, so that everything written in between goes out
+// together.
+void
+ptwrite(const void *data, size_t size)
+{
+	size_t end, n;
 
-	if ((size_t)bufsize <= sizeof(write_buffer) - write_buffer_size) {
-		for (i = 0; i < bufsize; i++)
-			write_buffer[write_buffer_size++] = buffer[i];
+	// There is nobody to answer while playing back.
+	if (pty->replay)
+		return;
 
-		if (write_buffer_size > 0)
-			flush_ptmx();
-	}
+	if (!pty->queue || size > pty->queue_size - pty->queue_length)
+		grow_queue(pty->queue_length + size);
 
-	free(buffer);
+	end = (pty->queue_start + pty->queue_length) % pty->queue_size;
+	n = size < pty->queue_size - end ? size : pty->queue_size - end;
+	memcpy(&pty->queue[end], data, n);
+	memcpy(pty->queue, (const unsigned char *)data + n, size - n);
+	pty->queue_length += size;
 }
 
+void
+ptputs(const char *string)
+{
+	ptwrite(string, strlen(string));
+}
+
+// Writes number in decimal, as the reports sent back to the host need.
+void
+ptputn(unsigned number)
+{
+	char digits[16];
+	int i;
+
+	i = sizeof(digits);
+
+	do digits[--i] = '0' + number % 10;
+	while (number /= 10);
+
+	ptwrite(&digits[i], sizeof(digits) - i);
+}
+
+// Parses everything the reader has put in the ring so far and writes whatever
+// is waiting to be written.
 void
 ptpump()
 {
-	struct pollfd pfd;
-	bool loop;
+	size_t head, tail, n;
+	uint64_t start;
 
-	pfd.fd = ptmx;
-	pfd.events = POLLIN|POLLOUT;
+	if (pty->replay) {
+		pump_replay();
+		return;
+	}
 
-	for (;;)
-		switch (poll(&pfd, 1, 0)) {
-		case 1:
-			if (pfd.revents & POLLERR)
-				die("pseudoterminal is broken");
+	atomic_store(&pty->main_waiting, false);
+	drain(pty->main_pipe[0]);
 
-			if (pfd.revents & POLLHUP)
-				exit(0);
+	// Whatever was typed goes out before a long batch of output is parsed.
+	if (pty->queue_length && !pty->held)
+		flush_ptmx();
 
-			if (pfd.revents & POLLNVAL)
-				die("pseudoterminal not open");
+	if (pty->echo_due)
+		wait_for_echo();
 
-			loop = false;
+	head = atomic_load_explicit(&pty->ring_head, memory_order_acquire);
+	tail = atomic_load_explicit(&pty->ring_tail, memory_order_relaxed);
 
-			if (pfd.revents & POLLIN) {
-				read_ptmx();
-				loop = true;
-			}
+	start = monotonic_time();
+	count_reads();
 
-			if (pfd.revents & POLLOUT && write_buffer_size) {
-				flush_ptmx();
-				loop = true;
-			}
+	if (head != tail) {
+		// Output brings the view back down to the screen.
+		scroll_view(-term->scrollback);
+		session->redraw = true;
+		stats.parse_bytes += head - tail;
+		session->echoed |= session->key_time != 0;
 
-			if (loop)
-				break;
+		if (!session->output_time)
+			session->output_time = start;
+	}
 
-			return;
-		default:
-			pdie("failed to poll pseudoterminal");
+	pty->pumping = true;
+
+	while (head != tail) {
+		n = RING_SIZE - tail % RING_SIZE;
+
+		if (n > head - tail)
+			n = head - tail;
+
+		vtinterp_buf(&pty->ring[tail % RING_SIZE], n);
+		tail += n;
+		atomic_store_explicit(&pty->ring_tail, tail,
+			memory_order_release);
+
+		if (atomic_exchange(&pty->reader_waiting, false))
+			wake(pty->reader_pipe[1]);
+	}
+
+	pty->pumping = false;
+
+	if (pty->recorder)
+		record_screen(pty->recorder, tail);
+
+	stats.parse_time += monotonic_time() - start;
+
+	// The reader only stops once everything before it stopped was read,
+	// and then the session is over.
+	switch (atomic_load(&pty->reader_state)) {
+	case HUNG_UP:
+		if (atomic_load(&pty->ring_head) == tail)
+			session->closed = true;
+		break;
+	case BROKEN:
+		if (atomic_load(&pty->ring_head) == tail) {
+			errno = pty->reader_errno;
+			warn("failed to read parent pseudoterminal");
+			session->closed = true;
+		}
+		break;
+	}
+
+	if (pty->queue_length && !pty->held)
+		flush_ptmx();
+}
+
+// Adds the reads counted since the last time to stats.
+static void
+count_reads()
+{
+	unsigned long reads, read_bytes;
+
+	reads = atomic_load_explicit(&pty->reads, memory_order_relaxed);
+	read_bytes = atomic_load_explicit(&pty->read_bytes,
+		memory_order_relaxed);
+	stats.reads += reads - pty->counted_reads;
+	stats.read_bytes += read_bytes - pty->counted_bytes;
+	pty->counted_reads = reads;
+	pty->counted_bytes = read_bytes;
+}
+
+static void
+start_reader()
+{
+	if (pipe2(pty->main_pipe, O_NONBLOCK|O_CLOEXEC) ||
+		pipe2(pty->reader_pipe, O_NONBLOCK|O_CLOEXEC))
+		pdie("failed to create pseudoterminal reader pipes");
+
+	if ((errno = pthread_create(&pty->thread, NULL, read_ptmx, pty)))
+		pdie("failed to start pseudoterminal reader");
+}
+
+// Runs on the reader thread, reading straight into the ring until the child
+// hangs up or ptkill() stops it.
+static void *
+read_ptmx(void *argument)
+{
+	struct pty *self;
+	struct pollfd pfds[2];
+	size_t head, room;
+	ssize_t n;
+	bool stopped;
+
+	self = argument;
+	head = 0;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = self->reader_pipe[0];
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		room = ring_room(self, head);
+
+		// Saying so before looking again means the main thread and the
+		// recording writer cannot make room in between without waking
+		// this one.
+		if ((stopped = !room || atomic_load(&self->paused))) {
+			atomic_store(&self->reader_waiting, true);
+			room = ring_room(self, head);
+			stopped = !room || atomic_load(&self->paused);
+		}
+
+		pfds[0].fd = stopped ? -1 : self->ptmx;
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			self->reader_errno = errno;
+			break;
+		}
+
+		drain(self->reader_pipe[0]);
+
+		if (atomic_load(&self->stopping))
+			return NULL;
+
+		if (stopped || !pfds[0].revents)
+			continue;
+
+		if (room > RING_SIZE - head % RING_SIZE)
+			room = RING_SIZE - head % RING_SIZE;
+
+		// Linux reports that the child closed its end as EIO.
+		if ((n = read(self->ptmx, &self->ring[head % RING_SIZE],
+			room)) <= 0) {
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+
+			self->reader_errno = n < 0 && errno != EIO ? errno : 0;
+			break;
 		}
+
+		if (self->recorder)
+			record_output(self->recorder,
+				&self->ring[head % RING_SIZE], n);
+
+		head += n;
+		atomic_fetch_add_explicit(&self->reads, 1,
+			memory_order_relaxed);
+		atomic_fetch_add_explicit(&self->read_bytes, n,
+			memory_order_relaxed);
+		atomic_store_explicit(&self->ring_head, head,
+			memory_order_release);
+
+		if (atomic_exchange(&self->main_waiting, false))
+			wake(self->main_pipe[1]);
+	}
+
+	atomic_store(&self->reader_state,
+		self->reader_errno ? BROKEN : HUNG_UP);
+	wake(self->main_pipe[1]);
+	return NULL;
+}
+
+// Returns how many bytes the reader can read past head without reading over
+// anything not yet parsed or, while recording, written out.
+static size_t
+ring_room(struct pty *self, size_t head)
+{
+	size_t tail, written;
+
+	tail = atomic_load_explicit(&self->ring_tail, memory_order_acquire);
+
+	if (self->recorder && (written = recorded_bytes(self->recorder)) < tail)
+		tail = written;
+
+	return RING_SIZE - (head - tail);
+}
+
+static void
+wake(int fd)
+{
+	// A full pipe will wake the other side anyway.
+	if (write(fd, "", 1) < 0 && errno != EAGAIN)
+		pdie("failed to wake pseudoterminal thread");
 }
 
 static void
-read_ptmx()
+drain(int fd)
+{
+	char buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0)
+		;
+}
+
+// Notes that a key was just pressed, if it queued anything to write. In
+// low-latency mode, that is written right away instead of waiting for ptpump(),
+// which then waits for the echo.
+void
+pttyped()
 {
-	char buffer[1024];
-	ssize_t i, n;
+	if (!pty->queue_length || pty->held)
+		return;
+
+	if (!session->key_time)
+		session->key_time = monotonic_time();
 
-	if ((n = read(ptmx, buffer, sizeof(buffer))) < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) return;
-		pdie("failed to read parent pseudoterminal");
+	if (low_latency) {
+		flush_ptmx();
+		pty->echo_due = true;
 	}
+}
 
-	for (i = 0; i < n; i++)
-		vtinterp(buffer[i]);
+// Makes room for at least size bytes in the queue, straightening out whatever
+// is already in it.
+static void
+grow_queue(size_t size)
+{
+	unsigned char *new;
+	size_t new_size, n;
+
+	new_size = pty->queue_size ? pty->queue_size : QUEUE_SIZE;
+
+	while (new_size < size)
+		new_size *= 2;
+
+	if (!(new = malloc(new_size)))
+		pdie("failed to allocate pseudoterminal write queue");
+
+	if (pty->queue_length) {
+		n = pty->queue_size - pty->queue_start;
+
+		if (n > pty->queue_length)
+			n = pty->queue_length;
+
+		memcpy(new, &pty->queue[pty->queue_start], n);
+		memcpy(&new[n], pty->queue, pty->queue_length - n);
+	}
+
+	free(pty->queue);
+	pty->queue = new;
+	pty->queue_size = new_size;
+	pty->queue_start = 0;
 }
 
+// Writes as much of the queue as the pseudoterminal will take. The rest waits
+// for ptprepare() to see it has room again.
 static void
 flush_ptmx()
 {
+	struct iovec iov[2];
 	ssize_t n;
 
-	if ((n = write(ptmx, write_buffer, write_buffer_size)) < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+	iov[0].iov_base = &pty->queue[pty->queue_start];
+	iov[0].iov_len = pty->queue_size - pty->queue_start;
+
+	if (iov[0].iov_len > pty->queue_length)
+		iov[0].iov_len = pty->queue_length;
+
+	iov[1].iov_base = pty->queue;
+	iov[1].iov_len = pty->queue_length - iov[0].iov_len;
+
+	if ((n = writev(pty->ptmx, iov, iov[1].iov_len ? 2 : 1)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+
+		// The shell is gone and the reader will say so shortly.
+		if (errno == EIO) {
+			pty->queue_start = pty->queue_length = 0;
+			return;
+		}
+
 		pdie("failed to write to parent pseudoterminal");
 	}
 
-	if (n > 0) {
-		write_buffer_size -= n;
-		memmove(write_buffer, write_buffer + n, write_buffer_size);
+	pty->queue_start = (pty->queue_start + n) % pty->queue_size;
+
+	if (!(pty->queue_length -= n))
+		pty->queue_start = 0;
+}
+
+// Waits until the reader has something or ECHO_TIMEOUT runs out, whichever
+// comes first.
+static void
+wait_for_echo()
+{
+	static const struct timespec timeout = { 0, ECHO_TIMEOUT };
+
+	struct pollfd pfd;
+
+	pty->echo_due = false;
+	pfd.fd = pty->main_pipe[0];
+	pfd.events = POLLIN;
+	atomic_store(&pty->main_waiting, true);
+
+	if (atomic_load(&pty->ring_head) == atomic_load(&pty->ring_tail) &&
+		atomic_load(&pty->reader_state) == RUNNING &&
+		ppoll(&pfd, 1, &timeout, NULL) < 0 && errno != EINTR)
+		pdie("failed to wait for echo");
+
+	atomic_store(&pty->main_waiting, false);
+	drain(pty->main_pipe[0]);
+}
+
+// Runs on the recording writer, which just made room in the ring.
+static void
+made_room(void *argument)
+{
+	struct pty *self;
+
+	self = argument;
+
+	if (atomic_exchange(&self->reader_waiting, false))
+		wake(self->reader_pipe[1]);
+}
+
+// Returns when the recording being played back next has something due, or 0
+// if there is nothing left or no recording.
+uint64_t
+ptdeadline()
+{
+	return pty->replay ? replay_deadline(pty->replay) : 0;
+}
+
+// Plays whatever is due of the recording, as ptpump() parses what the shell
+// wrote. Without a window, the session is over once it has all been played.
+static void
+pump_replay()
+{
+	uint64_t deadline, start;
+
+	if (!(deadline = replay_deadline(pty->replay))) {
+		if (headless)
+			session->closed = true;
+		return;
 	}
-}
\ No newline at end of file
+
+	if (deadline > current_time)
+		return;
+
+	start = monotonic_time();
+	scroll_view(-term->scrollback);
+	session->redraw = true;
+
+	if (!session->output_time)
+		session->output_time = start;
+
+	stats.parse_bytes += play_replay(pty->replay, current_time);
+	stats.parse_time += monotonic_time() - start;
+}
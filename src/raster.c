@@ -0,0 +1,795 @@
+// raster.c - drawing frames in software
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "terminix.h"
+
+// Once at least PARALLEL_ROWS lines need drawing, they are split into bands of
+// BAND_ROWS lines that the workers, and the thread that called rasterize(),
+// take one at a time until there are none left, so that uneven bands even out.
+// There are as many workers as there are other cores, up to MAX_WORKERS.
+#define PARALLEL_ROWS 8
+#define BAND_ROWS 2
+#define MAX_WORKERS 7
+
+unsigned long cells_drawn, pixels_drawn;
+
+// The snapshot being drawn and the canvas it is drawn into, for the length of a
+// call to rasterize().
+static struct snapshot *frame;
+static struct canvas *canvas;
+
+// Drawing is clipped to the cell being rendered so a glyph cannot bleed into
+// neighbours that are not being redrawn this frame. Each thread drawing has a
+// clip of its own, and counts what it draws itself until its band is done.
+static __thread int clip_left, clip_top, clip_right, clip_bottom;
+static __thread unsigned long band_cells, band_pixels;
+
+// rows lists the lines of the frame in hand that need drawing, row_count long,
+// in band_count bands, and next_band is the first band nobody has taken yet.
+// bands_left counts down as they are finished, and generation goes up with
+// every frame split up. A worker still looking for work from the last frame
+// finds next_band at band_count until the next is handed out under pool_lock.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[MAX_WORKERS];
+static int worker_count, *rows, row_count, row_capacity;
+static int band_count, next_band, bands_left;
+static unsigned long generation;
+
+// blit_masks[byte] holds eight pixel masks that select the pixels whose bits
+// are set in byte, and doubled_bits[byte] is byte with every bit repeated.
+// space_blank is set by init_spans() if the font's space lights nothing, so
+// that blank cells can be filled without drawing it, by either renderer.
+static uint32_t blit_masks[256][8];
+static uint16_t doubled_bits[256];
+static bool space_blank;
+
+static bool frame_mode(long);
+static void damage_cells(int, int, int);
+static void damage_frame(void);
+static void resize_framebuffer(void);
+static void shift_framebuffer(void);
+static void mark_upload(int, int);
+static void damage_blinking(void);
+static void find_rows(void);
+static void render_rows(void);
+static void *work(void *);
+static bool render_band(void);
+static void render_line(int);
+static void render_span(int, int, int, bool);
+static void span_pixels(const struct style *, bool, uint32_t *, uint32_t *);
+static bool plain_cell(const struct cell *, const struct style *);
+static void set_clip(int, int, int, int);
+static void cover_cell(uint32_t *, char, const struct cell *,
+	const struct style *);
+static void render_glyph(uint32_t *, int, int, char, bool,
+	const unsigned char *);
+static void render_unscaled(uint32_t *, int, int, const unsigned char *);
+static void render_scaled(uint32_t *, int, int, char, const unsigned char *);
+static void blit_cell(unsigned char *, const uint32_t *, int, int, uint32_t,
+	uint32_t);
+static void fill_clip(unsigned char *, uint32_t);
+static uint32_t pack_color(struct color);
+
+void
+init_raster()
+{
+	long cores;
+	int byte, bit;
+
+	for (byte = 0; byte < 256; byte++) {
+		for (bit = 0; bit < 8; bit++) {
+			if (!((byte << bit) & 0x80))
+				continue;
+
+			blit_masks[byte][bit] = 0xFFFFFFFF;
+			doubled_bits[byte] |= 3 << (14 - bit * 2);
+		}
+	}
+
+	init_spans();
+
+	if (worker_count || (cores = sysconf(_SC_NPROCESSORS_ONLN)) < 2)
+		return;
+
+	for (; worker_count < cores - 1 && worker_count < MAX_WORKERS;
+		worker_count++) {
+		if ((errno = pthread_create(&workers[worker_count], NULL, work,
+			NULL)))
+			pdie("failed to start raster thread");
+
+		pthread_detach(workers[worker_count]);
+	}
+}
+
+void
+deinit_canvas(struct canvas *c)
+{
+	free(c->pixels);
+	memset(c, 0, sizeof(*c));
+}
+
+// Draws whatever changed in a snapshot since the last one drawn into a canvas,
+// and returns whether anything on it is blinking.
+bool
+rasterize(struct canvas *target, struct snapshot *snapshot)
+{
+	struct line *line;
+	int y, cw;
+	bool shown, repaint, blinks;
+
+	canvas = target;
+	frame = snapshot;
+	blinks = false;
+
+	if (canvas->width != frame->window_width ||
+		canvas->height != frame->window_height)
+		resize_framebuffer();
+
+	if (frame->shift)
+		shift_framebuffer();
+
+	if (canvas->blink_phase != frame->timer_count % 4)
+		damage_blinking();
+
+	// The cursor is drawn over its cell, so it only has to be drawn again
+	// if it moved, blinked, or something on its line was drawn over it.
+	shown = frame_mode(DECTCEM) && !frame->scrolled_back &&
+		!(frame->timer_count / 2 % 2);
+	repaint = canvas->cursor_x != frame->cursor_x ||
+		canvas->cursor_y != frame->cursor_y ||
+		canvas->cursor_drawn != shown;
+
+	if (repaint && canvas->cursor_y < frame->height)
+		damage_cells(canvas->cursor_y, canvas->cursor_x,
+			canvas->cursor_x + 1);
+
+	line = frame->lines[frame->cursor_y];
+	repaint |= line->damage_start < line->damage_end;
+	find_rows();
+	render_rows();
+
+	for (y = 0; y < frame->height; y++)
+		if (frame->lines[y]->blinks)
+			blinks = true;
+
+	canvas->cursor_x = frame->cursor_x;
+	canvas->cursor_y = frame->cursor_y;
+	canvas->cursor_drawn = shown;
+
+	if (shown && repaint) {
+		cw = CHARWIDTH * (line->dimensions ? 2 : 1);
+		set_clip(frame->cursor_x * cw, frame->cursor_y * CHARHEIGHT, cw,
+			CHARHEIGHT);
+		fill_clip(canvas->pixels,
+			pack_color(default_attrs.fg_truecolor ?
+			default_attrs.foreground :
+			frame->palette[default_attrs.foreground.r]));
+		mark_upload(frame->cursor_y * CHARHEIGHT,
+			(frame->cursor_y + 1) * CHARHEIGHT);
+	}
+
+	cells_drawn += band_cells;
+	pixels_drawn += band_pixels;
+	band_cells = band_pixels = 0;
+	return blinks;
+}
+
+// The cursor moves with the line it was drawn on, unless that line scrolled
+// out of the region, and the shift has been dealt with. Both renderers keep
+// where they drew the cursor, and call this once they have shifted their own
+// copy of a snapshot's lines.
+void
+follow_shift(struct snapshot *snapshot, short *cursor_y)
+{
+	if (*cursor_y >= snapshot->shift_top &&
+		*cursor_y <= snapshot->shift_bottom) {
+		*cursor_y -= snapshot->shift;
+
+		if (*cursor_y < snapshot->shift_top ||
+			*cursor_y > snapshot->shift_bottom)
+			*cursor_y = snapshot->height;
+	}
+
+	snapshot->shift = 0;
+}
+
+// Both renderers draw a line as spans of cells in the same style, which the
+// functions from here to blank_cell() work out for them.
+void
+init_spans()
+{
+	space_blank = glyph_blank(find_glyph(0x20));
+}
+
+// Returns where the span of cells starting at start ends: at the first cell in
+// another style or highlighted differently, or at limit.
+int
+span_end(const struct line *line, const bool *highlights, int start, int limit)
+{
+	int x;
+
+	for (x = start; x < limit &&
+		line->cells[x].style == line->cells[start].style &&
+		highlights[x] == highlights[start];
+		x += cell_columns(&line->cells[x]))
+		;
+
+	return x;
+}
+
+// Works out the colors of a span's cells once for all of them.
+void
+span_colors(const struct snapshot *snapshot, const struct style *style,
+	bool highlight, struct color *fgp, struct color *bgp)
+{
+	struct color swap;
+	bool negative;
+
+	*bgp = style->bg_truecolor ? style->background :
+		snapshot->palette[style->background.r];
+	*fgp = style->fg_truecolor ? style->foreground :
+		snapshot->palette[style->foreground.r];
+
+	// Search matches are picked out the same way negative text is.
+	negative = snapshot->mode & DECSCNM;
+
+	if (negative ^ style->negative ^ highlight) {
+		swap = *bgp;
+		*bgp = *fgp;
+		*fgp = swap;
+	}
+}
+
+// Returns whether a cell shows nothing but its background whatever the blink
+// phase, being blank without decorations.
+bool
+blank_cell(const struct cell *cell, const struct style *style)
+{
+	return space_blank && !cell->wide &&
+		(!cell->code_point || cell->code_point == 0x20) &&
+		!style->underline && !style->crossed_out && !style->overline;
+}
+
+static bool
+frame_mode(long flag)
+{
+	return frame->mode & flag;
+}
+
+static void
+damage_cells(int y, int start, int end)
+{
+	damage_line(frame->lines[y], frame->width, start, end);
+}
+
+static void
+damage_frame()
+{
+	int y;
+
+	for (y = 0; y < frame->height; y++)
+		damage_cells(y, 0, frame->width);
+
+	frame->shift = 0;
+}
+
+static void
+resize_framebuffer()
+{
+	free(canvas->pixels);
+
+	if (!(canvas->pixels = calloc(frame->window_width *
+		frame->window_height, 4)))
+		pdie("failed to allocate framebuffer memory");
+
+	canvas->width = frame->window_width;
+	canvas->height = frame->window_height;
+	damage_frame();
+}
+
+// Moves the pixels of the lines the screen scrolled. If part of the region is
+// outside the canvas, its lines are all drawn again instead.
+static void
+shift_framebuffer()
+{
+	size_t stride;
+	int top, bottom, rows, y;
+
+	stride = canvas->width * 4;
+	top = frame->shift_top * CHARHEIGHT;
+	bottom = (frame->shift_bottom + 1) * CHARHEIGHT;
+	rows = (frame->shift > 0 ? frame->shift : -frame->shift) * CHARHEIGHT;
+
+	if (bottom > canvas->height) {
+		for (y = frame->shift_top; y <= frame->shift_bottom; y++)
+			damage_cells(y, 0, frame->width);
+
+		frame->shift = 0;
+		return;
+	}
+
+	if (frame->shift > 0)
+		memmove(&canvas->pixels[top * stride],
+			&canvas->pixels[(top + rows) * stride],
+			(bottom - top - rows) * stride);
+	else
+		memmove(&canvas->pixels[(top + rows) * stride],
+			&canvas->pixels[top * stride],
+			(bottom - top - rows) * stride);
+
+	mark_upload(top, bottom);
+	follow_shift(frame, &canvas->cursor_y);
+}
+
+static void
+mark_upload(int top, int bottom)
+{
+	if (canvas->upload_top >= canvas->upload_bottom) {
+		canvas->upload_top = top;
+		canvas->upload_bottom = bottom;
+	} else {
+		if (top < canvas->upload_top)
+			canvas->upload_top = top;
+
+		if (bottom > canvas->upload_bottom)
+			canvas->upload_bottom = bottom;
+	}
+
+	if (canvas->upload_bottom > frame->window_height)
+		canvas->upload_bottom = frame->window_height;
+}
+
+static void
+damage_blinking()
+{
+	int y;
+
+	canvas->blink_phase = frame->timer_count % 4;
+
+	for (y = 0; y < frame->height; y++)
+		if (frame->lines[y]->blinks)
+			damage_cells(y, 0, frame->width);
+}
+
+// Lists the lines that need drawing, and marks them to be uploaded.
+static void
+find_rows()
+{
+	int y;
+
+	if (frame->height > row_capacity) {
+		free(rows);
+		row_capacity = frame->height;
+
+		if (!(rows = malloc(row_capacity * sizeof(*rows))))
+			pdie("failed to allocate raster memory");
+	}
+
+	for (row_count = 0, y = frame->height - 1; y >= 0; y--) {
+		if (frame->lines[y]->damage_start >=
+			frame->lines[y]->damage_end)
+			continue;
+
+		rows[row_count++] = y;
+		mark_upload(y * CHARHEIGHT, (y + 1) * CHARHEIGHT);
+	}
+}
+
+// Draws the lines find_rows() listed, handing them out in bands if there are
+// enough and waiting until every band is done.
+static void
+render_rows()
+{
+	int i;
+
+	if (!worker_count || row_count < PARALLEL_ROWS) {
+		for (i = 0; i < row_count; i++)
+			render_line(rows[i]);
+
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	next_band = 0;
+	band_count = bands_left = (row_count + BAND_ROWS - 1) / BAND_ROWS;
+	generation++;
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&pool_lock);
+
+	while (render_band())
+		;
+
+	pthread_mutex_lock(&pool_lock);
+
+	while (bands_left)
+		pthread_cond_wait(&work_done, &pool_lock);
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+// Runs on each worker, which helps with every frame split up into bands.
+static void *
+work(void *unused __attribute__((unused)))
+{
+	unsigned long seen;
+
+	pthread_mutex_lock(&pool_lock);
+	seen = generation;
+
+	for (;;) {
+		while (generation == seen)
+			pthread_cond_wait(&work_ready, &pool_lock);
+
+		seen = generation;
+		pthread_mutex_unlock(&pool_lock);
+
+		while (render_band())
+			;
+
+		pthread_mutex_lock(&pool_lock);
+	}
+
+	return NULL;
+}
+
+// Takes the next band no one has taken and draws it, and returns whether there
+// was one. Bands are lines of the canvas no other band touches, so they are
+// drawn without holding the lock.
+static bool
+render_band()
+{
+	int band, i;
+
+	pthread_mutex_lock(&pool_lock);
+
+	if ((band = next_band) >= band_count) {
+		pthread_mutex_unlock(&pool_lock);
+		return false;
+	}
+
+	next_band++;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = band * BAND_ROWS; i < row_count && i < (band + 1) * BAND_ROWS;
+		i++)
+		render_line(rows[i]);
+
+	pthread_mutex_lock(&pool_lock);
+	cells_drawn += band_cells;
+	pixels_drawn += band_pixels;
+	band_cells = band_pixels = 0;
+
+	if (!--bands_left)
+		pthread_cond_signal(&work_done);
+
+	pthread_mutex_unlock(&pool_lock);
+	return true;
+}
+
+// Redraws the damaged part of a line, a span of cells in the same style at a
+// time. Double-width glyphs cover the cell after them, so the line has to be
+// walked from the start to find where cells begin.
+static void
+render_line(int y)
+{
+	struct line *line;
+	bool *highlights;
+	int x, end;
+
+	line = frame->lines[y];
+	highlights = snapshot_highlights(frame, y);
+
+	for (x = 0; x < line->damage_end; x = end) {
+		if ((end = x + cell_columns(&line->cells[x])) <=
+			line->damage_start)
+			continue;
+
+		end = span_end(line, highlights, x, line->damage_end);
+		render_span(y, x, end, highlights[x]);
+	}
+
+	line->damage_start = line->damage_end = 0;
+}
+
+// Draws the cells of line y from start to end, which all have the same style
+// and colors. Runs of cells that show nothing but their background, such as
+// blanks, are filled in one go without looking up a glyph.
+static void
+render_span(int y, int start, int end, bool highlight)
+{
+	struct line *line;
+	struct cell *cells;
+	const struct style *style;
+	uint32_t fg, bg, coverage[CHARHEIGHT];
+	int x, n, cw;
+
+	line = frame->lines[y];
+	cells = line->cells;
+	style = &frame->styles[cells[start].style];
+	cw = CHARWIDTH * (line->dimensions ? 2 : 1);
+	span_pixels(style, highlight, &fg, &bg);
+
+	if (style->blink)
+		line->blinks = true;
+
+	for (x = start; x < end; x += n) {
+		n = cell_columns(&cells[x]);
+
+		if (!plain_cell(&cells[x], style)) {
+			set_clip(x * cw, y * CHARHEIGHT, n * cw, CHARHEIGHT);
+			band_cells++;
+			cover_cell(coverage, line->dimensions, &cells[x],
+				style);
+			blit_cell(canvas->pixels, coverage, x * cw,
+				y * CHARHEIGHT, fg, bg);
+			continue;
+		}
+
+		for (band_cells++; x + n < end &&
+			plain_cell(&cells[x + n], style);
+			n += cell_columns(&cells[x + n]))
+			band_cells++;
+
+		set_clip(x * cw, y * CHARHEIGHT, n * cw, CHARHEIGHT);
+		fill_clip(canvas->pixels, bg);
+	}
+}
+
+// Works out the pixels of a span's cells once for all of them. Faint text is
+// drawn at half brightness, which the instanced renderer leaves to its shader.
+static void
+span_pixels(const struct style *style, bool highlight, uint32_t *fgp,
+	uint32_t *bgp)
+{
+	struct color bg, fg;
+
+	span_colors(frame, style, highlight, &fg, &bg);
+
+	if (style->intensity == INTENSITY_FAINT) {
+		fg.r /= 2;
+		fg.g /= 2;
+		fg.b /= 2;
+	}
+
+	*fgp = pack_color(fg);
+	*bgp = pack_color(bg);
+}
+
+// Returns whether a cell shows nothing but its background: it is blank and
+// has no decorations, or its text is blinked off.
+static bool
+plain_cell(const struct cell *cell, const struct style *style)
+{
+	if (style->blink == BLINK_SLOW && frame->timer_count / 2 % 2)
+		return true;
+
+	if (style->blink == BLINK_FAST && frame->timer_count % 2)
+		return true;
+
+	return blank_cell(cell, style);
+}
+
+static void
+set_clip(int x, int y, int width, int height)
+{
+	clip_left = x;
+	clip_top = y;
+	clip_right = x + width < frame->window_width ? x + width :
+		frame->window_width;
+	clip_bottom = y + height < frame->window_height ? y + height :
+		frame->window_height;
+
+	if (clip_right > clip_left && clip_bottom > clip_top)
+		band_pixels += (clip_right - clip_left) *
+			(clip_bottom - clip_top);
+}
+
+// Works out which pixels of a cell its glyph and decorations cover, so that
+// blit_cell() can write each row in one pass.
+static void
+cover_cell(uint32_t *coverage, char dim, const struct cell *cell,
+	const struct style *style)
+{
+	const unsigned char *glyph;
+	bool dbl;
+
+	memset(coverage, 0, sizeof(*coverage) * CHARHEIGHT);
+	glyph = find_glyph(cell->code_point ? cell->code_point : 0x20);
+	dbl = cell->wide;
+
+	render_glyph(coverage, 0, 0, dim, false, glyph);
+
+	if (style->intensity == INTENSITY_BOLD)
+		render_glyph(coverage, 1, 0, dim, false, glyph);
+
+	if (style->underline)
+		render_glyph(coverage, 0, 0, dim, dbl, find_glyph(0x0332));
+
+	// The second underline goes above the first to stay inside the cell.
+	if (style->underline == UNDERLINE_DOUBLE)
+		render_glyph(coverage, 0, -2, dim, dbl, find_glyph(0x0332));
+
+	if (style->crossed_out)
+		render_glyph(coverage, 0, 0, dim, dbl, find_glyph(0x2015));
+
+	if (style->overline)
+		render_glyph(coverage, 0, 0, dim, dbl, find_glyph(0x0305));
+}
+
+// Adds the pixels of a glyph drawn at (dx, dy) within the cell to coverage,
+// which holds one row of the cell per element, most significant bit first.
+static void
+render_glyph(uint32_t *coverage, int dx, int dy, char dim,
+	bool double_wide_glyph, const unsigned char *glyph)
+{
+	// Code points without a glyph have an empty entry.
+	if (!glyph || !glyph[0])
+		return;
+
+	if (double_wide_glyph)
+		render_glyph(coverage, dx + (dim ? 16 : 8), dy, dim, false, glyph);
+
+	if (dim)
+		render_scaled(coverage, dx, dy, dim, glyph);
+	else
+		render_unscaled(coverage, dx, dy, glyph);
+}
+
+static void
+render_unscaled(uint32_t *coverage, int dx, int dy, const unsigned char *glyph)
+{
+	int row, y;
+	uint32_t bits;
+
+	for (row = 0; row < CHARHEIGHT; row++) {
+		if ((y = dy + row) < 0 || y >= CHARHEIGHT)
+			continue;
+
+		if (glyph[0] == 1)
+			bits = (uint32_t)glyph[1 + row] << 24;
+		else
+			bits = (uint32_t)glyph[1 + row * 2] << 24 |
+				(uint32_t)glyph[2 + row * 2] << 16;
+
+		coverage[y] |= bits >> dx;
+	}
+}
+
+// Adds a glyph at twice its width, and at twice its height showing only the
+// top or bottom half if the line is double-height.
+static void
+render_scaled(uint32_t *coverage, int dx, int dy, char dim,
+	const unsigned char *glyph)
+{
+	int row, first, last, y;
+	uint32_t bits;
+
+	first = dim == DOUBLE_HEIGHT_BOTTOM ? CHARHEIGHT / 2 : 0;
+	last = dim == DOUBLE_HEIGHT_TOP ? CHARHEIGHT / 2 : CHARHEIGHT;
+
+	for (row = first; row < last; row++) {
+		if (glyph[0] == 1)
+			bits = (uint32_t)doubled_bits[glyph[1 + row]] << 16;
+		else
+			bits = (uint32_t)doubled_bits[glyph[1 + row * 2]] << 16 |
+				doubled_bits[glyph[2 + row * 2]];
+
+		bits >>= dx;
+
+		if (dim == DOUBLE_WIDTH) {
+			if ((y = dy + row) >= 0 && y < CHARHEIGHT)
+				coverage[y] |= bits;
+		} else {
+			y = dy + (row - first) * 2;
+
+			if (y >= 0 && y < CHARHEIGHT)
+				coverage[y] |= bits;
+
+			if (++y >= 0 && y < CHARHEIGHT)
+				coverage[y] |= bits;
+		}
+	}
+}
+
+// Writes the clipped part of a cell drawn at (px, py). Pixels are written
+// eight at a time, using blit_masks to pick foreground or background.
+static void
+blit_cell(unsigned char *buffer, const uint32_t *coverage, int px, int py,
+	uint32_t fg, uint32_t bg)
+{
+	uint32_t *row, bits, diff;
+	const uint32_t *mask;
+	int shift, x, y, width;
+#ifdef __SSE2__
+	__m128i wide_bg, wide_diff;
+#else
+	int i;
+#endif
+
+	shift = px - clip_left;
+	width = clip_right - clip_left;
+	diff = fg ^ bg;
+#ifdef __SSE2__
+	wide_bg = _mm_set1_epi32(bg);
+	wide_diff = _mm_set1_epi32(diff);
+#endif
+
+	for (y = clip_top; y < clip_bottom; y++) {
+		bits = y - py >= 0 && y - py < CHARHEIGHT &&
+			shift < 32 && shift > -32 ? coverage[y - py] : 0;
+		bits = shift >= 0 ? bits >> shift : bits << -shift;
+		row = (uint32_t *)buffer + (size_t)y * frame->window_width +
+			clip_left;
+
+		for (x = 0; x + 8 <= width; x += 8, bits <<= 8) {
+			mask = blit_masks[bits >> 24];
+#ifdef __SSE2__
+			_mm_storeu_si128((__m128i *)&row[x], _mm_xor_si128(wide_bg,
+				_mm_and_si128(wide_diff,
+				_mm_loadu_si128((const __m128i *)mask))));
+			_mm_storeu_si128((__m128i *)&row[x + 4], _mm_xor_si128(wide_bg,
+				_mm_and_si128(wide_diff,
+				_mm_loadu_si128((const __m128i *)&mask[4]))));
+#else
+			for (i = 0; i < 8; i++)
+				row[x + i] = bg ^ (diff & mask[i]);
+#endif
+		}
+
+		for (; x < width; x++, bits <<= 1)
+			row[x] = bits & 0x80000000 ? fg : bg;
+	}
+}
+
+static void
+fill_clip(unsigned char *buffer, uint32_t pixel)
+{
+	uint32_t *row;
+	int x, y;
+
+	for (y = clip_top; y < clip_bottom; y++) {
+		row = (uint32_t *)buffer + (size_t)y * frame->window_width;
+
+		for (x = clip_left; x < clip_right; x++)
+			row[x] = pixel;
+	}
+}
+
+static uint32_t
+pack_color(struct color color)
+{
+	unsigned char bytes[4];
+	uint32_t pixel;
+
+	bytes[0] = color.r;
+	bytes[1] = color.g;
+	bytes[2] = color.b;
+	// TODO : determine background color much more flexibly
+	bytes[3] = memcmp(&color, frame->palette, sizeof(color)) ? 255 : 0;
+	memcpy(&pixel, bytes, sizeof(pixel));
+
+	return pixel;
+}
\ No newline at end of file
@@ -0,0 +1,1089 @@
+// record.c - recording what the shell writes and playing it back
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "terminix.h"
+
+// A recording starts with MAGIC and the size of the screen, followed by
+// records that are only ever appended, with numbers written by put_number().
+//
+//	OUTPUT	 time since the last output, length, what was read
+//	RESIZE	 time, offset, width, height
+//	KEYFRAME time, offset, length, the screen packed by pack_screen()
+//
+// Times are in ns since the recording started. Offsets count the bytes of
+// output before the record takes effect, since output is recorded by the
+// pseudoterminal reader as it is read while the rest are recorded by the main
+// thread once it has parsed that far, and either can get ahead of the other.
+#define MAGIC "terminix recording 1\n"
+
+enum { OUTPUT = 'o', RESIZE = 'r', KEYFRAME = 'k' };
+
+// The screen is packed into a keyframe whenever KEYFRAME_INTERVAL ns or
+// KEYFRAME_BYTES of output have gone by since the last one, so that seeking
+// never has to parse much more than that.
+#define KEYFRAME_INTERVAL 5000000000
+#define KEYFRAME_BYTES (4 << 20)
+
+// Playing back as fast as possible, at most REPLAY_BATCH bytes are parsed
+// each time round the main loop, so that frames keep being drawn.
+#define REPLAY_BATCH (1 << 20)
+
+// The writer takes whatever was recorded since it last looked and writes it
+// out WRITE_BATCH records at a time.
+#define WRITE_BATCH 512
+
+// Records wait in pending until the writer thread swaps it for writing, which
+// it then writes out. Output is written straight from where the reader read it
+// into, which the reader does not reuse until written says it has gone out.
+// Other records are packed into memory of their own, which is freed once they
+// are written. end is how much output had been recorded once a record was
+// written, or 0 for those that are not output.
+struct entry {
+	const void	*data;
+	size_t		 size, end;
+	bool		 owned;
+	unsigned char	 header_size, header[32];
+};
+
+// recorded and last_time belong to the reader, and keyframe_offset and
+// keyframe_time to the main thread.
+struct recorder {
+	int		 fd;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 ready;
+	struct entry	*pending, *writing;
+	size_t		 pending_count, pending_capacity, writing_capacity;
+	bool		 stopping, failed;
+	atomic_size_t	 written;
+	size_t		 recorded, keyframe_offset;
+	uint64_t	 start, last_time, keyframe_time;
+	void		 (*made_room)(void *);
+	void		*argument;
+};
+
+// Output is played back a chunk at a time, each one read at time and offset
+// bytes into the output. Resizes and keyframes are events; a resize applies
+// once playback gets to both its offset and its time, and a keyframe is passed
+// over once playback gets to its offset.
+struct chunk {
+	const unsigned char	*data;
+	size_t			 size, offset;
+	uint64_t		 time;
+};
+
+struct event {
+	const unsigned char	*data;
+	size_t			 size, offset;
+	uint64_t		 time;
+	int			 kind, width, height;
+};
+
+// A replay maps the whole recording and finds every record in it up front.
+// Playback is at position bytes into the output, with chunk and event the next
+// of each to go. It plays speed times as fast as it was recorded, or as fast as
+// it can if speed is 0; clock is when it started or last sought, and from is
+// the time in the recording it started from.
+struct replay {
+	unsigned char	*map;
+	size_t		 map_size, position, chunk, event;
+	struct chunk	*chunks;
+	struct event	*events;
+	size_t		 chunk_count, event_count;
+	int		 width, height;
+	double		 speed;
+	uint64_t	 clock, from;
+	bool		 started;
+};
+
+// Bounds-checked reading of a recording, which may have been cut off part way
+// through a record. bad is set once something runs off the end.
+struct reader {
+	const unsigned char	*p, *end;
+	bool			 bad;
+};
+
+// The styles of the keyframe being packed.
+static struct style_numbering keyframe_styles;
+
+static void push(struct recorder *, struct entry *);
+static void *write_recording(void *);
+static void write_entries(struct recorder *, struct entry *, size_t);
+static bool write_all(int, struct iovec *, int);
+static size_t pack_screen(unsigned char **);
+static unsigned char *pack_cursor(unsigned char *, const struct cursor *);
+static unsigned char *pack_style(unsigned char *, const struct style *);
+static void index_replay(struct replay *, const char *);
+static void *grow_array(void *, size_t, size_t *, size_t);
+static size_t play(struct replay *, uint64_t, size_t);
+static void apply_event(const struct event *);
+static void unpack_screen(const struct event *);
+static void unpack_cursor(struct reader *, struct cursor *);
+static void unpack_style(struct reader *, struct style *);
+static uint64_t read_number(struct reader *);
+static uint64_t read_bounded(struct reader *, uint64_t);
+static unsigned char get_byte(struct reader *);
+static const unsigned char *get_bytes(struct reader *, size_t);
+
+// Starts recording to path, which is replaced if it exists. made_room is called
+// with argument on the writer thread whenever output has been written out.
+struct recorder *
+start_recording(const char *path, void (*made_room)(void *), void *argument)
+{
+	struct recorder *r;
+	struct entry entry;
+	unsigned char *p;
+
+	if (!(r = calloc(1, sizeof(*r))))
+		pdie("failed to allocate recording memory");
+
+	if ((r->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+		err(EXIT_FAILURE, "failed to open %s", path);
+
+	r->start = r->keyframe_time = monotonic_time();
+	r->made_room = made_room;
+	r->argument = argument;
+
+	if ((errno = pthread_mutex_init(&r->lock, NULL)) ||
+		(errno = pthread_cond_init(&r->ready, NULL)))
+		pdie("failed to initialize recording lock");
+
+	memset(&entry, 0, sizeof(entry));
+	memcpy(entry.header, MAGIC, sizeof(MAGIC) - 1);
+	p = put_number(&entry.header[sizeof(MAGIC) - 1], term->width);
+	p = put_number(p, term->height);
+	entry.header_size = p - entry.header;
+	push(r, &entry);
+
+	if ((errno = pthread_create(&r->thread, NULL, write_recording, r)))
+		pdie("failed to start recording writer");
+
+	return r;
+}
+
+// Writes out whatever is still waiting and closes the recording.
+void
+stop_recording(struct recorder *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stopping = true;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	if (close(r->fd) && !r->failed)
+		warn("failed to close recording");
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->ready);
+	free(r->pending);
+	free(r->writing);
+	free(r);
+}
+
+// Returns how much output has been written out, which the reader must not
+// overwrite before it is.
+size_t
+recorded_bytes(struct recorder *r)
+{
+	return atomic_load_explicit(&r->written, memory_order_acquire);
+}
+
+// Records size bytes of output just read into data, which stays where it is
+// until recorded_bytes() says it was written out. Called on the reader thread.
+void
+record_output(struct recorder *r, const void *data, size_t size)
+{
+	struct entry entry;
+	unsigned char *p;
+	uint64_t time;
+
+	time = monotonic_time() - r->start;
+	entry.data = data;
+	entry.size = size;
+	entry.end = r->recorded += size;
+	entry.owned = false;
+	entry.header[0] = OUTPUT;
+	p = put_number(&entry.header[1], time - r->last_time);
+	p = put_number(p, size);
+	entry.header_size = p - entry.header;
+	r->last_time = time;
+	push(r, &entry);
+}
+
+// Records that the screen was resized once offset bytes of output were parsed,
+// from outside the output.
+void
+record_resize(struct recorder *r, size_t offset)
+{
+	struct entry entry;
+	unsigned char *p;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.header[0] = RESIZE;
+	p = put_number(&entry.header[1], monotonic_time() - r->start);
+	p = put_number(p, offset);
+	p = put_number(p, term->width);
+	p = put_number(p, term->height);
+	entry.header_size = p - entry.header;
+	push(r, &entry);
+}
+
+// Records a keyframe of the screen as it is once offset bytes of output were
+// parsed, if one is due.
+void
+record_screen(struct recorder *r, size_t offset)
+{
+	struct entry entry;
+	unsigned char *data, *p;
+	uint64_t now;
+
+	now = monotonic_time();
+
+	if (offset == r->keyframe_offset ||
+		(offset - r->keyframe_offset < KEYFRAME_BYTES &&
+		now - r->keyframe_time < KEYFRAME_INTERVAL))
+		return;
+
+	r->keyframe_offset = offset;
+	r->keyframe_time = now;
+	entry.size = pack_screen(&data);
+	entry.data = data;
+	entry.end = 0;
+	entry.owned = true;
+	entry.header[0] = KEYFRAME;
+	p = put_number(&entry.header[1], now - r->start);
+	p = put_number(p, offset);
+	p = put_number(p, entry.size);
+	entry.header_size = p - entry.header;
+	push(r, &entry);
+}
+
+static void
+push(struct recorder *r, struct entry *entry)
+{
+	pthread_mutex_lock(&r->lock);
+
+	if (r->pending_count == r->pending_capacity) {
+		r->pending_capacity = r->pending_capacity ?
+			r->pending_capacity * 2 : WRITE_BATCH;
+
+		if (!(r->pending = realloc(r->pending,
+			r->pending_capacity * sizeof(*r->pending))))
+			pdie("failed to allocate recording memory");
+	}
+
+	r->pending[r->pending_count++] = *entry;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// Runs on the writer thread, writing out whatever was recorded as it comes in
+// until stop_recording() says to finish.
+static void *
+write_recording(void *argument)
+{
+	struct recorder *r;
+	struct entry *entries;
+	size_t count, capacity;
+
+	r = argument;
+	pthread_mutex_lock(&r->lock);
+
+	for (;;) {
+		while (!r->pending_count && !r->stopping)
+			pthread_cond_wait(&r->ready, &r->lock);
+
+		if (!r->pending_count)
+			break;
+
+		entries = r->pending;
+		count = r->pending_count;
+		capacity = r->pending_capacity;
+		r->pending = r->writing;
+		r->pending_capacity = r->writing_capacity;
+		r->pending_count = 0;
+		r->writing = entries;
+		r->writing_capacity = capacity;
+		pthread_mutex_unlock(&r->lock);
+
+		write_entries(r, entries, count);
+		pthread_mutex_lock(&r->lock);
+	}
+
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+// Writes out count entries, each one's header and then its data where it
+// already is. Once a write fails, the rest of the recording is dropped, but
+// the output is still let go of so that the terminal carries on.
+static void
+write_entries(struct recorder *r, struct entry *entries, size_t count)
+{
+	struct iovec iov[WRITE_BATCH * 2];
+	size_t i, end, done;
+	int n;
+
+	for (done = 0; done < count; done = i) {
+		for (n = 0, end = 0, i = done; i < count &&
+			n < WRITE_BATCH * 2; i++) {
+			iov[n].iov_base = entries[i].header;
+			iov[n++].iov_len = entries[i].header_size;
+			iov[n].iov_base = (void *)entries[i].data;
+			iov[n++].iov_len = entries[i].size;
+
+			if (entries[i].end)
+				end = entries[i].end;
+		}
+
+		if (!r->failed && !write_all(r->fd, iov, n)) {
+			warn("failed to write recording; recording stopped");
+			r->failed = true;
+		}
+
+		for (; done < i; done++)
+			if (entries[done].owned)
+				free((void *)entries[done].data);
+
+		if (end) {
+			atomic_store_explicit(&r->written, end,
+				memory_order_release);
+			r->made_room(r->argument);
+		}
+	}
+}
+
+// Writes all of count buffers, however many goes that takes.
+static bool
+write_all(int fd, struct iovec *iov, int count)
+{
+	ssize_t n;
+
+	while (count) {
+		if ((n = writev(fd, iov, count)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		for (; count && (size_t)n >= iov->iov_len; count--, iov++)
+			n -= iov->iov_len;
+
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+// Packs everything the escape codes can change about the screen into memory of
+// its own, leaving out the history, and returns how big it came out. Lines are
+// packed as their code points, each shifted up a bit to make room for whether
+// it is wide, followed by the runs of cells in the same style.
+static size_t
+pack_screen(unsigned char **data)
+{
+	static uint16_t run_lengths[UINT16_MAX], run_styles[UINT16_MAX];
+	const struct parser *parser;
+	const struct line *line;
+	const struct cell *cells;
+	unsigned char *lines, *p;
+	size_t size;
+	int used, x, y, start, runs, i;
+
+	// Styles are only known once every line is packed, so the lines are
+	// packed on their own and copied in after them.
+	size = 4096 + term->height * (16 + term->width * 24);
+
+	if (!(lines = malloc(size)) || !(*data = malloc(size +
+		(term->width * term->height + 3) * 32)))
+		pdie("failed to allocate keyframe memory");
+
+	start_numbering(&keyframe_styles);
+	number_style(&keyframe_styles, 0);
+
+	for (p = lines, y = 0; y < term->height; y++) {
+		line = term->lines[y];
+		cells = line->cells;
+
+		for (used = term->width; used; used--)
+			if (cells[used - 1].code_point || cells[used - 1].style)
+				break;
+
+		*p++ = line->dimensions;
+		*p++ = line->wrapped;
+		p = put_number(p, used);
+
+		for (runs = 0, start = 0, x = 0; x < used; x++) {
+			p = put_number(p, (uint64_t)cells[x].code_point << 1 |
+				cells[x].wide);
+
+			if (x + 1 == used ||
+				cells[x + 1].style != cells[start].style) {
+				run_lengths[runs] = x + 1 - start;
+				run_styles[runs++] = number_style(
+					&keyframe_styles, cells[start].style);
+				start = x + 1;
+			}
+		}
+
+		p = put_number(p, runs);
+
+		for (i = 0; i < runs; i++) {
+			p = put_number(p, run_lengths[i]);
+			p = put_number(p, run_styles[i]);
+		}
+	}
+
+	parser = &term->parser;
+	size = p - lines;
+	p = put_number(*data, term->width);
+	p = put_number(p, term->height);
+	p = put_number(p, term->mode);
+	p = put_number(p, term->scroll_top);
+	p = put_number(p, term->scroll_bottom);
+	p = pack_cursor(p, &term->cursor);
+	p = pack_cursor(p, &term->saved_cursor);
+
+	for (x = 0; x < term->width; x++)
+		*p++ = term->tabstops[x];
+
+	for (i = 0; i < 256; i++) {
+		*p++ = term->palette[i].r;
+		*p++ = term->palette[i].g;
+		*p++ = term->palette[i].b;
+	}
+
+	p = put_number(p, parser->state);
+	p = put_number(p, parser->vt52_state);
+	*p++ = parser->intermediates[0];
+	*p++ = parser->intermediates[1];
+
+	for (i = 0; i < MAX_PARAMETERS; i++)
+		p = put_number(p, parser->parameters[i]);
+
+	p = put_number(p, parser->parameter_index);
+	p = put_number(p, parser->osc_size);
+	p = put_number(p, parser->osc_data_offset);
+	memcpy(p, parser->osc, parser->osc_size);
+	p += parser->osc_size;
+	p = put_number(p, parser->sequence_size);
+	*p++ = parser->sequence_lower;
+	*p++ = parser->sequence_upper;
+	p = put_number(p, parser->code_point);
+
+	p = put_number(p, keyframe_styles.count);
+
+	for (i = 0; i < keyframe_styles.count; i++)
+		p = pack_style(p, &keyframe_styles.styles[i]);
+
+	memcpy(p, lines, size);
+	p += size;
+	free(lines);
+	return p - *data;
+}
+
+// Packs the cursor, with its character sets numbered in the order
+// charset_number() in unpack_cursor() reads them back.
+static unsigned char *
+pack_cursor(unsigned char *p, const struct cursor *cursor)
+{
+	const uint32_t *charset;
+	int i;
+
+	p = pack_style(p, &cursor->attrs);
+
+	for (i = 0; i < 4; i++) {
+		charset = cursor->logical_charsets[i];
+		*p++ = charset == charset_united_kingdom ? 1 :
+			charset == charset_dec_graphics ? 2 :
+			charset == charset_vt52_graphics ? 3 : 0;
+	}
+
+	*p++ = cursor->active_charsets[GL];
+	*p++ = cursor->active_charsets[GR];
+	p = put_number(p, cursor->x);
+	p = put_number(p, cursor->y);
+	*p++ = cursor->conceal;
+	*p++ = cursor->last_column;
+	return p;
+}
+
+static unsigned char *
+pack_style(unsigned char *p, const struct style *style)
+{
+	*p++ = style->background.r;
+	*p++ = style->background.g;
+	*p++ = style->background.b;
+	*p++ = style->foreground.r;
+	*p++ = style->foreground.g;
+	*p++ = style->foreground.b;
+
+	return put_number(p, style->font | style->intensity << 4 |
+		style->blink << 6 | style->underline << 8 | style->frame << 10 |
+		style->italic << 12 | style->negative << 13 |
+		style->crossed_out << 14 | style->fraktur << 15 |
+		style->overline << 16 | style->bg_truecolor << 17 |
+		style->fg_truecolor << 18);
+}
+
+// Maps the recording at path to play it back speed times as fast as it was
+// recorded, or as fast as possible if speed is 0. Nothing changes on screen
+// until seek_replay() puts it where playback starts.
+struct replay *
+open_replay(const char *path, double speed)
+{
+	struct replay *r;
+	struct stat st;
+	int fd;
+
+	if (!(r = calloc(1, sizeof(*r))))
+		pdie("failed to allocate replay memory");
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+		err(EXIT_FAILURE, "failed to open %s", path);
+
+	if (fstat(fd, &st))
+		err(EXIT_FAILURE, "failed to get size of %s", path);
+
+	if ((size_t)st.st_size < sizeof(MAGIC) - 1)
+		errx(EXIT_FAILURE, "%s is not a recording", path);
+
+	r->map_size = st.st_size;
+
+	if ((r->map = mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fd,
+		0)) == MAP_FAILED)
+		err(EXIT_FAILURE, "failed to map %s", path);
+
+	close(fd);
+	madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+	r->speed = speed;
+	index_replay(r, path);
+	return r;
+}
+
+void
+close_replay(struct replay *r)
+{
+	munmap(r->map, r->map_size);
+	free(r->chunks);
+	free(r->events);
+	free(r);
+}
+
+// Finds every record in the recording. One that was cut off part way through,
+// as the last one is if terminix never got to finish writing it, ends it.
+static void
+index_replay(struct replay *r, const char *path)
+{
+	struct reader in;
+	struct chunk *chunk;
+	struct event event;
+	const unsigned char *record;
+	size_t offset, chunk_capacity, event_capacity;
+	uint64_t time;
+	int kind;
+
+	if (memcmp(r->map, MAGIC, sizeof(MAGIC) - 1))
+		errx(EXIT_FAILURE, "%s is not a recording", path);
+
+	in.p = r->map + sizeof(MAGIC) - 1;
+	in.end = r->map + r->map_size;
+	in.bad = false;
+	r->width = read_number(&in);
+	r->height = read_number(&in);
+
+	if (in.bad || r->width < 1 || r->height < 1 || r->width > SHRT_MAX ||
+		r->height > SHRT_MAX)
+		errx(EXIT_FAILURE, "%s is not a recording", path);
+
+	offset = time = chunk_capacity = event_capacity = 0;
+
+	while (in.p < in.end) {
+		record = in.p;
+		kind = *in.p++;
+		memset(&event, 0, sizeof(event));
+		event.kind = kind;
+
+		switch (kind) {
+		case OUTPUT:
+			time += read_number(&in);
+			event.size = read_number(&in);
+			event.data = get_bytes(&in, event.size);
+			break;
+		case RESIZE:
+			event.time = read_number(&in);
+			event.offset = read_number(&in);
+			event.width = read_number(&in);
+			event.height = read_number(&in);
+
+			if (event.width < 1 || event.height < 1 ||
+				event.width > SHRT_MAX ||
+				event.height > SHRT_MAX)
+				in.bad = true;
+			break;
+		case KEYFRAME:
+			event.time = read_number(&in);
+			event.offset = read_number(&in);
+			event.size = read_number(&in);
+			event.data = get_bytes(&in, event.size);
+			break;
+		default:
+			in.bad = true;
+		}
+
+		if (in.bad) {
+			warnx("%s is corrupt or cut off %zu bytes in; playing "
+				"what comes before", path,
+				(size_t)(record - r->map));
+			break;
+		}
+
+		if (kind != OUTPUT) {
+			r->events = grow_array(r->events, r->event_count,
+				&event_capacity, sizeof(*r->events));
+			r->events[r->event_count++] = event;
+			continue;
+		}
+
+		r->chunks = grow_array(r->chunks, r->chunk_count,
+			&chunk_capacity, sizeof(*r->chunks));
+		chunk = &r->chunks[r->chunk_count++];
+		chunk->data = event.data;
+		chunk->size = event.size;
+		chunk->offset = offset;
+		chunk->time = time;
+		offset += event.size;
+	}
+}
+
+// Makes room in an array of count items of size bytes for one more, doubling
+// its capacity whenever it is full.
+static void *
+grow_array(void *array, size_t count, size_t *capacity, size_t size)
+{
+	if (count < *capacity)
+		return array;
+
+	*capacity = *capacity ? *capacity * 2 : 64;
+
+	if (!(array = realloc(array, *capacity * size)))
+		pdie("failed to allocate replay memory");
+
+	return array;
+}
+
+// Puts the screen where the recording was time ns in, by unpacking the last
+// keyframe before then and playing the rest from there as fast as possible.
+// Playback carries on from there the next time round.
+void
+seek_replay(struct replay *r, uint64_t time)
+{
+	const struct event *keyframe;
+	size_t low, high, middle, target, i;
+
+	// Only the output read by then is played, and no keyframe after the
+	// last of it will do.
+	for (low = 0, high = r->chunk_count; low < high; ) {
+		middle = (low + high) / 2;
+
+		if (r->chunks[middle].time <= time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	target = low < r->chunk_count ? r->chunks[low].offset :
+		r->chunk_count ? r->chunks[low - 1].offset +
+		r->chunks[low - 1].size : 0;
+
+	for (keyframe = NULL, i = r->event_count; i--; )
+		if (r->events[i].kind == KEYFRAME &&
+			r->events[i].offset <= target &&
+			r->events[i].time <= time) {
+			keyframe = &r->events[i];
+			break;
+		}
+
+	scroll_view(-term->scrollback);
+
+	if (keyframe) {
+		unpack_screen(keyframe);
+		r->position = keyframe->offset;
+		r->event = i + 1;
+	} else {
+		reset();
+		resize(r->width, r->height);
+		memset(&term->parser, 0, sizeof(term->parser));
+		r->position = r->event = 0;
+	}
+
+	for (low = 0, high = r->chunk_count; low < high; ) {
+		middle = (low + high) / 2;
+
+		if (r->chunks[middle].offset + r->chunks[middle].size <=
+			r->position)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	r->chunk = low;
+	play(r, time, SIZE_MAX);
+	r->from = time;
+	r->started = false;
+}
+
+// Plays whatever is due by now, on the clock terminix keeps, and returns how
+// many bytes of output it parsed.
+size_t
+play_replay(struct replay *r, uint64_t now)
+{
+	if (!r->started) {
+		r->clock = now;
+		r->started = true;
+	}
+
+	if (!r->speed)
+		return play(r, UINT64_MAX, REPLAY_BATCH);
+
+	return play(r, r->from + (now - r->clock) * r->speed, REPLAY_BATCH);
+}
+
+// Returns when the rest of the recording is next due to be played, on the
+// clock terminix keeps, or 0 if it has all been played.
+uint64_t
+replay_deadline(const struct replay *r)
+{
+	const struct event *event;
+	uint64_t next;
+
+	if (r->chunk == r->chunk_count && r->event == r->event_count)
+		return 0;
+
+	if (!r->started || !r->speed)
+		return 1;
+
+	event = r->event < r->event_count ? &r->events[r->event] : NULL;
+
+	if (event && (r->chunk == r->chunk_count ||
+		(event->offset <= r->position && event->kind == RESIZE)))
+		next = event->time;
+	else
+		next = r->chunks[r->chunk].time;
+
+	if (next <= r->from)
+		return r->clock;
+
+	return r->clock + (next - r->from) / r->speed;
+}
+
+// Plays at most budget bytes of what was recorded until the given time into
+// the recording, through the same parser the shell's output goes through.
+// Output that was read in one go is parsed in one go, except where an event
+// comes part way through it.
+static size_t
+play(struct replay *r, uint64_t until, size_t budget)
+{
+	const struct chunk *chunk;
+	const struct event *event;
+	size_t played, n;
+
+	for (played = 0; played < budget; played += n) {
+		event = r->event < r->event_count ? &r->events[r->event] : NULL;
+
+		if (event && event->offset <= r->position) {
+			if (event->kind == RESIZE && event->time > until)
+				break;
+
+			apply_event(event);
+			r->event++;
+			n = 0;
+			continue;
+		}
+
+		if (r->chunk == r->chunk_count ||
+			(chunk = &r->chunks[r->chunk])->time > until)
+			break;
+
+		n = chunk->offset + chunk->size - r->position;
+
+		if (n > budget - played)
+			n = budget - played;
+
+		if (event && event->offset - r->position < n)
+			n = event->offset - r->position;
+
+		vtinterp_buf(&chunk->data[r->position - chunk->offset], n);
+
+		if ((r->position += n) == chunk->offset + chunk->size)
+			r->chunk++;
+	}
+
+	return played;
+}
+
+// Keyframes are only for seeking, since playing up to one already put the
+// screen the way it says.
+static void
+apply_event(const struct event *event)
+{
+	if (event->kind == RESIZE)
+		resize(event->width, event->height);
+}
+
+// Puts the screen the way pack_screen() found it. Styles are added to the style
+// table as the cells that use them are filled in, since the table may reclaim
+// any that no cell uses yet.
+static void
+unpack_screen(const struct event *keyframe)
+{
+	static struct style styles[MAX_STYLES];
+	struct parser *parser;
+	struct reader in;
+	struct line *line;
+	struct cell *cells;
+	const unsigned char *osc;
+	uint64_t number, used, runs, length, style, x;
+	uint32_t style_count;
+	int width, height, y, i;
+
+	in.p = keyframe->data;
+	in.end = keyframe->data + keyframe->size;
+	in.bad = false;
+	width = read_bounded(&in, SHRT_MAX);
+	height = read_bounded(&in, SHRT_MAX);
+
+	if (width < 1 || height < 1)
+		die("keyframe is corrupt");
+
+	reset();
+	resize(width, height);
+	term->mode = read_number(&in);
+	term->scroll_top = read_bounded(&in, SHRT_MAX);
+	term->scroll_bottom = read_bounded(&in, SHRT_MAX);
+	unpack_cursor(&in, &term->cursor);
+	unpack_cursor(&in, &term->saved_cursor);
+
+	for (i = 0; i < width; i++)
+		term->tabstops[i] = get_byte(&in);
+
+	for (i = 0; i < 256; i++) {
+		term->palette[i].r = get_byte(&in);
+		term->palette[i].g = get_byte(&in);
+		term->palette[i].b = get_byte(&in);
+	}
+
+	parser = &term->parser;
+	memset(parser, 0, sizeof(*parser));
+	parser->state = read_bounded(&in, VT100_STATES - 1);
+	parser->vt52_state = read_bounded(&in, VT52_STATES - 1);
+	parser->intermediates[0] = get_byte(&in);
+	parser->intermediates[1] = get_byte(&in);
+
+	for (i = 0; i < MAX_PARAMETERS; i++)
+		parser->parameters[i] = read_bounded(&in, USHRT_MAX);
+
+	parser->parameter_index = read_bounded(&in, MAX_PARAMETERS - 1);
+	parser->osc_size = read_bounded(&in, sizeof(parser->osc));
+	parser->osc_data_offset = read_bounded(&in, parser->osc_size);
+
+	if ((osc = get_bytes(&in, parser->osc_size)))
+		memcpy(parser->osc, osc, parser->osc_size);
+
+	// A UTF-8 sequence has at most three bytes to go, each of which adds
+	// six bits to the code point.
+	parser->sequence_size = read_bounded(&in, 3);
+	parser->sequence_lower = get_byte(&in);
+	parser->sequence_upper = get_byte(&in);
+	parser->code_point = read_bounded(&in,
+		0x10FFFF >> 6 * parser->sequence_size);
+
+	style_count = read_bounded(&in, MAX_STYLES);
+
+	for (i = 0; i < (int)style_count; i++)
+		unpack_style(&in, &styles[i]);
+
+	for (y = 0; y < height && !in.bad; y++) {
+		line = term->lines[y];
+		cells = line->cells;
+		line->dimensions = get_byte(&in);
+		line->wrapped = get_byte(&in);
+
+		if (line->dimensions > DOUBLE_HEIGHT_BOTTOM)
+			die("keyframe is corrupt");
+
+		// Once anything is out of range, read_bounded() gives nothing
+		// but zeros, so no more cells are filled in.
+		used = read_bounded(&in, width);
+
+		for (x = 0; x < used && !in.bad; x++) {
+			number = read_bounded(&in, (uint64_t)0x10FFFF << 1 | 1);
+			cells[x].code_point = number >> 1;
+			cells[x].wide = number & 1;
+		}
+
+		runs = read_bounded(&in, used);
+
+		for (x = 0; runs-- && !in.bad; ) {
+			length = read_bounded(&in, used - x);
+
+			if ((style = read_number(&in)) >= style_count)
+				die("keyframe is corrupt");
+
+			for (style = intern_style(&styles[style]); length--; )
+				cells[x++].style = style;
+		}
+	}
+
+	if (in.bad || in.p != in.end ||
+		term->cursor.x < 0 || term->cursor.x >= width ||
+		term->cursor.y < 0 || term->cursor.y >= height ||
+		term->saved_cursor.x < 0 || term->saved_cursor.x >= width ||
+		term->saved_cursor.y < 0 || term->saved_cursor.y >= height ||
+		term->scroll_top < 0 ||
+		term->scroll_top > term->scroll_bottom ||
+		term->scroll_bottom >= height)
+		die("keyframe is corrupt");
+
+	damage_screen();
+}
+
+static void
+unpack_cursor(struct reader *in, struct cursor *cursor)
+{
+	static const uint32_t *const charsets[] = { NULL,
+		charset_united_kingdom, charset_dec_graphics,
+		charset_vt52_graphics };
+
+	unsigned number;
+	int i;
+
+	unpack_style(in, &cursor->attrs);
+	cursor->style = 0;
+
+	for (i = 0; i < 4; i++) {
+		if ((number = get_byte(in)) > 3)
+			in->bad = true;
+
+		cursor->logical_charsets[i] = charsets[number & 3];
+	}
+
+	cursor->active_charsets[GL] = get_byte(in) & 3;
+	cursor->active_charsets[GR] = get_byte(in) & 3;
+	cursor->x = read_bounded(in, SHRT_MAX);
+	cursor->y = read_bounded(in, SHRT_MAX);
+	cursor->conceal = get_byte(in);
+	cursor->last_column = get_byte(in);
+}
+
+static void
+unpack_style(struct reader *in, struct style *style)
+{
+	uint32_t bits;
+
+	memset(style, 0, sizeof(*style));
+	style->background.r = get_byte(in);
+	style->background.g = get_byte(in);
+	style->background.b = get_byte(in);
+	style->foreground.r = get_byte(in);
+	style->foreground.g = get_byte(in);
+	style->foreground.b = get_byte(in);
+	bits = read_number(in);
+	style->font = bits;
+	style->intensity = bits >> 4;
+	style->blink = bits >> 6;
+	style->underline = bits >> 8;
+	style->frame = bits >> 10;
+	style->italic = bits >> 12 & 1;
+	style->negative = bits >> 13 & 1;
+	style->crossed_out = bits >> 14 & 1;
+	style->fraktur = bits >> 15 & 1;
+	style->overline = bits >> 16 & 1;
+	style->bg_truecolor = bits >> 17 & 1;
+	style->fg_truecolor = bits >> 18 & 1;
+}
+
+// Reads a number with get_number(), unless it runs off the end or is longer
+// than put_number() ever writes.
+static uint64_t
+read_number(struct reader *in)
+{
+	const unsigned char *p;
+
+	for (p = in->p; p < in->end && p - in->p < MAX_NUMBER_SIZE; p++)
+		if (!(*p & 0x80))
+			return get_number(&in->p);
+
+	in->bad = true;
+	return 0;
+}
+
+// Reads a number with read_number() that must be no more than most, or gives 0
+// and marks the reader bad.
+static uint64_t
+read_bounded(struct reader *in, uint64_t most)
+{
+	uint64_t number;
+
+	if ((number = read_number(in)) > most) {
+		in->bad = true;
+		return 0;
+	}
+
+	return number;
+}
+
+static unsigned char
+get_byte(struct reader *in)
+{
+	if (in->p == in->end) {
+		in->bad = true;
+		return 0;
+	}
+
+	return *in->p++;
+}
+
+// Returns the next size bytes, or NULL if there are not that many left.
+static const unsigned char *
+get_bytes(struct reader *in, size_t size)
+{
+	const unsigned char *p;
+
+	if (size > (size_t)(in->end - in->p)) {
+		in->bad = true;
+		return NULL;
+	}
+
+	p = in->p;
+	in->p += size;
+	return p;
+}
@@ -17,6 +17,10 @@
 #include <string.h>
 #include "terminix.h"
 
+// The style index table is kept at most half full.
+#define STYLE_HASH_BITS 17
+#define STYLE_HASH_SIZE (1 << STYLE_HASH_BITS)
+
 static const struct color default_palette[256] = {
 	{0x00,0x00,0x00},{0x80,0x00,0x00},{0x00,0x80,0x00},{0x80,0x80,0x00},
 	{0x00,0x00,0x80},{0x80,0x00,0x80},{0x00,0x80,0x80},{0xC0,0xC0,0xC0},
@@ -111,58 +115,479 @@ const uint32_t charset_vt52_graphics[] = { 0x5E, 0x7E,
 	0x2500, 0x2500, 0x23BC, 0x23BC, 0x2080, 0x2081, 0x2082, 0x2083, 0x2084,
 	0x2085, 0x2086, 0x2087, 0x2088, 0x2089, 0x00B6 };
 
-const struct cell default_attrs = {
+const struct style default_attrs = {
 	.background = {0, 0, 0},
 	.foreground = {7, 0, 0}
 };
 
-struct color palette[256];
-long mode;
-struct cursor cursor, saved_cursor;
-bool *tabstops;
-struct line **lines;
-short screen_width, screen_height, scroll_top, scroll_bottom;
+struct terminal *term;
+
+static void scroll_lines(int, int, int, struct cell);
+static void rotate_lines(int, int, int);
+static void set_line(int, struct line *);
+static void note_shift(int, int, int);
+static void fill_cells(struct cell *, int, struct cell);
+static void grow_arenas(int, int);
+static void reflow(struct line **, int, int);
+static int used_cells(const struct line *, int);
+static void copy_cells(struct cell *, struct line **, int, int, int);
+static void resize_snapshot(struct snapshot *);
+static void shift_snapshot(struct snapshot *);
+static bool collect_styles(void);
+static uint32_t next_slot(uint32_t);
+static uint32_t hash_style(const struct style *);
+static bool same_style(const struct style *, const struct style *);
+
+// Marks cells [start, end) of row y as needing to be redrawn.
+void
+damage(int y, int start, int end)
+{
+	damage_line(visible_line(y), term->width, start, end);
+	session->redraw = true;
+}
 
 void
-deinit_screen()
+damage_screen()
 {
-	int i;
+	int y;
 
-	for (i = 0; i < screen_height; i++)
-		free(lines[i]);
+	for (y = 0; y < term->height; y++)
+		damage(y, 0, term->width);
 
-	free(lines);
-	free(tabstops);
+	term->shift = 0;
 }
 
+// Returns the style the cursor prints and erases with, adding it to the style
+// table if it changed since it was last used.
+uint16_t
+cursor_style()
+{
+	if (!same_style(&term->styles[term->cursor.style],
+		&term->cursor.attrs))
+		term->cursor.style = intern_style(&term->cursor.attrs);
+
+	return term->cursor.style;
+}
+
+// Returns the index of a style in the style table, adding it if it is new.
+uint16_t
+intern_style(const struct style *style)
+{
+	uint32_t i;
+	uint16_t id;
+
+	if (same_style(style, &term->styles[0]))
+		return 0;
+
+	for (i = hash_style(style); (id = term->style_hash[i]);
+		i = next_slot(i))
+		if (same_style(style, &term->styles[id]))
+			return id;
+
+	// If every style is still in use, fall back to the blank one.
+	if (term->style_count == MAX_STYLES && !collect_styles())
+		return 0;
+
+	for (i = hash_style(style); term->style_hash[i]; i = next_slot(i))
+		;
+
+	id = term->free_style ? term->free_styles[--term->free_style] :
+		term->style_count;
+	term->style_count++;
+	term->styles[id] = *style;
+	term->style_hash[i] = id;
+
+	if (id < term->changed_first) term->changed_first = id;
+	if (id > term->changed_last) term->changed_last = id;
+
+	return id;
+}
+
+// Frees every style that no cell, recent saved line or saved cursor refers to,
+// and rebuilds the index of the rest. Returns false if none could be freed.
+static bool
+collect_styles()
+{
+	static bool used[MAX_STYLES];
+	uint32_t i, id;
+	int x, y;
+
+	memset(used, 0, sizeof(used));
+	used[0] = used[term->cursor.style] = true;
+	used[term->saved_cursor.style] = true;
+
+	for (y = 0; y < term->height; y++)
+		for (x = 0; x < term->width; x++)
+			used[term->lines[y]->cells[x].style] = true;
+
+	// The view is marked even when it is not shown, since scroll_view()
+	// can add styles while it puts the view together.
+	for (y = 0; y < term->height; y++)
+		for (x = 0; x < term->width; x++)
+			used[term->view[y]->cells[x].style] = true;
+
+	mark_history_styles(used);
+
+	memset(term->style_hash, 0, STYLE_HASH_SIZE * sizeof(uint16_t));
+	term->free_style = 0;
+	term->style_count = 1;
+
+	for (id = 1; id < MAX_STYLES; id++) {
+		if (!used[id]) {
+			term->free_styles[term->free_style++] = id;
+			continue;
+		}
+
+		for (i = hash_style(&term->styles[id]); term->style_hash[i];
+			i = next_slot(i))
+			;
+
+		term->style_hash[i] = id;
+		term->style_count++;
+	}
+
+	return term->style_count < MAX_STYLES;
+}
+
+static uint32_t
+next_slot(uint32_t i)
+{
+	return (i + 1) % STYLE_HASH_SIZE;
+}
+
+static uint32_t
+hash_style(const struct style *style)
+{
+	uint32_t hash;
+
+	hash = style->background.r | style->background.g << 8 |
+		style->background.b << 16;
+	hash = hash * 31 + (style->foreground.r | style->foreground.g << 8 |
+		style->foreground.b << 16);
+	hash = hash * 31 + (style->font | style->intensity << 4 |
+		style->blink << 6 | style->underline << 8 | style->frame << 10 |
+		style->italic << 12 | style->negative << 13 |
+		style->crossed_out << 14 | style->fraktur << 15 |
+		style->overline << 16 | style->bg_truecolor << 17 |
+		style->fg_truecolor << 18);
+
+	return (uint32_t)(hash * 2654435761u) >> (32 - STYLE_HASH_BITS);
+}
+
+// Styles are compared field by field, since the padding around their bit
+// fields is not guaranteed to match.
+static bool
+same_style(const struct style *a, const struct style *b)
+{
+	return !memcmp(&a->background, &b->background, sizeof(a->background)) &&
+		!memcmp(&a->foreground, &b->foreground, sizeof(a->foreground)) &&
+		a->font == b->font && a->intensity == b->intensity &&
+		a->blink == b->blink && a->underline == b->underline &&
+		a->frame == b->frame && a->italic == b->italic &&
+		a->negative == b->negative && a->crossed_out == b->crossed_out &&
+		a->fraktur == b->fraktur && a->overline == b->overline &&
+		a->bg_truecolor == b->bg_truecolor &&
+		a->fg_truecolor == b->fg_truecolor;
+}
+
+// Makes a blank terminal for the current session, which resize() and reset()
+// then set up. The style table is untouched memory until styles are added.
+void
+init_screen()
+{
+	if (!(term = session->term = calloc(1, sizeof(*term))))
+		pdie("failed to allocate terminal memory");
+
+	if (!(term->styles = calloc(MAX_STYLES, sizeof(struct style))) ||
+		!(term->style_hash = calloc(STYLE_HASH_SIZE,
+		sizeof(uint16_t))) ||
+		!(term->free_styles = calloc(MAX_STYLES, sizeof(uint16_t))))
+		pdie("failed to allocate style memory");
+
+	term->style_count = 1;
+	term->changed_first = MAX_STYLES;
+}
+
+void
+deinit_screen()
+{
+	if (!term)
+		return;
+
+	free(term->arena);
+	free(term->view_arena);
+	free(term->ring);
+	free(term->spare);
+	free(term->view);
+	free(term->tabstops);
+	free(term->styles);
+	free(term->style_hash);
+	free(term->free_styles);
+	free(term);
+	term = session->term = NULL;
+}
+
+// Changes the size of the screen, rewrapping what is on it to the new width.
+// Lines that no longer fit above the cursor go into the history.
 void
 resize(int width, int height)
 {
-	int i;
+	struct line **old_lines;
+	char *old_arena, *old_view_arena;
+	struct line **old_ring, **old_spare, **old_view;
+	int old_width, old_height, i;
+
+	old_width = term->width;
+	old_height = term->height;
+	old_arena = old_view_arena = NULL;
+	old_ring = old_spare = old_view = NULL;
+
+	// The lines are read from where they are if the arenas have to be
+	// replaced anyway, or from a copy in the view otherwise.
+	if (width > term->arena_width || height > term->arena_height) {
+		old_arena = term->arena;
+		old_view_arena = term->view_arena;
+		old_ring = term->ring;
+		old_spare = term->spare;
+		old_view = term->view;
+		old_lines = term->lines;
+		grow_arenas(width, height);
+	} else {
+		for (i = 0; i < old_height; i++)
+			memcpy(term->view[i], term->lines[i],
+				LINE_SIZE(old_width));
 
-	deinit_screen();
+		old_lines = term->view;
+	}
 
-	if (!(tabstops = calloc(width, sizeof(bool))))
+	if (!(term->tabstops = realloc(term->tabstops, width * sizeof(bool))))
 		pdie("failed to allocate tab stop memory");
 
-	for (i = 8; i < width; i += 8)
-		tabstops[i] = true;
+	for (i = old_width; i < width; i++)
+		term->tabstops[i] = i && !(i % 8);
+
+	for (i = 0; i < height; i++)
+		term->ring[i] = term->ring[height + i] =
+			(struct line *)&term->arena[i *
+			LINE_SIZE(term->arena_width)];
+
+	term->head = 0;
+	term->lines = term->ring;
+	term->scrollback = 0;
+
+	term->width = width;
+	term->height = height;
+	term->scroll_top = 0;
+	term->scroll_bottom = height - 1;
+	reflow(old_lines, old_width, old_height);
+
+	if (term->saved_cursor.x >= width) term->saved_cursor.x = width - 1;
+	if (term->saved_cursor.y >= height) term->saved_cursor.y = height - 1;
+
+	free(old_arena);
+	free(old_view_arena);
+	free(old_ring);
+	free(old_spare);
+	free(old_view);
+
+	damage_screen();
+	wmresize();
+	ptresize();
+}
 
-	if (!(lines = calloc(height, sizeof(struct line *))))
+// Makes new arenas with room for at least width by height cells. The old ones
+// are left for the caller to free.
+static void
+grow_arenas(int width, int height)
+{
+	int i;
+
+	if (width < term->arena_width) width = term->arena_width;
+	if (height < term->arena_height) height = term->arena_height;
+
+	if (!(term->arena = calloc(height, LINE_SIZE(width))))
+		pdie("failed to allocate line memory");
+
+	if (!(term->view_arena = calloc(height, LINE_SIZE(width))))
+		pdie("failed to allocate line memory");
+
+	if (!(term->ring = calloc(height * 2, sizeof(struct line *))) ||
+		!(term->spare = calloc(height, sizeof(struct line *))) ||
+		!(term->view = calloc(height, sizeof(struct line *))))
 		pdie("failed to allocate line array memory");
 
 	for (i = 0; i < height; i++)
-		if (!(lines[i] = calloc(LINE_SIZE(width), 1)))
-			pdie("failed to allocate line memory");
+		term->view[i] =
+			(struct line *)&term->view_arena[i * LINE_SIZE(width)];
 
-	screen_width = width;
-	screen_height = height;
-	scroll_top = 0;
-	scroll_bottom = height - 1;
-	cursor.x = 0;
-	cursor.y = 0;
+	term->arena_width = width;
+	term->arena_height = height;
+}
 
-	wmresize();
+// Lays old_height lines of old_width cells out again across the screen, joining
+// lines that wrapped and splitting them at the new width. Double width lines
+// are never joined or split. The cursor stays on the same cell of text, and the
+// screen is filled from the top unless that would push the cursor off the
+// bottom, in which case lines from the top go into the history.
+static void
+reflow(struct line **old, int old_width, int old_height)
+{
+	struct line *line, *saved;
+	int first, last, length, offset, rows, cursor_row, cursor_column;
+	int content, skip, row, start, n, y, cursor_length;
+	bool single, waiting;
+
+	// The first pass counts the rows the text needs and finds the cursor.
+	cursor_row = cursor_column = cursor_length = 0;
+	waiting = false;
+	content = rows = 0;
+
+	for (first = 0; first < old_height; first = last + 1) {
+		for (last = first; last + 1 < old_height &&
+			old[last]->wrapped && !old[last]->dimensions &&
+			!old[last + 1]->dimensions; last++)
+			;
+
+		single = !old[first]->dimensions;
+		length = (last - first) * old_width +
+			used_cells(old[last], old_width);
+
+		// The cursor waits to wrap if it comes right after the end of
+		// a line and the text, even if it had already gone down to the
+		// next one, so that resizing back puts it where it was.
+		if (term->cursor.y >= first && term->cursor.y <= last) {
+			offset = (term->cursor.y - first) * old_width +
+				term->cursor.x + term->cursor.last_column;
+
+			if (!single) {
+				waiting = term->cursor.last_column;
+				cursor_row = rows;
+				cursor_column = term->cursor.x;
+			} else {
+				waiting = offset && !(offset % term->width) &&
+					(term->cursor.last_column ||
+					offset >= length);
+				cursor_row = rows + (offset - waiting) /
+					term->width;
+				cursor_column = waiting ? term->width - 1 :
+					offset % term->width;
+			}
+
+			if (length < offset + !waiting)
+				length = offset + !waiting;
+
+			cursor_length = length;
+		}
+
+		n = single && length ? (length + term->width - 1) /
+			term->width : 1;
+
+		if (length || old[first]->dimensions)
+			content = rows + n;
+
+		rows += n;
+	}
+
+	if (content < cursor_row + 1)
+		content = cursor_row + 1;
+
+	// Whatever is below the cursor is cut off first.
+	skip = content > term->height ? content - term->height : 0;
+
+	if (skip > cursor_row)
+		skip = cursor_row;
+
+	if (!(saved = malloc(LINE_SIZE(term->width))))
+		pdie("failed to allocate line memory");
+
+	// The second pass copies the text into its new rows.
+	for (row = 0, first = 0; first < old_height && row < skip +
+		term->height; first = last + 1) {
+		for (last = first; last + 1 < old_height &&
+			old[last]->wrapped && !old[last]->dimensions &&
+			!old[last + 1]->dimensions; last++)
+			;
+
+		single = !old[first]->dimensions;
+		length = term->cursor.y >= first && term->cursor.y <= last ?
+			cursor_length : (last - first) * old_width +
+			used_cells(old[last], old_width);
+		start = 0;
+
+		do {
+			line = row < skip ? saved : term->lines[row - skip];
+			memset(line, 0, LINE_SIZE(term->width));
+			line->dimensions = old[first]->dimensions;
+
+			n = single ? term->width : old_width < term->width ?
+				old_width : term->width;
+
+			// length can take in a cursor past the last cell.
+			if (n > length - start)
+				n = length - start;
+
+			if (n > (last - first + 1) * old_width - start)
+				n = (last - first + 1) * old_width - start;
+
+			if (n > 0)
+				copy_cells(line->cells, &old[first], old_width,
+					start, n);
+
+			start += single ? term->width : length;
+			line->wrapped = start < length;
+
+			if (row++ < skip)
+				push_history(saved);
+		} while (start < length && row < skip + term->height);
+	}
+
+	for (y = row - skip; y < term->height; y++)
+		memset(term->lines[y], 0, LINE_SIZE(term->width));
+
+	free(saved);
+	term->cursor.y = cursor_row - skip;
+	term->cursor.x = cursor_column < term->width ? cursor_column :
+		term->width - 1;
+	term->cursor.last_column = waiting && term->cursor.x == term->width - 1;
+}
+
+// Returns how many cells of a line come before the blank ones at its end,
+// counting cells erased to the default background as blank.
+static int
+used_cells(const struct line *line, int width)
+{
+	const struct cell *cell;
+	const struct style *style;
+
+	for (; width; width--) {
+		cell = &line->cells[width - 1];
+		style = &term->styles[cell->style];
+
+		if (cell->code_point || style->negative || style->underline ||
+			style->bg_truecolor || style->background.r)
+			break;
+	}
+
+	return width;
+}
+
+// Copies count cells of the text that runs across lines of the given width,
+// starting start cells in.
+static void
+copy_cells(struct cell *cells, struct line **rows, int width, int start,
+	int count)
+{
+	int n;
+
+	for (; count; count -= n, start += n, cells += n) {
+		n = width - start % width;
+
+		if (n > count)
+			n = count;
+
+		memcpy(cells, &rows[start / width]->cells[start % width],
+			n * sizeof(struct cell));
+	}
 }
 
 void
@@ -170,23 +595,25 @@ reset()
 {
 	int i;
 
-	memcpy(palette, default_palette, sizeof(palette));
+	memcpy(term->palette, default_palette, sizeof(term->palette));
+
+	term->mode = DECANM|DECSCLM|DECARM|DECINLM|DECTCEM;
 
-	mode = DECANM|DECSCLM|DECARM|DECINLM|DECTCEM;
+	memset(&term->cursor, 0, sizeof(term->cursor));
+	term->cursor.attrs = default_attrs;
 
-	memset(&cursor, 0, sizeof(cursor));
-	cursor.attrs = default_attrs;
+	memset(term->tabstops, 0, term->width * sizeof(bool));
+	for (i = 8; i < term->width; i += 8)
+		term->tabstops[i] = true;
 
-	memset(tabstops, 0, screen_width * sizeof(bool));
-	for (i = 8; i < screen_width; i += 8)
-		tabstops[i] = true;
+	memset(term->arena, 0,
+		term->arena_height * LINE_SIZE(term->arena_width));
 
-	for (i = 0; i < screen_height; i++)
-		memset(lines[i], 0, LINE_SIZE(screen_width));
+	term->saved_cursor = term->cursor;
+	term->scroll_top = 0;
+	term->scroll_bottom = term->height - 1;
 
-	saved_cursor = cursor;
-	scroll_top = 0;
-	scroll_bottom = screen_height - 1;
+	damage_screen();
 }
 
 void
@@ -194,53 +621,39 @@ screen_align()
 {
 	int x, y;
 
-	for (y = 0; y < screen_height; y++)
-		for (x = 0; x < screen_width; x++)
-			lines[y]->cells[x].code_point = 'E';
+	for (y = 0; y < term->height; y++)
+		for (x = 0; x < term->width; x++) {
+			term->lines[y]->cells[x].code_point = 'E';
+			term->lines[y]->cells[x].wide = false;
+		}
+
+	damage_screen();
 }
 
 void
 insert_line()
 {
-	struct line *temp;
-	int i;
-
-	temp = lines[scroll_bottom];
+	struct cell blank = {0, cursor_style(), false};
 
-	memmove(&lines[cursor.y + 1], &lines[cursor.y],
-		(scroll_bottom - cursor.y) * sizeof(struct line *));
-
-	lines[cursor.y] = temp;
-
-	for (i = 0; i < screen_width; i++)
-		lines[cursor.y]->cells[i] = cursor.attrs;
+	scroll_lines(term->cursor.y, term->scroll_bottom, -1, blank);
 }
 
 void
 delete_line()
 {
-	struct line *temp;
-	int i;
-
-	temp = lines[cursor.y];
+	struct cell blank = {0, cursor_style(), false};
 
-	memmove(&lines[cursor.y], &lines[cursor.y + 1],
-		(scroll_bottom - cursor.y) * sizeof(struct line *));
-
-	lines[scroll_bottom] = temp;
-
-	for (i = 0; i < screen_width; i++)
-		lines[scroll_bottom]->cells[i] = cursor.attrs;
+	scroll_lines(term->cursor.y, term->scroll_bottom, 1, blank);
 }
 
 void
 tab()
 {
-	for (cursor.x++; cursor.x < screen_width && !tabstops[cursor.x];
-		cursor.x++);
+	for (term->cursor.x++; term->cursor.x < term->width &&
+		!term->tabstops[term->cursor.x]; term->cursor.x++);
 
-	if (cursor.x >= screen_width)
-		cursor.x = screen_width - 1;
+	if (term->cursor.x >= term->width)
+		term->cursor.x = term->width - 1;
 }
 
 void
@@ -249,15 +662,18 @@ insert_characters(int n)
 	struct line *line;
 	int max;
 
-	line = lines[cursor.y];
+	line = term->lines[term->cursor.y];
 
-	if (n > (max = screen_width - cursor.x - 1))
+	if (n > (max = term->width - term->cursor.x - 1))
 		n = max;
 
-	memmove(&line->cells[cursor.x + n], &line->cells[cursor.x],
-		(screen_width - n - cursor.x) * sizeof(struct cell));
+	memmove(&line->cells[term->cursor.x + n], &line->cells[term->cursor.x],
+		(term->width - n - term->cursor.x) * sizeof(struct cell));
+
+	memset(&term->lines[term->cursor.y]->cells[term->cursor.x], 0,
+		n * sizeof(struct cell));
 
-	memset(&lines[cursor.y]->cells[cursor.x], 0, n * sizeof(struct cell));
+	damage(term->cursor.y, term->cursor.x, term->width);
 }
 
 void
@@ -266,17 +682,18 @@ delete_characters(int n)
 	struct line *line;
 	int max;
 
-	line = lines[cursor.y];
+	line = term->lines[term->cursor.y];
 
-	if (n > (max = screen_width - cursor.x - 1))
+	if (n > (max = term->width - term->cursor.x - 1))
 		n = max;
 
-	memmove(&line->cells[cursor.x], &line->cells[cursor.x + n],
-		(screen_width - n - cursor.x) * sizeof(struct cell));
+	memmove(&line->cells[term->cursor.x], &line->cells[term->cursor.x + n],
+		(term->width - n - term->cursor.x) * sizeof(struct cell));
 
-	memset(&line->cells[screen_width - n], 0, n * sizeof(struct cell));
+	memset(&line->cells[term->width - n], 0, n * sizeof(struct cell));
 
-	cursor.last_column = false;
+	damage(term->cursor.y, term->cursor.x, term->width);
+	term->cursor.last_column = false;
 }
 
 void
@@ -284,68 +701,84 @@ erase_characters(int n)
 {
 	int max;
 
-	if (n > (max = screen_width - cursor.x - 1))
+	if (n > (max = term->width - term->cursor.x - 1))
 		n = max;
 
-	memset(&lines[cursor.y]->cells[cursor.x], 0, n * sizeof(struct cell));
+	memset(&term->lines[term->cursor.y]->cells[term->cursor.x], 0,
+		n * sizeof(struct cell));
 
-	cursor.last_column = false;
+	damage(term->cursor.y, term->cursor.x, term->cursor.x + n);
+	term->cursor.last_column = false;
 }
 
 void
 erase_display(int param)
 {
-	int x, y, n;
+	struct cell blank;
+	int y, n;
 
 	switch (param) {
 	case 0:
-		if (cursor.x == 0)
-			lines[cursor.y]->dimensions = SINGLE_WIDTH;
+		if (term->cursor.x == 0)
+			term->lines[term->cursor.y]->dimensions = SINGLE_WIDTH;
 		erase_line(0);
-		y = cursor.y + 1;
-		n = screen_height;
+		y = term->cursor.y + 1;
+		n = term->height;
 		break;
 	case 1:
-		if (cursor.x == screen_width - 1)
-			lines[cursor.y]->dimensions = SINGLE_WIDTH;
+		if (term->cursor.x == term->width - 1)
+			term->lines[term->cursor.y]->dimensions = SINGLE_WIDTH;
 		erase_line(1);
 		y = 0;
-		n = cursor.y;
+		n = term->cursor.y;
 		break;
 	case 2:
 		y = 0;
-		n = screen_height;
+		n = term->height;
 		break;
 	default:
 		return;
 	}
 
+	blank.code_point = 0;
+	blank.style = cursor_style();
+	blank.wide = false;
+
 	for (; y < n; y++) {
-		lines[y]->dimensions = SINGLE_WIDTH;
+		term->lines[y]->dimensions = SINGLE_WIDTH;
+		term->lines[y]->wrapped = false;
+		fill_cells(term->lines[y]->cells, term->width, blank);
 
-		for (x = 0; x < screen_width; x++)
-			lines[y]->cells[x] = cursor.attrs;
+		damage(y, 0, term->width);
 	}
 
-	cursor.last_column = false;
+	term->cursor.last_column = false;
 }
 
 void
 erase_line(int param)
 {
+	struct cell blank;
 	int x, max;
 
 	switch (param) {
-	case 0: x = cursor.x; max = screen_width; break;
-	case 1: x = 0; max = cursor.x + 1; break;
-	case 2: x = 0; max = screen_width; break;
+	case 0: x = term->cursor.x; max = term->width; break;
+	case 1: x = 0; max = term->cursor.x + 1; break;
+	case 2: x = 0; max = term->width; break;
 	default: return;
 	}
 
-	for (; x < max; x++)
-		lines[cursor.y]->cells[x] = cursor.attrs;
+	damage(term->cursor.y, x, max);
+	blank.code_point = 0;
+	blank.style = cursor_style();
+	blank.wide = false;
+
+	fill_cells(&term->lines[term->cursor.y]->cells[x], max - x, blank);
 
-	cursor.last_column = false;
+	if (max == term->width)
+		term->lines[term->cursor.y]->wrapped = false;
+
+	term->cursor.last_column = false;
 }
 
 void
@@ -355,61 +788,324 @@ warpto(int x, int y)
 	bool decom;
 
 	decom = getmode(DECOM);
-	miny = decom ? scroll_top : 0;
-	maxy = decom ? scroll_bottom : screen_height - 1;
+	miny = decom ? term->scroll_top : 0;
+	maxy = decom ? term->scroll_bottom : term->height - 1;
 
-	if (x < 0) x = 0; else if (x >= screen_width) x = screen_width - 1;
+	if (x < 0) x = 0; else if (x >= term->width) x = term->width - 1;
 	if (y < miny) y = miny; else if (y > maxy) y = maxy;
 
-	cursor.x = x;
-	cursor.y = y;
-	cursor.last_column = false;
+	term->cursor.x = x;
+	term->cursor.y = y;
+	term->cursor.last_column = false;
 }
 
 void
 move_cursor(unsigned char direction, int amount)
 {
 	switch (direction) {
-	case 0x41: warpto(cursor.x, cursor.y - amount); break;
-	case 0x42: warpto(cursor.x, cursor.y + amount); break;
-	case 0x43: warpto(cursor.x + amount, cursor.y); break;
-	case 0x44: warpto(cursor.x - amount, cursor.y); break;
+	case 0x41: warpto(term->cursor.x, term->cursor.y - amount); break;
+	case 0x42: warpto(term->cursor.x, term->cursor.y + amount); break;
+	case 0x43: warpto(term->cursor.x + amount, term->cursor.y); break;
+	case 0x44: warpto(term->cursor.x - amount, term->cursor.y); break;
 	}
 }
 
 void
 scrollup()
 {
-	struct line *temp;
-
-	memset((temp = lines[scroll_top]), 0, LINE_SIZE(screen_width));
+	struct cell blank = {0, 0, false};
 
-	memmove(&lines[scroll_top], &lines[scroll_top + 1],
-		(scroll_bottom - scroll_top) * sizeof(struct line *));
+	if (term->scroll_top == 0)
+		push_history(term->lines[0]);
 
-	lines[scroll_bottom] = temp;
+	scroll_lines(term->scroll_top, term->scroll_bottom, 1, blank);
 }
 
 void
 scrolldown()
 {
-	struct line *temp;
+	struct cell blank = {0, 0, false};
+
+	scroll_lines(term->scroll_top, term->scroll_bottom, -1, blank);
+}
+
+// Moves lines top through bottom up by count lines, or down if it is negative,
+// and fills the lines that come in at the other end with blank.
+static void
+scroll_lines(int top, int bottom, int count, struct cell blank)
+{
+	struct line *line;
+	int y, first, last;
+
+	if (top > bottom)
+		return;
+
+	if (count > 0) {
+		first = bottom - count + 1;
+		last = bottom;
+	} else {
+		first = top;
+		last = top - count - 1;
+	}
+
+	if (first < top) first = top;
+	if (last > bottom) last = bottom;
+
+	note_shift(top, bottom, count);
+	rotate_lines(top, bottom, count);
+
+	for (y = first; y <= last; y++) {
+		line = term->lines[y];
+		line->dimensions = SINGLE_WIDTH;
+		line->blinks = line->wrapped = false;
+		fill_cells(line->cells, term->width, blank);
+		damage(y, 0, term->width);
+	}
+}
+
+// Rotating the whole screen only moves the head of the ring; anything less
+// rewrites the part of it that moved.
+static void
+rotate_lines(int top, int bottom, int count)
+{
+	int size, i;
+
+	size = bottom - top + 1;
+	count = (count % size + size) % size;
+
+	if (size == term->height) {
+		term->head = (term->head + count) % term->height;
+		term->lines = &term->ring[term->head];
+		return;
+	}
+
+	for (i = 0; i < size; i++)
+		term->spare[i] = term->lines[top + (i + count) % size];
+
+	for (i = 0; i < size; i++)
+		set_line(top + i, term->spare[i]);
+}
+
+static void
+set_line(int y, struct line *line)
+{
+	int i;
+
+	if ((i = term->head + y) >= term->height)
+		i -= term->height;
+
+	term->ring[i] = term->ring[term->height + i] = line;
+}
+
+// Scrolls the view back through the history by count lines, or forward if it
+// is negative, as far as there is history to show.
+void
+scroll_view(long count)
+{
+	long n;
+	int y;
+
+	if ((n = term->scrollback + count) > history_size())
+		n = history_size();
+
+	if (n < 0)
+		n = 0;
+
+	if (n == term->scrollback)
+		return;
+
+	for (y = 0; y < term->height && y < n; y++)
+		history_line(n - y, term->view[y]);
+
+	for (; y < term->height; y++)
+		memcpy(term->view[y], term->lines[y - n],
+			LINE_SIZE(term->width));
+
+	term->scrollback = n;
+	damage_screen();
+}
+
+// Brings a snapshot up to date with the screen, leaving the screen undamaged.
+void
+take_snapshot(struct snapshot *snapshot)
+{
+	struct line *line, *copy;
+	bool blinks, *highlights;
+	int x, y;
+
+	if (snapshot->width != term->width || snapshot->height != term->height)
+		resize_snapshot(snapshot);
+
+	if (term->changed_first <= term->changed_last) {
+		memcpy(&snapshot->styles[term->changed_first],
+			&term->styles[term->changed_first],
+			(term->changed_last - term->changed_first + 1) *
+			sizeof(struct style));
+		term->changed_first = MAX_STYLES;
+		term->changed_last = 0;
+	}
+
+	if (term->shift)
+		shift_snapshot(snapshot);
+
+	for (y = 0; y < term->height; y++) {
+		line = visible_line(y);
+
+		if (line->damage_start >= line->damage_end)
+			continue;
+
+		// Whether the line blinks is the renderer's business, and it
+		// finds out again when it draws the whole line.
+		copy = snapshot->lines[y];
+		blinks = copy->blinks && (line->damage_start > 0 ||
+			line->damage_end < term->width);
+		memcpy(copy, line, LINE_SIZE(term->width));
+		copy->blinks = blinks;
+		line->damage_start = line->damage_end = 0;
+
+		highlights = snapshot_highlights(snapshot, y);
+
+		for (x = 0; x < term->width; x++)
+			highlights[x] = highlighted(y, x);
+	}
+
+	memcpy(snapshot->palette, term->palette, sizeof(term->palette));
+	snapshot->mode = term->mode;
+	snapshot->cursor_x = term->cursor.x;
+	snapshot->cursor_y = term->cursor.y;
+	snapshot->scrolled_back = term->scrollback;
+}
+
+void
+deinit_snapshot(struct snapshot *snapshot)
+{
+	int y;
+
+	for (y = 0; y < snapshot->height; y++)
+		free(snapshot->lines[y]);
+
+	free(snapshot->lines);
+	free(snapshot->styles);
+}
+
+// Gives a snapshot lines of the screen's size. Every line of the screen is
+// damaged whenever its size changes, so they are all copied in afterwards.
+static void
+resize_snapshot(struct snapshot *snapshot)
+{
+	int y;
+
+	for (y = 0; y < snapshot->height; y++)
+		free(snapshot->lines[y]);
+
+	free(snapshot->lines);
+
+	if (!(snapshot->lines = calloc(term->height, sizeof(struct line *))))
+		pdie("failed to allocate snapshot memory");
 
-	memset((temp = lines[scroll_bottom]), 0, LINE_SIZE(screen_width));
+	for (y = 0; y < term->height; y++)
+		if (!(snapshot->lines[y] = calloc(1, LINE_SIZE(term->width) +
+			term->width * sizeof(bool))))
+			pdie("failed to allocate snapshot memory");
 
-	memmove(&lines[scroll_top + 1], &lines[scroll_top],
-		(scroll_bottom - scroll_top) * sizeof(struct line *));
+	if (!snapshot->styles) {
+		if (!(snapshot->styles = malloc(MAX_STYLES *
+			sizeof(struct style))))
+			pdie("failed to allocate snapshot memory");
 
-	lines[scroll_top] = temp;
+		memcpy(snapshot->styles, term->styles,
+			MAX_STYLES * sizeof(struct style));
+	}
+
+	snapshot->width = term->width;
+	snapshot->height = term->height;
+	snapshot->shift = 0;
+}
+
+// Moves the lines of a snapshot the way the screen moved its own since the last
+// one, and hands the shift over to the renderer.
+static void
+shift_snapshot(struct snapshot *snapshot)
+{
+	struct line **lines;
+	int size, count, i;
+
+	lines = &snapshot->lines[term->shift_top];
+	size = term->shift_bottom - term->shift_top + 1;
+	count = (term->shift % size + size) % size;
+
+	for (i = 0; i < size; i++)
+		term->spare[i] = lines[(i + count) % size];
+
+	memcpy(lines, term->spare, size * sizeof(struct line *));
+	snapshot->shift_top = term->shift_top;
+	snapshot->shift_bottom = term->shift_bottom;
+	snapshot->shift = term->shift;
+	term->shift = 0;
+}
+
+// Blank cells are usually all zero bytes, and anything else is filled by
+// copying the part already filled over the rest, which memcpy() does with the
+// widest stores it has.
+static void
+fill_cells(struct cell *cells, int count, struct cell blank)
+{
+	int n;
+
+	if (count <= 0)
+		return;
+
+	if (!blank.code_point && !blank.style) {
+		memset(cells, 0, count * sizeof(struct cell));
+		return;
+	}
+
+	cells[0] = blank;
+
+	for (n = 1; n < count; n *= 2)
+		memcpy(&cells[n], cells,
+			(n < count - n ? n : count - n) * sizeof(struct cell));
+}
+
+// Records that lines top through bottom are about to move up by count lines
+// so that the renderer can move what it already drew instead of drawing it
+// again. Only one region is tracked at a time; when another one scrolls, the
+// lines of the old one are damaged before anything moves out of it.
+static void
+note_shift(int top, int bottom, int count)
+{
+	int y;
+
+	// What is on screen is not the lines that moved.
+	if (term->scrollback)
+		return;
+
+	if (term->shift && (top != term->shift_top ||
+		bottom != term->shift_bottom))
+		for (y = term->shift_top; y <= term->shift_bottom; y++)
+			damage(y, 0, term->width);
+
+	if (!term->shift || top != term->shift_top ||
+		bottom != term->shift_bottom) {
+		term->shift_top = top;
+		term->shift_bottom = bottom;
+		term->shift = 0;
+	}
+
+	term->shift += count;
+
+	// Nothing the renderer drew is left in the region.
+	if (term->shift > bottom - top || -term->shift > bottom - top)
+		term->shift = 0;
 }
 
 void
 newline()
 {
-	cursor.last_column = false;
+	term->cursor.last_column = false;
 
-	if (cursor.y < scroll_bottom)
-		cursor.y++;
+	if (term->cursor.y < term->scroll_bottom)
+		term->cursor.y++;
 	else
 		scrollup();
 }
@@ -417,11 +1113,11 @@ newline()
 void
 revline()
 {
-	cursor.last_column = false;
+	term->cursor.last_column = false;
 
 	// TODO : change to move_cursor?
-	if (cursor.y > scroll_top)
-		warpto(cursor.x, cursor.y - 1);
+	if (term->cursor.y > term->scroll_top)
+		warpto(term->cursor.x, term->cursor.y - 1);
 	else
 		scrolldown();
 }
@@ -429,7 +1125,7 @@ revline()
 void
 nextline()
 {
-	cursor.x = 0;
+	term->cursor.x = 0;
 	newline();
 }
 
@@ -439,13 +1135,13 @@ linefeed()
 	newline();
 
 	if (getmode(LNM))
-		cursor.x = 0;
+		term->cursor.x = 0;
 }
 
 void
 carriagereturn()
 {
-	cursor.x = 0;
+	term->cursor.x = 0;
 }
 
 void
@@ -453,33 +1149,97 @@ print(long ch)
 {
 	struct cell *cell;
 	const uint32_t *charset;
-	const unsigned char *glyph;
 	int increment;
 
-	if (cursor.last_column) {
-		cursor.x = 0;
+	charset = term->cursor.logical_charsets[
+		term->cursor.active_charsets[ch < 128 ? GL : GR]];
+
+	if (charset && ch >= charset[0] && ch <= charset[1])
+		ch = charset[ch - charset[0] + 2];
+
+	// There is nowhere to keep characters that combine with the one before,
+	// so they are dropped rather than throwing the cursor out of step with
+	// where the host thinks it is.
+	if (!(increment = ch ? char_width(ch) : 1))
+		return;
+
+	if (term->cursor.last_column) {
+		term->lines[term->cursor.y]->wrapped = true;
+		term->cursor.x = 0;
 		newline();
 	}
 
-	cell = &lines[cursor.y]->cells[cursor.x];
-	*cell = cursor.attrs;
+	cell = &term->lines[term->cursor.y]->cells[term->cursor.x];
+	cell->code_point = term->cursor.conceal ? 0 : ch;
+	cell->style = cursor_style();
+	cell->wide = increment == 2;
 
-	if (!cursor.conceal) {
-		charset = cursor.logical_charsets[
-			cursor.active_charsets[ch < 128 ? GL : GR]];
+	damage(term->cursor.y, term->cursor.x, term->cursor.x + increment);
 
-		if (charset && ch >= charset[0] && ch <= charset[1])
-			ch = charset[ch - charset[0] + 2];
-
-		cell->code_point = ch;
+	if (term->cursor.x + increment >= term->width) {
+		if (getmode(DECAWM)) term->cursor.last_column = true;
+	} else {
+		term->cursor.x += increment;
 	}
+}
 
-	increment = ch ?
-		((glyph = find_glyph(ch)) && glyph[0] == '\2' ? 2 : 1) : 1;
+// Does the same as calling print() for each character of text, which must be
+// printable ASCII, but fills as much of the line as it can at once.
+void
+print_ascii(const unsigned char *text, size_t size)
+{
+	struct cell *cells;
+	size_t i, n, room;
+	uint16_t style;
 
-	if (cursor.x + increment >= screen_width) {
-		if (getmode(DECAWM)) cursor.last_column = true;
-	} else {
-		cursor.x += increment;
+	// Other character sets may replace ASCII with wide characters.
+	if (term->cursor.logical_charsets[term->cursor.active_charsets[GL]]) {
+		for (i = 0; i < size; i++)
+			print(text[i]);
+
+		return;
+	}
+
+	style = cursor_style();
+
+	while (size) {
+		if (term->cursor.last_column) {
+			term->lines[term->cursor.y]->wrapped = true;
+			term->cursor.x = 0;
+			newline();
+		}
+
+		room = term->width - term->cursor.x;
+		n = size < room ? size : room;
+		cells = &term->lines[term->cursor.y]->cells[term->cursor.x];
+
+		for (i = 0; i < n; i++) {
+			cells[i].code_point =
+				term->cursor.conceal ? 0 : text[i];
+			cells[i].style = style;
+			cells[i].wide = false;
+		}
+
+		damage(term->cursor.y, term->cursor.x, term->cursor.x + n);
+
+		if (n < room) {
+			term->cursor.x += n;
+		} else {
+			term->cursor.x = term->width - 1;
+
+			// Without autowrap the rest of the text overwrites the
+			// last column, so only the final character remains.
+			if (getmode(DECAWM)) {
+				term->cursor.last_column = true;
+			} else {
+				if (!term->cursor.conceal)
+					cells[n - 1].code_point = text[size - 1];
+
+				n = size;
+			}
+		}
+
+		text += n;
+		size -= n;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,561 @@
+// search.c - searching the screen and scrollback history
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#define _GNU_SOURCE // pipe2
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "terminix.h"
+
+// Longest query, in code points, and most matches kept for one.
+#define MAX_QUERY 64
+#define MAX_MATCHES 100000
+
+// Whenever the query changes, the screen and the recent lines are searched
+// right away, and the scanning thread carries on through the packed history a
+// block at a time, handing what it finds over in found and waking the main loop
+// through a pipe. Every query gets a new generation, so that the thread can
+// tell when the block it just scanned was for one that has been replaced.
+//
+// Matches are numbered like the lines of the history, with the screen's rows
+// following on, so that they stay put as the screen scrolls. They are kept
+// newest first, which is the order they are found in.
+struct match {
+	long	line;
+	int	column;
+};
+
+// Every session has a search of its own, but there is only the one scanning
+// thread, which takes a block from each of those still scanning in turn.
+struct search {
+	// These are shared with the scanning thread and only touched under
+	// lock.
+	struct history	*history;
+	struct search	*next;
+	bool		 scanning, found_new;
+	uint32_t	 shared_query[MAX_QUERY];
+	int		 shared_length;
+	long		 generation, next_line;
+	struct match	*found;
+	size_t		 found_count, found_capacity, found_total;
+
+	// These belong to the main thread.
+	uint32_t	 query[MAX_QUERY];
+	int		 query_length;
+	struct match	*matches;
+	size_t		 match_count, match_capacity;
+	long		 selected;
+	bool		 done;
+};
+
+struct search *search;
+
+// These are shared with the scanning thread and only touched under lock. busy
+// is the search it is scanning without holding the lock, which is waited for
+// to finish before that search goes away.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static pthread_t scan_thread;
+static bool started, notified;
+static int wake_pipe[2];
+static struct search *searches, *busy;
+
+// These belong to the scanning thread.
+static uint32_t scan_query[MAX_QUERY];
+static int scan_length;
+static struct match *scanned;
+static size_t scanned_count, scanned_capacity;
+
+static void restart(void);
+static void *scan(void *);
+static struct search *next_scan(void);
+static void check_line(long, const uint32_t *, int);
+static void check_scanned_line(long, const uint32_t *, int);
+static void find_matches(struct match **, size_t *, size_t *,
+	const uint32_t *, int, long, const uint32_t *, int);
+static void add_matches(struct match **, size_t *, size_t *,
+	const struct match *, size_t);
+static void show_match(void);
+static void show_status(void);
+
+// Sets up a search of the current session's history.
+void
+init_search()
+{
+	if (!started) {
+		if (pipe2(wake_pipe, O_NONBLOCK|O_CLOEXEC))
+			pdie("failed to create search pipe");
+
+		if ((errno = pthread_create(&scan_thread, NULL, scan, NULL)))
+			pdie("failed to start search thread");
+
+		pthread_detach(scan_thread);
+		started = true;
+	}
+
+	if (!(search = session->search = calloc(1, sizeof(*search))))
+		pdie("failed to allocate search memory");
+
+	search->history = history;
+	search->selected = -1;
+	search->done = true;
+
+	pthread_mutex_lock(&lock);
+	search->next = searches;
+	searches = search;
+	pthread_mutex_unlock(&lock);
+}
+
+// Frees the current session's search, once the scanning thread is done with
+// it.
+void
+deinit_search()
+{
+	struct search **p;
+
+	if (!search)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	for (p = &searches; *p != search; p = &(*p)->next)
+		;
+
+	*p = search->next;
+
+	// The scanning thread may be exiting itself, when it cannot wait.
+	while (busy == search && !pthread_equal(pthread_self(), scan_thread))
+		pthread_cond_wait(&finished, &lock);
+
+	pthread_mutex_unlock(&lock);
+
+	free(search->found);
+	free(search->matches);
+	free(search);
+	search = session->search = NULL;
+}
+
+void
+start_search()
+{
+	session->searching = true;
+	search->query_length = 0;
+	restart();
+}
+
+void
+stop_search()
+{
+	session->searching = false;
+	search->query_length = 0;
+	restart();
+	wmstatus(NULL);
+}
+
+// Adds UTF-8 text to the end of the query.
+void
+search_input(const char *text, int size)
+{
+	uint32_t code_point;
+	int i, j, n;
+	bool changed;
+
+	for (changed = false, i = 0; i < size; i += n) {
+		code_point = (unsigned char)text[i];
+
+		if (code_point < 0x80) n = 1;
+		else if (code_point < 0xE0) code_point &= 0x1F, n = 2;
+		else if (code_point < 0xF0) code_point &= 0x0F, n = 3;
+		else code_point &= 0x07, n = 4;
+
+		for (j = 1; j < n && i + j < size; j++)
+			code_point = code_point << 6 | (text[i + j] & 0x3F);
+
+		if (code_point < 0x20 || code_point == 0x7F ||
+			search->query_length == MAX_QUERY)
+			continue;
+
+		search->query[search->query_length++] = code_point;
+		changed = true;
+	}
+
+	if (changed)
+		restart();
+}
+
+void
+search_erase()
+{
+	if (search->query_length) {
+		search->query_length--;
+		restart();
+	}
+}
+
+// Selects the next older match, or the next newer one if direction is -1.
+void
+search_next(int direction)
+{
+	if (!search->match_count)
+		return;
+
+	search->selected += direction;
+
+	if (search->selected < 0)
+		search->selected = 0;
+
+	if (search->selected >= (long)search->match_count)
+		search->selected = search->match_count - 1;
+
+	show_match();
+	show_status();
+}
+
+void
+search_prepare(struct pollfd *pfd)
+{
+	pfd->fd = started ? wake_pipe[0] : -1;
+	pfd->events = POLLIN;
+}
+
+// Takes whatever the scanning thread has found for the current session since
+// it was last called. The pipe is shared, so whichever session gets here first
+// empties it, and the rest see what they have been given in found_new.
+void
+search_poll()
+{
+	char byte;
+
+	pthread_mutex_lock(&lock);
+
+	if (notified) {
+		if (read(wake_pipe[0], &byte, 1) < 0)
+			pdie("failed to read search pipe");
+
+		notified = false;
+	}
+
+	if (!search->found_new) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	search->found_new = false;
+	add_matches(&search->matches, &search->match_count,
+		&search->match_capacity, search->found, search->found_count);
+	search->found_count = 0;
+	search->done = !search->scanning;
+	pthread_mutex_unlock(&lock);
+
+	if (!session->searching)
+		return;
+
+	if (search->selected < 0 && search->match_count) {
+		search->selected = 0;
+		show_match();
+	}
+
+	damage_screen();
+	show_status();
+}
+
+// Returns whether the cell shown at x, y is part of a match.
+bool
+highlighted(int y, int x)
+{
+	const struct match *matches;
+	size_t low, high, middle;
+	long line;
+
+	if (!search->match_count)
+		return false;
+
+	matches = search->matches;
+	line = history_end() - term->scrollback + y;
+	low = 0;
+	high = search->match_count;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+
+		if (matches[middle].line > line)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	for (; low < search->match_count && matches[low].line == line; low++)
+		if (x >= matches[low].column &&
+			x < matches[low].column + search->query_length)
+			return true;
+
+	return false;
+}
+
+// Throws away the matches for the old query and starts looking for the new one.
+static void
+restart()
+{
+	uint32_t *code_points;
+	long oldest;
+	int x, y;
+
+	search->match_count = 0;
+	search->selected = -1;
+	search->done = true;
+
+	pthread_mutex_lock(&lock);
+	search->generation++;
+	search->scanning = false;
+	search->found_new = false;
+	search->found_count = 0;
+	memcpy(search->shared_query, search->query,
+		search->query_length * sizeof(uint32_t));
+	search->shared_length = search->query_length;
+	pthread_mutex_unlock(&lock);
+
+	if (search->query_length) {
+		if (!(code_points = malloc(term->width * sizeof(uint32_t))))
+			pdie("failed to allocate search memory");
+
+		for (y = term->height - 1; y >= 0; y--) {
+			for (x = 0; x < term->width; x++)
+				code_points[x] =
+					term->lines[y]->cells[x].code_point;
+
+			check_line(history_end() + y, code_points, term->width);
+		}
+
+		free(code_points);
+		oldest = search_recent(check_line);
+
+		pthread_mutex_lock(&lock);
+		search->next_line = oldest;
+		search->found_total = search->match_count;
+		search->done = !(search->scanning =
+			search->match_count < MAX_MATCHES);
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+	}
+
+	if (search->match_count) {
+		search->selected = 0;
+		show_match();
+	}
+
+	damage_screen();
+
+	if (session->searching)
+		show_status();
+}
+
+// Runs on the scanning thread.
+static void *
+scan(void *unused __attribute__((unused)))
+{
+	struct search *s;
+	long current, before, oldest;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+
+		while (!(s = next_scan()))
+			pthread_cond_wait(&wake, &lock);
+
+		busy = s;
+		current = s->generation;
+		before = s->next_line;
+		memcpy(scan_query, s->shared_query, s->shared_length *
+			sizeof(uint32_t));
+		scan_length = s->shared_length;
+		pthread_mutex_unlock(&lock);
+
+		scanned_count = 0;
+		oldest = search_history(s->history, scan_query, scan_length,
+			before, check_scanned_line);
+
+		pthread_mutex_lock(&lock);
+		busy = NULL;
+		pthread_cond_broadcast(&finished);
+
+		if (s->generation == current) {
+			add_matches(&s->found, &s->found_count,
+				&s->found_capacity, scanned, scanned_count);
+			s->found_total += scanned_count;
+			s->next_line = oldest;
+			s->scanning = oldest >= 0 &&
+				s->found_total < MAX_MATCHES;
+
+			if (scanned_count || !s->scanning)
+				s->found_new = true;
+
+			if (s->found_new && !notified) {
+				if (write(wake_pipe[1], "", 1) < 0)
+					pdie("failed to write search pipe");
+
+				notified = true;
+			}
+		}
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+// Picks the next search with history left to scan, and moves it to the end of
+// the list so that the others get their turn before it comes up again. Called
+// under lock.
+static struct search *
+next_scan()
+{
+	struct search **p, *s;
+
+	for (p = &searches; *p && !(*p)->scanning; p = &(*p)->next)
+		;
+
+	if (!(s = *p))
+		return NULL;
+
+	*p = s->next;
+	s->next = NULL;
+
+	for (; *p; p = &(*p)->next)
+		;
+
+	*p = s;
+	return s;
+}
+
+static void
+check_line(long line, const uint32_t *code_points, int width)
+{
+	find_matches(&search->matches, &search->match_count,
+		&search->match_capacity, search->query, search->query_length,
+		line, code_points, width);
+}
+
+static void
+check_scanned_line(long line, const uint32_t *code_points, int width)
+{
+	find_matches(&scanned, &scanned_count, &scanned_capacity, scan_query,
+		scan_length, line, code_points, width);
+}
+
+// Adds every place the needle turns up in a line to an array of matches.
+// Blanks match spaces.
+static void
+find_matches(struct match **array, size_t *count, size_t *capacity,
+	const uint32_t *needle, int length, long line,
+	const uint32_t *code_points, int width)
+{
+	struct match match;
+	int x, i;
+
+	for (x = 0; x + length <= width && *count < MAX_MATCHES; x++) {
+		for (i = 0; i < length; i++)
+			if ((code_points[x + i] ? code_points[x + i] : 0x20) !=
+				needle[i])
+				break;
+
+		if (i == length) {
+			match.line = line;
+			match.column = x;
+			add_matches(array, count, capacity, &match, 1);
+		}
+	}
+}
+
+static void
+add_matches(struct match **array, size_t *count, size_t *capacity,
+	const struct match *new, size_t new_count)
+{
+	if (new_count > MAX_MATCHES - *count)
+		new_count = MAX_MATCHES - *count;
+
+	if (*count + new_count > *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+
+		if (*capacity < *count + new_count)
+			*capacity = *count + new_count;
+
+		if (!(*array = realloc(*array, *capacity * sizeof(**array))))
+			pdie("failed to allocate search memory");
+	}
+
+	memcpy(&(*array)[*count], new, new_count * sizeof(**array));
+	*count += new_count;
+}
+
+// Scrolls the view so that the selected match is in the middle of it, unless it
+// can already be seen.
+static void
+show_match()
+{
+	long line, top;
+
+	line = search->matches[search->selected].line;
+	top = history_end() - term->scrollback;
+
+	if (line >= top && line < top + term->height)
+		return;
+
+	scroll_view(history_end() - line + term->height / 2 - term->scrollback);
+}
+
+// Shows the query in the title bar, with which match is selected out of how
+// many have been found so far.
+static void
+show_status()
+{
+	char status[MAX_QUERY * 4 + 64], *p;
+	uint32_t code_point;
+	int i;
+
+	p = status + sprintf(status, "Search: ");
+
+	for (i = 0; i < search->query_length; i++) {
+		if ((code_point = search->query[i]) < 0x80) {
+			*p++ = code_point;
+		} else if (code_point < 0x800) {
+			*p++ = 0xC0 | code_point >> 6;
+			*p++ = 0x80 | (code_point & 0x3F);
+		} else if (code_point < 0x10000) {
+			*p++ = 0xE0 | code_point >> 12;
+			*p++ = 0x80 | (code_point >> 6 & 0x3F);
+			*p++ = 0x80 | (code_point & 0x3F);
+		} else {
+			*p++ = 0xF0 | code_point >> 18;
+			*p++ = 0x80 | (code_point >> 12 & 0x3F);
+			*p++ = 0x80 | (code_point >> 6 & 0x3F);
+			*p++ = 0x80 | (code_point & 0x3F);
+		}
+	}
+
+	if (search->match_count)
+		sprintf(p, " (%ld of %zu)", search->selected + 1,
+			search->match_count);
+	else if (search->query_length)
+		sprintf(p, search->done ? " (no matches)" : " (searching)");
+	else
+		*p = 0;
+
+	wmstatus(status);
+}
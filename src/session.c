@@ -0,0 +1,365 @@
+// session.c - hosting any number of terminals in one process
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#define _GNU_SOURCE // accept4
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "terminix.h"
+
+// How long a client gets to say which directory its session starts in, in ns.
+#define REQUEST_TIMEOUT 1000000000
+
+struct session *session, *sessions;
+bool daemon_mode;
+
+// A daemon listens on a socket in the user's runtime directory, named after
+// the display it opens its windows on. A client sends it the directory it was
+// started in, ended by a NUL, and the daemon hangs up once the session is open.
+// owner is the daemon, whose shells would otherwise remove the socket as they
+// exit if they fail to start.
+static struct sockaddr_un address;
+static int listener = -1, next_number;
+static pid_t owner;
+
+// Clients are read from without blocking as what they send comes in. Each gets
+// one of requests until it has asked for its session or run out of time; once
+// they are all taken, the rest wait in the listen queue.
+static struct request {
+	int		fd;
+	char		directory[PATH_MAX];
+	size_t		size;
+	uint64_t	deadline;
+} requests[MAX_REQUESTS];
+static int request_count;
+
+static void find_socket(void);
+static void remove_socket(void);
+static void take_request(struct request *);
+static void drop_request(struct request *);
+
+// Opens a session at the end of the list, with its shell started in directory,
+// or in ours if that is NULL, and makes it current.
+void
+open_session(const char *directory)
+{
+	struct session *s, **p;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		pdie("failed to allocate session memory");
+
+	s->number = next_number++;
+	s->redraw = true;
+	s->window_visible = true;
+
+	for (p = &sessions; *p; p = &(*p)->next)
+		;
+
+	*p = s;
+	switch_session(s);
+
+	// The history has to be there before the screen can scroll into it.
+	init_history();
+	init_search();
+	init_screen();
+	resize(80, 24);
+	reset();
+	ptinit(directory);
+	wmopen();
+}
+
+// Closes the current session and makes the first one left current, if any.
+void
+close_session()
+{
+	struct session *s, **p;
+
+	s = session;
+	deinit_search();
+	wmclose();
+	ptkill();
+	deinit_screen();
+	deinit_history();
+
+	for (p = &sessions; *p != s; p = &(*p)->next)
+		;
+
+	*p = s->next;
+	free(s);
+	switch_session(sessions);
+}
+
+// Points every module at the state of the given session, which may be NULL
+// once there are none left.
+void
+switch_session(struct session *s)
+{
+	session = s;
+	term = s ? s->term : NULL;
+	history = s ? s->history : NULL;
+	search = s ? s->search : NULL;
+	pty = s ? s->pty : NULL;
+	win = s ? s->win : NULL;
+}
+
+// Starts listening for clients, for --daemon.
+void
+listen_sessions()
+{
+	int flags;
+
+	find_socket();
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		pdie("failed to create socket");
+
+	// A socket left behind by a daemon that is gone is taken over, but not
+	// one that is still being listened on.
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address))) {
+		if (errno != EADDRINUSE)
+			pdie("failed to bind socket");
+
+		if (!connect(listener, (struct sockaddr *)&address,
+			sizeof(address)))
+			errx(EXIT_FAILURE, "another daemon is already "
+				"listening on %s", address.sun_path);
+
+		close(listener);
+		unlink(address.sun_path);
+
+		if ((listener = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC,
+			0)) < 0)
+			pdie("failed to create socket");
+
+		if (bind(listener, (struct sockaddr *)&address,
+			sizeof(address)))
+			pdie("failed to bind socket");
+	}
+
+	owner = getpid();
+
+	if (atexit(remove_socket))
+		pdie("failed to register exit callback");
+
+	if (listen(listener, SOMAXCONN))
+		pdie("failed to listen on socket");
+
+	if ((flags = fcntl(listener, F_GETFL)) < 0 ||
+		fcntl(listener, F_SETFL, flags|O_NONBLOCK) == -1)
+		pdie("failed to set socket flags to non-blocking");
+}
+
+// Asks a daemon for a session in the directory we were started in and exits
+// once it has one open, for --client. Returns if there is no daemon to ask, so
+// that a window opens anyway.
+void
+request_session()
+{
+	char directory[PATH_MAX], byte;
+	ssize_t n;
+	int fd;
+
+	find_socket();
+
+	if (!getcwd(directory, sizeof(directory)))
+		pdie("failed to get working directory");
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		pdie("failed to create socket");
+
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+		warnx("no daemon is listening on %s; starting a window of our "
+			"own", address.sun_path);
+		close(fd);
+		return;
+	}
+
+	if (write(fd, directory, strlen(directory) + 1) < 0)
+		pdie("failed to write socket");
+
+	while ((n = read(fd, &byte, 1)) < 0 && errno == EINTR)
+		;
+
+	if (n < 0)
+		pdie("failed to read socket");
+
+	exit(EXIT_SUCCESS);
+}
+
+void
+session_prepare(struct pollfd *pfds)
+{
+	int i;
+
+	pfds[0].fd = request_count < MAX_REQUESTS ? listener : -1;
+	pfds[0].events = POLLIN;
+
+	for (i = 0; i < request_count; i++) {
+		pfds[i + 1].fd = requests[i].fd;
+		pfds[i + 1].events = POLLIN;
+	}
+
+	for (; i < MAX_REQUESTS; i++)
+		pfds[i + 1].fd = -1;
+}
+
+// Returns when the client that has waited longest runs out of time, or 0 if
+// none are waiting.
+uint64_t
+session_deadline()
+{
+	return request_count ? requests[0].deadline : 0;
+}
+
+// Opens a session for every client that has finished asking for one, which
+// leaves the last one current, and takes in any new clients.
+void
+session_poll()
+{
+	struct request *r;
+	int fd, i;
+
+	if (listener < 0)
+		return;
+
+	// A finished request is dropped by moving the ones after it down,
+	// which keeps them in the order they time out in.
+	for (i = 0; i < request_count; ) {
+		r = &requests[i];
+
+		if (r->fd >= 0)
+			take_request(r);
+
+		if (r->fd < 0)
+			drop_request(r);
+		else
+			i++;
+	}
+
+	while (request_count < MAX_REQUESTS) {
+		if ((fd = accept4(listener, NULL, NULL,
+			SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR && errno != ECONNABORTED)
+				pdie("failed to accept connection");
+
+			return;
+		}
+
+		r = &requests[request_count++];
+		r->fd = fd;
+		r->size = 0;
+		r->deadline = current_time + REQUEST_TIMEOUT;
+		take_request(r);
+
+		if (r->fd < 0)
+			drop_request(r);
+	}
+}
+
+// Works out the path of the socket for the display we are on.
+static void
+find_socket()
+{
+	const char *directory, *display;
+	char *p;
+
+	if (!(display = getenv("DISPLAY")) || headless)
+		display = "headless";
+
+	address.sun_family = AF_UNIX;
+
+	if ((directory = getenv("XDG_RUNTIME_DIR")) && *directory)
+		snprintf(address.sun_path, sizeof(address.sun_path),
+			"%s/terminix-%s", directory, display);
+	else
+		snprintf(address.sun_path, sizeof(address.sun_path),
+			"/tmp/terminix-%ld-%s", (long)getuid(), display);
+
+	// Displays on other hosts have slashes in their names.
+	for (p = strrchr(address.sun_path, '/') + 1; *p; p++)
+		if (*p == '/')
+			*p = '_';
+}
+
+static void
+remove_socket()
+{
+	if (getpid() == owner)
+		unlink(address.sun_path);
+}
+
+// Reads whatever more of the directory a client wants its session in has come
+// in, and opens the session once it has all of it. Closes the request's fd
+// once it is done with it, and gives a client that takes too long or hangs up
+// early nothing.
+static void
+take_request(struct request *r)
+{
+	ssize_t n;
+
+	while (r->size < sizeof(r->directory)) {
+		n = read(r->fd, &r->directory[r->size],
+			sizeof(r->directory) - r->size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (current_time < r->deadline)
+				return;
+
+			warnx("client took too long to ask for a session");
+			break;
+		}
+
+		// Another daemon seeing whether we are still here says
+		// nothing at all.
+		if (n <= 0) {
+			if (n < 0 || r->size)
+				warnx("client hung up before asking for a "
+					"session");
+			break;
+		}
+
+		if (memchr(&r->directory[r->size], 0, n)) {
+			open_session(r->directory);
+			break;
+		}
+
+		r->size += n;
+	}
+
+	if (r->size == sizeof(r->directory))
+		warnx("client asked for a session in too long a directory");
+
+	close(r->fd);
+	r->fd = -1;
+}
+
+// Removes a request that take_request() is done with.
+static void
+drop_request(struct request *r)
+{
+	memmove(r, r + 1, (char *)&requests[--request_count] - (char *)r);
+}
@@ -0,0 +1,305 @@
+// stats.c - counting where the time goes
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "terminix.h"
+
+// The overlay takes up the top right corner of the screen, HUD_ROWS lines of at
+// most HUD_COLUMNS characters each.
+#define HUD_ROWS 6
+#define HUD_COLUMNS 40
+
+struct stats stats;
+bool show_stats, hud_shown;
+
+// hud_base is what the counters were when the overlay was last worked out, at
+// hud_time, so that it shows what happened since rather than since the start.
+// hud_width is how many columns it takes up. Every session shows the same one.
+static struct stats hud_base;
+static uint64_t hud_time;
+static char hud_text[HUD_ROWS][HUD_COLUMNS];
+static int hud_width;
+static uint16_t hud_style;
+
+static void hud_line(int, const char *, ...)
+	__attribute__((format(printf, 2, 3)));
+static void add_latency(uint32_t *, uint64_t *, uint64_t);
+static double percentile(const uint32_t *, const uint32_t *, double);
+
+// Returns the time in ns, which unlike get_time() in terminix.c always follows
+// the real clock.
+uint64_t
+monotonic_time()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		pdie("failed to get time");
+
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds up what the render thread counted since glpoll() last looked.
+void
+count_frames(const struct frame_stats *drawn)
+{
+	stats.drawn.frames += drawn->frames;
+	stats.drawn.cells += drawn->cells;
+	stats.drawn.pixels += drawn->pixels;
+	stats.drawn.upload_bytes += drawn->upload_bytes;
+	stats.drawn.swap_time += drawn->swap_time;
+
+	if (drawn->frames && !stats.first_frame)
+		stats.first_frame = monotonic_time() - stats.start_time;
+
+	if (drawn->latency)
+		add_latency(stats.latencies, &stats.worst_latency,
+			drawn->latency);
+
+	if (drawn->key_latency)
+		add_latency(stats.key_latencies, &stats.worst_key_latency,
+			drawn->key_latency);
+}
+
+void
+toggle_hud()
+{
+	struct session *s;
+
+	hud_shown = !hud_shown;
+	hud_base = stats;
+	hud_time = monotonic_time();
+	update_hud();
+
+	for (s = sessions; s; s = s->next)
+		s->redraw = true;
+}
+
+// Works out the overlay again from what happened since the last time.
+void
+update_hud()
+{
+	struct stats d;
+	double seconds, frames;
+	uint64_t now;
+
+	now = monotonic_time();
+	seconds = (now - hud_time) / 1000000000.0;
+	d.reads = stats.reads - hud_base.reads;
+	d.read_bytes = stats.read_bytes - hud_base.read_bytes;
+	d.parse_bytes = stats.parse_bytes - hud_base.parse_bytes;
+	d.parse_time = stats.parse_time - hud_base.parse_time;
+	d.drawn.frames = stats.drawn.frames - hud_base.drawn.frames;
+	d.drawn.cells = stats.drawn.cells - hud_base.drawn.cells;
+	d.drawn.pixels = stats.drawn.pixels - hud_base.drawn.pixels;
+	d.drawn.upload_bytes =
+		stats.drawn.upload_bytes - hud_base.drawn.upload_bytes;
+	d.drawn.swap_time = stats.drawn.swap_time - hud_base.drawn.swap_time;
+	frames = d.drawn.frames ? d.drawn.frames : 1;
+	hud_width = 0;
+
+	hud_line(0, " read   %8.0f B/call %6.1f MB/s",
+		d.reads ? (double)d.read_bytes / d.reads : 0.0,
+		seconds ? d.read_bytes / seconds / 1000000 : 0.0);
+	hud_line(1, " parse  %8.2f ns/B   %6.1f fps",
+		d.parse_bytes ? (double)d.parse_time / d.parse_bytes : 0.0,
+		seconds ? d.drawn.frames / seconds : 0.0);
+	hud_line(2, " draw   %8.0f cells  %6.0f Kpx",
+		d.drawn.cells / frames, d.drawn.pixels / frames / 1000);
+	hud_line(3, " upload %8.0f KB     %6.2f ms",
+		d.drawn.upload_bytes / frames / 1000,
+		d.drawn.swap_time / frames / 1000000);
+	hud_line(4, " latency %5.1f %5.1f %5.1f ms",
+		percentile(stats.latencies, hud_base.latencies, 0.5),
+		percentile(stats.latencies, hud_base.latencies, 0.9),
+		percentile(stats.latencies, hud_base.latencies, 0.99));
+	hud_line(5, " typing  %5.1f %5.1f %5.1f ms",
+		percentile(stats.key_latencies, hud_base.key_latencies, 0.5),
+		percentile(stats.key_latencies, hud_base.key_latencies, 0.9),
+		percentile(stats.key_latencies, hud_base.key_latencies, 0.99));
+
+	hud_base = stats;
+	hud_time = now;
+}
+
+// Sets a line of the overlay. Lines are padded with spaces as they are drawn,
+// out to the width of the longest one plus a space.
+static void
+hud_line(int y, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(hud_text[y], sizeof(hud_text[y]), format, ap);
+	va_end(ap);
+
+	if (n >= (int)sizeof(hud_text[y]))
+		n = sizeof(hud_text[y]) - 1;
+
+	if (n + 1 > hud_width)
+		hud_width = n + 1;
+}
+
+// Gets the screen ready for gldraw() to take a snapshot of it. Wherever the
+// overlay was drawn last time is damaged, without asking for a frame, so that
+// the next snapshot has what is really there. The overlay's style is looked up
+// again each time, since the style table may have dropped it in between.
+void
+prepare_hud()
+{
+	struct style style;
+	int y, start;
+
+	if (session->drawn_width) {
+		start = term->width > session->drawn_width ?
+			term->width - session->drawn_width : 0;
+
+		for (y = 0; y < HUD_ROWS && y < term->height; y++)
+			damage_line(visible_line(y), term->width,
+				start ? start - 1 : 0, term->width);
+
+		session->drawn_width = 0;
+	}
+
+	if (!hud_shown)
+		return;
+
+	style = default_attrs;
+	style.negative = true;
+	hud_style = intern_style(&style);
+}
+
+// Draws the overlay over a snapshot prepare_hud() got the screen ready for.
+// Lines made of double-width characters are skipped, since the overlay would
+// be off their end.
+void
+draw_hud(struct snapshot *snapshot)
+{
+	struct line *line;
+	bool *highlights;
+	int start, length, x, y;
+
+	if (!hud_shown)
+		return;
+
+	start = snapshot->width - hud_width;
+
+	for (y = 0; y < HUD_ROWS && y < snapshot->height; y++) {
+		line = snapshot->lines[y];
+		highlights = snapshot_highlights(snapshot, y);
+		length = strlen(hud_text[y]);
+
+		if (line->dimensions != SINGLE_WIDTH)
+			continue;
+
+		// A double-width character running into the overlay is cut
+		// off instead.
+		if (start > 0)
+			line->cells[start - 1].wide = false;
+
+		for (x = start > 0 ? start : 0; x < snapshot->width; x++) {
+			line->cells[x].code_point = x - start < length ?
+				hud_text[y][x - start] : ' ';
+			line->cells[x].style = hud_style;
+			line->cells[x].wide = false;
+			highlights[x] = false;
+		}
+
+		damage_line(line, snapshot->width, start > 0 ? start - 1 : 0,
+			snapshot->width);
+	}
+
+	session->drawn_width = hud_width;
+}
+
+// Writes out the counters for the whole run, for --stats.
+void
+report_stats()
+{
+	static const uint32_t none[LATENCY_BUCKETS];
+
+	double frames;
+
+	frames = stats.drawn.frames ? stats.drawn.frames : 1;
+
+	fprintf(stderr, "startup: %.3f ms to the first frame\n",
+		stats.first_frame / 1000000.0);
+	fprintf(stderr, "read:    %lu bytes in %lu calls, %.0f bytes per "
+		"call\n", stats.read_bytes, stats.reads,
+		stats.reads ? (double)stats.read_bytes / stats.reads : 0.0);
+	fprintf(stderr, "parse:   %lu bytes in %.3f ms, %.2f ns per byte\n",
+		stats.parse_bytes, stats.parse_time / 1000000.0,
+		stats.parse_bytes ?
+		(double)stats.parse_time / stats.parse_bytes : 0.0);
+	fprintf(stderr, "draw:    %lu frames, %.0f cells and %.0f pixels "
+		"each\n", stats.drawn.frames, stats.drawn.cells / frames,
+		stats.drawn.pixels / frames);
+	fprintf(stderr, "upload:  %.0f bytes per frame\n",
+		stats.drawn.upload_bytes / frames);
+	fprintf(stderr, "swap:    %.3f ms per frame\n",
+		stats.drawn.swap_time / frames / 1000000);
+	fprintf(stderr, "latency: %.1f ms median, %.1f ms 90th percentile, "
+		"%.1f ms 99th percentile, %.1f ms worst\n",
+		percentile(stats.latencies, none, 0.5),
+		percentile(stats.latencies, none, 0.9),
+		percentile(stats.latencies, none, 0.99),
+		stats.worst_latency / 1000000.0);
+	fprintf(stderr, "typing:  %.1f ms median, %.1f ms 90th percentile, "
+		"%.1f ms 99th percentile, %.1f ms worst\n",
+		percentile(stats.key_latencies, none, 0.5),
+		percentile(stats.key_latencies, none, 0.9),
+		percentile(stats.key_latencies, none, 0.99),
+		stats.worst_key_latency / 1000000.0);
+}
+
+static void
+add_latency(uint32_t *latencies, uint64_t *worst, uint64_t latency)
+{
+	long bucket;
+
+	if ((bucket = latency / LATENCY_BUCKET) >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	latencies[bucket]++;
+
+	if (latency > *worst)
+		*worst = latency;
+}
+
+// Returns the latency, in ms, that the given fraction of the frames counted in
+// latencies and not in base took no longer than.
+static double
+percentile(const uint32_t *latencies, const uint32_t *base, double fraction)
+{
+	unsigned long total, seen;
+	long i;
+
+	for (total = 0, i = 0; i < LATENCY_BUCKETS; i++)
+		total += latencies[i] - base[i];
+
+	if (!total)
+		return 0;
+
+	for (seen = 0, i = 0; i < LATENCY_BUCKETS - 1; i++)
+		if ((seen += latencies[i] - base[i]) >= total * fraction)
+			break;
+
+	return (i + 1) * LATENCY_BUCKET / 1000000.0;
+}
@@ -0,0 +1,61 @@
+// stubs.c - the parts of terminix the bench and the checks leave out
+// Copyright (C) 2019 Megan Ruggiero. All rights reserved.
+//
+// Permission to use, copy, modify, and distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+#include <stdlib.h>
+#include <time.h>
+#include "terminix.h"
+
+// These are defined by terminix.c, which the bench and the checks replace.
+const char *answerback = "";
+int timer_count;
+uint64_t current_time;
+struct session *session, *sessions;
+
+// stats.c is left out along with the rest of the statistics.
+uint64_t
+monotonic_time()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		pdie("failed to get time");
+
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// There is no window and no child, so there is nothing to tell them.
+void wminit(void) {}
+void wmkill(void) {}
+bool wmprepare(struct pollfd *pfd) { pfd->fd = -1; return false; }
+void wmpoll(void) {}
+void wmname(const char *name __attribute__((unused))) {}
+void wmstatus(const char *status __attribute__((unused))) {}
+void wmiconname(const char *name __attribute__((unused))) {}
+void wmresize(void) {}
+void wmbell(void) {}
+
+void
+wmparsecolor(struct color *color, const char *name __attribute__((unused)))
+{
+	color->r = color->g = color->b = 0;
+}
+
+void ptresize(void) {}
+void pthold(bool hold __attribute__((unused))) {}
+void ptbreak(bool hold __attribute__((unused))) {}
+void ptwrite(const void *data __attribute__((unused)),
+	size_t size __attribute__((unused))) {}
+void ptputs(const char *string __attribute__((unused))) {}
+void ptputn(unsigned number __attribute__((unused))) {}
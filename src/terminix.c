@@ -13,31 +13,70 @@
 // ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 // OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+#include <errno.h>
 #include <getopt.h>
 #include <locale.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include "terminix.h"
 
 char *instance_name;
 const char *answerback = "";
 float opacity = 1.0, glow = 0.0, static_ = 0.0, glow_line = 0.0,
 	glow_line_speed = 4.0;
+int renderer = RENDERER_SOFTWARE;
+bool headless, dump_changed, low_latency;
+const char *dump_directory;
+const char *record_path, *replay_path;
+double replay_speed = 1.0;
+uint64_t replay_from;
+
+// Blink timer period, shortest time between frames, shortest time between
+// frames while the window can't be seen, and longest time a synchronized
+// update can hold frames back, all in ns.
+#define TICK_INTERVAL 400000000
+#define FRAME_INTERVAL 16666667
+#define HIDDEN_INTERVAL 1000000000
+#define SYNC_TIMEOUT 500000000
+
+// The X connection, the render and search pipes and the session sockets come
+// first in the pollfds waited on, and then two for each session's
+// pseudoterminal.
+#define SHARED_POLLS (3 + SESSION_POLLS)
 
 int timer_count;
 uint64_t current_time;
 
+// If time_step is set, the clock is fixed_time, which moves on by exactly that
+// much every time round the main loop, so that runs can be repeated and timed
+// against each other.
+static uint64_t time_step, fixed_time;
+
+// Set by --client, to ask a daemon for a window instead of opening one.
+static bool client_mode;
+
 static void parse_command_line(int, char **);
 static float parse_percentage(const char *);
+static size_t parse_size(const char *);
 static uint64_t get_time(void);
+static void update_session(bool);
+static uint64_t next_frame(void);
+static void close_sessions(void);
+static void wait_for_events(uint64_t);
+static void shorten(int *, int);
+static int time_until(uint64_t);
 static void handle_exit(void);
 
 int
 main(int argc, char **argv)
 {
+	struct session *s;
 	uint64_t lasttick;
+	bool tick;
+
+	stats.start_time = monotonic_time();
 
 	if (atexit(handle_exit))
 		pdie("failed to register exit callback");
@@ -46,22 +85,52 @@ main(int argc, char **argv)
 		warnx("failed to set locale");
 
 	parse_command_line(argc, argv);
-	resize(80, 24);
-	reset();
-	ptinit();
+
+	if (client_mode)
+		request_session();
+
+	// Shells that exit are reaped as they go, since sessions can close
+	// long before we do.
+	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+		pdie("failed to ignore child signals");
+
+	if (daemon_mode)
+		listen_sessions();
+
+	open_session(NULL);
 	wminit();
 	// glinit called by wminit
-	lasttick = 0;
+
+	// The libraries EGL loads register exit callbacks of their own, which
+	// would otherwise run while the render thread is still using them.
+	if (atexit(glstop))
+		pdie("failed to register exit callback");
+
+	lasttick = session->last_frame = get_time();
 
 	for (;;) {
-		while ((current_time = get_time()) - lasttick > 400000000) {
+		wait_for_events(lasttick);
+		fixed_time += time_step;
+
+		if ((tick = (current_time = get_time()) - lasttick >=
+			TICK_INTERVAL)) {
 			lasttick = current_time;
 			timer_count++;
+
+			if (hud_shown)
+				update_hud();
 		}
 
 		wmpoll();
-		ptpump();
-		gldraw();
+		session_poll();
+		glpoll();
+
+		for (s = sessions; s; s = s->next) {
+			switch_session(s);
+			update_session(tick);
+		}
+
+		close_sessions();
 	}
 }
 
@@ -69,7 +138,10 @@ static void
 parse_command_line(int argc, char **argv)
 {
 	enum { HELP = 1, VERSION, NAME, ANSWERBACK, OPACITY, GLOW, STATIC,
-		GLOW_LINE, GLOW_LINE_SPEED };
+		GLOW_LINE, GLOW_LINE_SPEED, RENDERER, SCROLLBACK,
+		SCROLLBACK_SPILL, HEADLESS, DUMP, DUMP_CHANGED, TIMESTEP,
+		STATS, LOW_LATENCY, DAEMON, CLIENT, RECORD, REPLAY,
+		REPLAY_SPEED, REPLAY_FROM };
 
 	static const struct option options[] = {
 		{ "help", no_argument, 0, HELP },
@@ -81,6 +153,21 @@ parse_command_line(int argc, char **argv)
 		{ "static", required_argument, 0, STATIC },
 		{ "glow-line", required_argument, 0, GLOW_LINE },
 		{ "glow-line-speed", required_argument, 0, GLOW_LINE_SPEED },
+		{ "renderer", required_argument, 0, RENDERER },
+		{ "scrollback", required_argument, 0, SCROLLBACK },
+		{ "scrollback-spill", required_argument, 0, SCROLLBACK_SPILL },
+		{ "headless", no_argument, 0, HEADLESS },
+		{ "dump", required_argument, 0, DUMP },
+		{ "dump-changed", required_argument, 0, DUMP_CHANGED },
+		{ "timestep", required_argument, 0, TIMESTEP },
+		{ "stats", no_argument, 0, STATS },
+		{ "low-latency", no_argument, 0, LOW_LATENCY },
+		{ "daemon", no_argument, 0, DAEMON },
+		{ "client", no_argument, 0, CLIENT },
+		{ "record", required_argument, 0, RECORD },
+		{ "replay", required_argument, 0, REPLAY },
+		{ "replay-speed", required_argument, 0, REPLAY_SPEED },
+		{ "replay-from", required_argument, 0, REPLAY_FROM },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -117,6 +204,64 @@ parse_command_line(int argc, char **argv)
 		case GLOW_LINE_SPEED:
 			glow_line_speed = atof(optarg);
 			break;
+		case RENDERER:
+			if (!strcmp(optarg, "software"))
+				renderer = RENDERER_SOFTWARE;
+			else if (!strcmp(optarg, "instanced"))
+				renderer = RENDERER_INSTANCED;
+			else
+				die("renderer must be software or instanced");
+			break;
+		case SCROLLBACK:
+			history_budget = parse_size(optarg);
+			break;
+		case SCROLLBACK_SPILL:
+			spill_budget = parse_size(optarg);
+			break;
+		case HEADLESS:
+			headless = true;
+			break;
+		case DUMP_CHANGED:
+			dump_changed = true;
+			// fall through
+		case DUMP:
+			dump_directory = optarg;
+			break;
+		case TIMESTEP:
+			if (atof(optarg) <= 0)
+				die("timestep must be a positive number of ms");
+
+			time_step = atof(optarg) * 1000000;
+			break;
+		case STATS:
+			show_stats = true;
+			break;
+		case LOW_LATENCY:
+			low_latency = true;
+			break;
+		case DAEMON:
+			daemon_mode = true;
+			break;
+		case CLIENT:
+			client_mode = true;
+			break;
+		case RECORD:
+			record_path = optarg;
+			break;
+		case REPLAY:
+			replay_path = optarg;
+			break;
+		case REPLAY_SPEED:
+			if ((replay_speed = atof(optarg)) < 0)
+				die("replay speed must be a factor, or 0 "
+					"for as fast as possible");
+			break;
+		case REPLAY_FROM:
+			if (atof(optarg) < 0)
+				die("replay must start a number of seconds in");
+
+			replay_from = atof(optarg) * 1000000000;
+			break;
 		case '?':
 			badopt = true;
 			break;
@@ -125,6 +270,15 @@ parse_command_line(int argc, char **argv)
 	if (badopt)
 		die("bad command line arguments; aborting...");
 
+	if (dump_directory && !headless)
+		die("frames can only be dumped with --headless");
+
+	if (daemon_mode && client_mode)
+		die("--daemon and --client cannot be used together");
+
+	if (record_path && replay_path)
+		die("--record and --replay cannot be used together");
+
 	if (!instance_name)
 		instance_name = getenv("RESOURCE_NAME");
 
@@ -144,15 +298,198 @@ parse_percentage(const char *argument)
 	return atof(argument);
 }
 
+// Parses a number of bytes, which may be followed by K, M, or G.
+static size_t
+parse_size(const char *argument)
+{
+	char *end;
+	size_t size;
+
+	size = strtoul(argument, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	}
+
+	if (end == argument || *end)
+		die("scrollback sizes must be a number of bytes");
+
+	return size;
+}
+
 static uint64_t
 get_time()
 {
-	struct timespec ts;
+	return time_step ? fixed_time : monotonic_time();
+}
 
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
-		pdie("failed to get time");
+// Brings the current session up to date with whatever came in, and hands a
+// frame of it over if one is due.
+static void
+update_session(bool tick)
+{
+	// The cursor only changes phase every other tick.
+	if (tick && (session->blinking || hud_shown ||
+		(getmode(DECTCEM) && !(timer_count % 2))))
+		session->redraw = true;
 
-	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (static_ || glow_line)
+		session->redraw = true;
+
+	ptpump();
+	search_poll();
+
+	if (!getmode(SYNC))
+		session->synced_since = 0;
+	else if (!session->synced_since)
+		session->synced_since = current_time;
+
+	// However much output came in since the last frame, it all goes into
+	// the next one.
+	if (session->redraw && current_time >= next_frame() && gldraw())
+		session->last_frame = current_time;
+}
+
+// Returns the earliest time the current session's next frame may be drawn.
+// Frames are held back while a synchronized update is in progress, but not for
+// long, in case whatever started it never finishes. In low-latency mode, the
+// echo of a key goes up without waiting.
+static uint64_t
+next_frame()
+{
+	uint64_t next;
+
+	if (low_latency && session->echoed && !session->synced_since)
+		return session->last_frame;
+
+	next = session->last_frame + (session->window_visible ?
+		FRAME_INTERVAL : HIDDEN_INTERVAL);
+
+	if (session->synced_since &&
+		session->synced_since + SYNC_TIMEOUT > next)
+		next = session->synced_since + SYNC_TIMEOUT;
+
+	return next;
+}
+
+// Closes the sessions that are over, and exits once the last one is unless we
+// are a daemon. Without a window, the last of a session's output is drawn
+// before it goes.
+static void
+close_sessions()
+{
+	struct session *s, *next;
+
+	for (s = sessions; s; s = next) {
+		next = s->next;
+
+		if (!s->closed)
+			continue;
+
+		switch_session(s);
+
+		if (headless)
+			glflush();
+
+		close_session();
+	}
+
+	if (!sessions && !daemon_mode)
+		exit(EXIT_SUCCESS);
+}
+
+// Sleeps until a pseudoterminal, the X server or a client has something for us
+// or the next blink tick or frame is due, whichever comes first.
+static void
+wait_for_events(uint64_t lasttick)
+{
+	static struct pollfd *pfds;
+	static size_t capacity;
+
+	struct session *s;
+	uint64_t deadline;
+	size_t count;
+	int timeout;
+	bool due;
+
+	for (count = SHARED_POLLS, s = sessions; s; s = s->next)
+		count += 2;
+
+	if (count > capacity) {
+		capacity = count * 2;
+
+		if (!(pfds = realloc(pfds, capacity * sizeof(*pfds))))
+			pdie("failed to allocate event memory");
+	}
+
+	timeout = -1;
+	due = false;
+
+	if (wmprepare(&pfds[0]))
+		timeout = 0;
+
+	glprepare(&pfds[1]);
+	search_prepare(&pfds[2]);
+	session_prepare(&pfds[3]);
+
+	if ((deadline = session_deadline()))
+		shorten(&timeout, time_until(deadline));
+
+	for (count = SHARED_POLLS, s = sessions; s; s = s->next, count += 2) {
+		switch_session(s);
+
+		if (getmode(DECTCEM) || session->blinking || hud_shown)
+			shorten(&timeout, time_until(lasttick + TICK_INTERVAL));
+
+		if (ptprepare(&pfds[count]))
+			timeout = 0;
+
+		// A recording being played back is due like a frame is, and
+		// a fixed clock waits for the renderer before it moves on, so
+		// that it plays back the same way every time.
+		if ((deadline = ptdeadline()) && (!time_step || glidle())) {
+			shorten(&timeout, time_until(deadline));
+			due = true;
+		}
+
+		// When the renderer is still busy, the frame waits for it to
+		// finish.
+		if (glidle() && (session->redraw || static_ || glow_line)) {
+			shorten(&timeout, time_until(next_frame()));
+			due = true;
+		}
+	}
+
+	// A fixed clock does not move while we wait, so a frame that is due
+	// later is only waited for by going round again, and nothing else that
+	// depends on the time counts as something to wait for.
+	if (time_step && timeout > 0)
+		timeout = due ? 0 : -1;
+
+	if (poll(pfds, count, timeout) < 0 && errno != EINTR)
+		pdie("failed to wait for events");
+}
+
+// Makes timeout, in ms or -1 for none, no longer than ms.
+static void
+shorten(int *timeout, int ms)
+{
+	if (*timeout < 0 || ms < *timeout)
+		*timeout = ms;
+}
+
+// Returns the number of milliseconds until deadline, rounded up.
+static int
+time_until(uint64_t deadline)
+{
+	uint64_t now;
+
+	if ((now = get_time()) >= deadline)
+		return 0;
+
+	return (deadline - now + 999999) / 1000000;
 }
 
 static void
@@ -160,9 +497,19 @@ handle_exit()
 {
 	// NOTE : wmkill() *MUST* be called before glkill().
 	// Some EGL implementations register exit callbacks with Xlib. If we
-	// kill Xlib before EGL, we'll get a segmentation fault at exit.
+	// kill Xlib before EGL, we'll get a segmentation fault at exit. The
+	// render thread has to be stopped before either, though.
+	glstop();
+	glpoll();
+
+	if (show_stats)
+		report_stats();
+
+	while (sessions) {
+		switch_session(sessions);
+		close_session();
+	}
+
 	wmkill();
 	glkill();
-	ptkill();
-	deinit_screen();
 }
\ No newline at end of file
@@ -17,9 +17,11 @@
 #define TERMINIX_H
 
 #include <err.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <EGL/eglplatform.h>
 
@@ -38,22 +40,116 @@
 extern char *instance_name;
 extern const char *answerback;
 extern float opacity, glow, static_, glow_line, glow_line_speed;
+extern size_t history_budget, spill_budget;
+
+enum { RENDERER_SOFTWARE, RENDERER_INSTANCED };
+extern int renderer;
+
+// Without a window, frames are drawn offscreen and, if dump_directory is set,
+// written into it as a numbered sequence of PNG images; only those that differ
+// from the one before if dump_changed is set.
+extern bool headless, dump_changed;
+extern const char *dump_directory;
+
+// In low-latency mode, what is typed goes out right away, the loop waits a
+// moment for its echo, and the frame showing it is drawn without waiting its
+// turn and presented as soon as it is ready, only where the screen changed.
+extern bool low_latency;
+
+// The first session's output is recorded to record_path if it is set, or
+// played back from replay_path instead of starting a shell, replay_speed times
+// as fast as it was recorded or as fast as possible if that is 0, starting
+// replay_from ns into it.
+extern const char *record_path, *replay_path;
+extern double replay_speed;
+extern uint64_t replay_from;
 
 // --- timing --- //
 
 extern int timer_count;
 extern uint64_t current_time;
 
+// --- sessions --- //
+
+// One process can host any number of sessions, each a terminal with a shell, a
+// scrollback history and a window of its own, while the X connection, the EGL
+// context, the shader programs and the glyph atlas are shared. The state of
+// each module lives in a structure the session points to, and the module works
+// on the current session's, which switch_session() changes.
+//
+// redraw is set whenever something on screen has changed and is cleared once
+// gldraw() hands a snapshot to the render thread; blinking is set by glpoll()
+// if the last frame drawn contained blinking text. echoed is set once output
+// arrives after a key was pressed, until gldraw() hands over the frame that
+// shows it. window_visible is cleared while the window is unmapped or fully
+// covered by other windows, when frames are drawn at a much lower rate. closed
+// is set once the shell hangs up or the window is closed, and the main loop
+// closes the session when it next comes round.
+//
+// output_time is when the oldest output not yet handed to the renderer was
+// parsed and key_time when the oldest key not yet echoed on screen was pressed,
+// or 0. last_frame is when the last frame was handed over and synced_since when
+// the synchronized update in progress, if any, started. drawn_width is how many
+// columns the overlay took up the last time it was drawn over a snapshot, or 0.
+struct terminal;
+struct history;
+struct search;
+struct pty;
+struct window;
+struct view;
+
+struct session {
+	struct terminal	*term;
+	struct history	*history;
+	struct search	*search;
+	struct pty	*pty;
+	struct window	*win;
+	struct view	*view;
+	struct session	*next;
+	int		 number, window_width, window_height, drawn_width;
+	uint64_t	 output_time, key_time, last_frame, synced_since;
+	bool		 redraw, blinking, echoed, searching, window_visible;
+	bool		 closed;
+};
+
+// sessions is the list of them all, in the order they were opened, and each is
+// numbered one higher than the highest before it. daemon_mode is set to keep
+// running once the last one closes, for --client to ask for more.
+//
+// session_prepare() fills in SESSION_POLLS pollfds: the socket clients connect
+// to, and each of the MAX_REQUESTS clients that can be waited on at once to
+// say where they want their sessions.
+#define MAX_REQUESTS 8
+#define SESSION_POLLS (1 + MAX_REQUESTS)
+
+extern struct session *session, *sessions;
+extern bool daemon_mode;
+
+void open_session(const char *);
+void close_session(void);
+void switch_session(struct session *);
+void listen_sessions(void);
+void request_session(void);
+void session_prepare(struct pollfd *);
+uint64_t session_deadline(void);
+void session_poll(void);
+
 // --- window management --- //
 
 struct color { uint8_t r, g, b; };
 
-extern int window_width, window_height;
+// wminit() connects to the X server, which every session shares, and wmopen()
+// and wmclose() open and close the current session's window.
+extern struct window *win;
 
 void wminit(void);
 void wmkill(void);
+void wmopen(void);
+void wmclose(void);
+bool wmprepare(struct pollfd *);
 void wmpoll(void);
 void wmname(const char *);
+void wmstatus(const char *);
 void wmiconname(const char *);
 void wmresize(void);
 void wmbell(void);
@@ -61,40 +157,286 @@ void wmparsecolor(struct color *, const char *);
 
 // --- rendering --- //
 
-void glinit(EGLNativeDisplayType, EGLNativeWindowType);
+// Frames are drawn from a snapshot of the screen on a thread of their own,
+// which draws every session's. glinit() sets up what the sessions share, and
+// glopen() and glclose() what the current session's window needs.
+void glinit(EGLNativeDisplayType);
+void glopen(EGLNativeWindowType);
+void glclose(void);
+void glstop(void);
+void glflush(void);
 void glkill(void);
-void gldraw(void);
+void glprepare(struct pollfd *);
+bool glidle(void);
+void glpoll(void);
+bool gldraw(void);
+
+// The software renderer draws into a canvas, which holds width by height RGBA
+// pixels as of the last snapshot drawn into it. upload_top and upload_bottom
+// are the rows it changed since whoever reads them last cleared them. It
+// remembers where it drew the cursor and which blink phase it drew so it can
+// repair those cells when they change. A zeroed canvas is empty.
+struct snapshot;
+
+struct canvas {
+	unsigned char	*pixels;
+	int		 width, height, upload_top, upload_bottom, blink_phase;
+	short		 cursor_x, cursor_y;
+	bool		 cursor_drawn;
+};
+
+// How many cells and pixels the software renderer drew since whoever reads them
+// last cleared them.
+extern unsigned long cells_drawn, pixels_drawn;
+
+void init_raster(void);
+void deinit_canvas(struct canvas *);
+bool rasterize(struct canvas *, struct snapshot *);
+void follow_shift(struct snapshot *, short *);
+
+// What both renderers share, from raster.c, for drawing a line as spans of
+// cells in the same style. init_spans() has to be called once the font is
+// loaded.
+struct style;
+struct cell;
+struct line;
+
+void init_spans(void);
+int span_end(const struct line *, const bool *, int, int);
+void span_colors(const struct snapshot *, const struct style *, bool,
+	struct color *, struct color *);
+bool blank_cell(const struct cell *, const struct style *);
+
+void write_png(const char *, const unsigned char *, int, int, long);
+
+// --- statistics --- //
+
+// Frame latencies are counted in buckets of LATENCY_BUCKET ns, and any longer
+// than the last bucket go in it.
+#define LATENCY_BUCKET 100000
+#define LATENCY_BUCKETS 2000
+
+// What the render thread did, which it counts up itself and the main thread
+// adds to stats from glpoll(). latency is how long the last frame took to show,
+// from when the oldest output in it was parsed, and key_latency from when the
+// key it echoes was pressed; either is 0 if there was no such thing.
+struct frame_stats {
+	unsigned long	frames, cells, pixels, upload_bytes;
+	uint64_t	swap_time, latency, key_latency;
+};
+
+// Counters for the whole run and every session, which belong to the main
+// thread. Times are in ns. start_time is when we started, by monotonic_time(),
+// and first_frame how long after that the first frame showed, or 0.
+struct stats {
+	unsigned long		reads, read_bytes, parse_bytes;
+	uint64_t		parse_time, start_time, first_frame;
+	uint64_t		worst_latency, worst_key_latency;
+	struct frame_stats	drawn;
+	uint32_t		latencies[LATENCY_BUCKETS];
+	uint32_t		key_latencies[LATENCY_BUCKETS];
+};
+
+// show_stats is set to report the counters at exit, and hud_shown while they
+// are drawn over the top right corner of the screen.
+extern struct stats stats;
+extern bool show_stats, hud_shown;
+
+uint64_t monotonic_time(void);
+void count_frames(const struct frame_stats *);
+void toggle_hud(void);
+void update_hud(void);
+void prepare_hud(void);
+void draw_hud(struct snapshot *);
+void report_stats(void);
 
 // --- pseudoterminals --- //
 
-void ptinit(void);
+extern struct pty *pty;
+
+void ptinit(const char *);
 void ptkill(void);
 void ptbreak(bool);
-void ptwrite(const char *, ...) __attribute__((__format__(printf, 1, 2)));
+void ptresize(void);
+void ptpause(void);
+void pthold(bool);
+bool ptprepare(struct pollfd *);
+void ptwrite(const void *, size_t);
+void ptputs(const char *);
+void ptputn(unsigned);
 void ptpump(void);
+void pttyped(void);
+uint64_t ptdeadline(void);
+
+// --- recording --- //
+
+// A recorder writes a session's output out as it is read, with the screen
+// packed into a keyframe every so often, on a thread of its own. A replay
+// plays a recording back through the parser, and can seek to any time in it
+// from the keyframe before.
+struct recorder;
+struct replay;
+
+struct recorder *start_recording(const char *, void (*)(void *), void *);
+void stop_recording(struct recorder *);
+size_t recorded_bytes(struct recorder *);
+void record_output(struct recorder *, const void *, size_t);
+void record_resize(struct recorder *, size_t);
+void record_screen(struct recorder *, size_t);
+struct replay *open_replay(const char *, double);
+void close_replay(struct replay *);
+void seek_replay(struct replay *, uint64_t);
+size_t play_replay(struct replay *, uint64_t);
+uint64_t replay_deadline(const struct replay *);
 
 // --- escape codes --- //
 
+// The parsers look each code point up in a transition table generated by
+// buildparser.rb. An entry holds the action to perform in its low byte and, if
+// the code point leads to a state, that state plus one in its high byte. The
+// last input of a table stands for every code point past the ones before it.
+enum {
+	VT100_GROUND,
+	VT100_ESCAPE,
+	VT100_ESCAPE_INTERMEDIATE,
+	VT100_CSI_ENTRY,
+	VT100_CSI_PARAM,
+	VT100_CSI_INTERMEDIATE,
+	VT100_CSI_IGNORE,
+	VT100_DCS_ENTRY,
+	VT100_DCS_PARAM,
+	VT100_DCS_INTERMEDIATE,
+	VT100_DCS_PASSTHROUGH,
+	VT100_DCS_IGNORE,
+	VT100_OSC_STRING,
+	VT100_SOS_STRING,
+	VT100_PM_STRING,
+	VT100_APC_STRING,
+	VT100_STATES
+};
+
+enum {
+	VT100_DO_NOTHING,
+	VT100_DO_EXECUTE,
+	VT100_DO_PRINT,
+	VT100_DO_SUBSTITUTE,
+	VT100_DO_COLLECT,
+	VT100_DO_PARAM,
+	VT100_DO_ESC_DISPATCH,
+	VT100_DO_CSI_DISPATCH,
+	VT100_DO_OSC_PUT,
+	VT100_DO_OSC_END
+};
+
+enum {
+	VT52_GROUND,
+	VT52_ESCAPE,
+	VT52_DCA1,
+	VT52_DCA2,
+	VT52_SETFG,
+	VT52_SETBG,
+	VT52_STATES
+};
+
+enum {
+	VT52_DO_NOTHING,
+	VT52_DO_EXECUTE,
+	VT52_DO_PRINT,
+	VT52_DO_ESC_DISPATCH,
+	VT52_DO_ROW,
+	VT52_DO_COLUMN,
+	VT52_DO_FOREGROUND,
+	VT52_DO_BACKGROUND
+};
+
+#define VT100_INPUTS 0xA1
+#define VT52_INPUTS 0x81
+
+extern const unsigned short vt100_transitions[VT100_STATES][VT100_INPUTS];
+extern const unsigned short vt52_transitions[VT52_STATES][VT52_INPUTS];
+
+// Where each terminal's parsers are part way through a sequence. sequence_size
+// is how many continuation bytes the UTF-8 decoder still expects,
+// sequence_lower and sequence_upper the range the next one must fall in, and
+// code_point the bits of the code point decoded so far.
+#define MAX_PARAMETERS 16
+
+struct parser {
+	int		state, vt52_state;
+	unsigned char	intermediates[2];
+	unsigned short	parameters[MAX_PARAMETERS];
+	unsigned char	parameter_index;
+	char		osc[512];
+	size_t		osc_size, osc_data_offset;
+	char		sequence_size;
+	unsigned char	sequence_lower, sequence_upper;
+	long		code_point;
+};
+
 void unrecognized_escape(unsigned char, unsigned char, unsigned char);
 void execute(unsigned char);
 void vtinterp(unsigned char);
+void vtinterp_buf(const unsigned char *, size_t);
+size_t printable_run(const unsigned char *, size_t);
 void vt52(long);
 void vt100(long);
+size_t vt100_text(const unsigned char *, size_t);
 
 // --- unifont --- //
 
-extern const unsigned char *const plane0and1[];
-extern const unsigned char *const plane15[];
+// Glyphs are packed into glyph_data by buildfont.rb. Each starts with 1 if it
+// is 8x16 or 2 if it is 16x16, followed by its rows; code points without a
+// glyph point at a zero byte. They are found in two steps, through the page of
+// 256 code points a code point is on and then its offset within that page.
+struct glyph_page {
+	uint32_t	base;
+	uint16_t	offsets[256];
+};
+
+extern const unsigned char glyph_data[];
+extern const struct glyph_page glyph_pages[];
+extern const uint16_t glyph_page_index[];
+
 static inline const unsigned char *
 find_glyph(long code_point)
 {
-	if (code_point >= 0x000000 && code_point <= 0x01FFFF)
-		return plane0and1[code_point];
+	const struct glyph_page *page;
+
+	if (code_point < 0 || code_point > 0x10FFFF)
+		return glyph_data;
+
+	page = &glyph_pages[glyph_page_index[code_point >> 8]];
+	return &glyph_data[page->base + page->offsets[code_point & 0xFF]];
+}
+
+// Returns whether a glyph from find_glyph() lights no pixels at all.
+static inline bool
+glyph_blank(const unsigned char *glyph)
+{
+	int i;
 
-	if (code_point >= 0x0F0000 && code_point <= 0x0FFFFF)
-		return plane15[code_point - 0x0F0000];
+	for (i = 0; i < glyph[0] * 16; i++)
+		if (glyph[1 + i])
+			return false;
 
-	return 0;
+	return true;
+}
+
+// Widths are packed two bits to a code point into pages the same way, with
+// pages that come out the same shared.
+extern const uint8_t width_pages[][64];
+extern const uint16_t width_page_index[];
+
+// Returns how many columns a code point takes up: 0 if it combines with the one
+// before it, 2 if it is wide, and 1 otherwise.
+static inline int
+char_width(long code_point)
+{
+	if (code_point < 0 || code_point > 0x10FFFF)
+		return 1;
+
+	return width_pages[width_page_index[code_point >> 8]]
+		[(code_point & 0xFF) >> 2] >> (code_point & 3) * 2 & 3;
 }
 
 // --- screen management --- //
@@ -109,8 +451,6 @@ enum { FRAME_NONE, FRAME_FRAMED, FRAME_ENCIRCLED };
 
 enum {
 	UTF8	= 1 <<  0, // Enable UTF-8 interpreter.
-	XOFF	= 1 <<  1, // Data transmission disabled by an XOFF octet.
-	PAUSED	= 1 <<  2, // Used by xlib.c to track sent XON/XOFF signals.
 	AUTOPRINT=1 <<  3, // TODO : Autoprint line on LF, FF, VT, or DECAWM
 	VT52GFX	= 1 <<  4, // VT52 Graphic Character Set Enabled
 	S8C1T	= 1 <<  5, // Send 8-bit control sequences (TODO : implement)
@@ -124,7 +464,8 @@ enum {
 	DECAWM	= 1 << 13, // Autowrap Mode
 	DECARM	= 1 << 14, // Auto Repeat Mode
 	DECINLM	= 1 << 15, // Interlace Mode (TODO : implement)
-	DECTCEM	= 1 << 16  // Text Cursor Enable Mode
+	DECTCEM	= 1 << 16, // Text Cursor Enable Mode
+	SYNC	= 1 << 17  // Synchronized Update Mode (frames wait for reset)
 };
 
 // From the days of yore, when Unicode wasn't available on terminals and
@@ -137,21 +478,38 @@ enum {
 enum { GL, GR };
 enum { G0, G1, G2, G3 };
 
-struct cell {
+struct style {
 	struct color	background, foreground;
-	uint32_t	code_point:21;
 	uint8_t		font:4, intensity:2, blink:2, underline:2, frame:2;
 	bool		italic:1, negative:1, crossed_out:1, fraktur:1,
 			overline:1, bg_truecolor:1, fg_truecolor:1;
 };
 
+// Cells refer to their attributes by an index into styles. Style 0 has every
+// attribute cleared so that zeroed cells are valid, and styles that no cell
+// uses any more are reclaimed when the table fills up. wide is set when the
+// character also covers the next cell.
+struct cell {
+	uint32_t	code_point;
+	uint16_t	style;
+	bool		wide;
+};
+
+// damage_start and damage_end are the half-open range of cells that must be
+// redrawn; the line is clean when damage_start >= damage_end. blinks is set by
+// the renderer when something on the line was drawn blinking. wrapped is set
+// when text ran off the end of the line onto the next one, so that resizing
+// can join them back up.
 struct line {
 	char		dimensions;
+	bool		blinks, wrapped;
+	short		damage_start, damage_end;
 	struct cell	cells[];
 };
 
 struct cursor {
-	struct cell	 attrs;
+	struct style	 attrs;
+	uint16_t	 style;
 	const uint32_t	*logical_charsets[4];
 	int		 active_charsets[2];
 	short		 x, y;
@@ -167,15 +525,71 @@ extern const uint32_t
 	charset_dec_graphics[],
 	charset_vt52_graphics[];
 
-extern const struct cell default_attrs;
+extern const struct style default_attrs;
+
+// Style indices are 16 bits wide.
+#define MAX_STYLES 65536
 
-extern struct color palette[256];
-extern long mode;
-extern struct cursor cursor, saved_cursor;
-extern bool *tabstops;
-extern struct line **lines;
-extern short screen_width, screen_height, scroll_top, scroll_bottom;
+// Everything the escape codes can change about a terminal. view holds the
+// lines shown instead of lines while scrollback is nonzero, and shift_top,
+// shift_bottom and shift describe how far the lines of that region moved since
+// the renderer last saw them; see note_shift().
+//
+// Cells refer to their terminal's styles, which style_hash maps hashes of to
+// their indices, 0 marking an empty slot. free_styles holds the indices
+// collect_styles() reclaimed, and styles from changed_first to changed_last
+// were added since the last snapshot.
+//
+// Every line lives in arena, and ring holds the order of the lines twice over
+// so that lines can start anywhere in its first half and still see height of
+// them in a row. spare is scratch space for rotating lines. view points into
+// view_arena, where the lines shown while scrolled back through the history
+// are put together. The arenas have room for arena_height lines of arena_width
+// cells, which only grows, so that the screen can shrink and grow back without
+// reallocating.
+struct terminal {
+	long		  mode;
+	struct cursor	  cursor, saved_cursor;
+	bool		 *tabstops;
+	struct line	**lines, **view;
+	short		  width, height, scroll_top, scroll_bottom;
+	short		  shift_top, shift_bottom, shift;
+	long		  scrollback;
+	struct color	  palette[256];
+	struct parser	  parser;
+	struct style	 *styles;
+	uint16_t	 *style_hash, *free_styles;
+	uint32_t	  style_count, free_style, changed_first, changed_last;
+	char		 *arena, *view_arena;
+	struct line	**ring, **spare;
+	int		  head, arena_width, arena_height;
+};
 
+// A snapshot is the renderer's own copy of the screen, so that it can draw one
+// frame while the next batch of output is parsed. Each one only copies the
+// lines damaged since the last, carrying their damage over, and moves the rest
+// the way the screen shifted them. Every line is followed by whether each of
+// its cells is a search match. The window size and the clock are filled in by
+// gldraw().
+struct snapshot {
+	struct line	**lines;
+	struct style	 *styles;
+	struct color	  palette[256];
+	long		  mode;
+	short		  width, height, cursor_x, cursor_y;
+	short		  shift_top, shift_bottom, shift;
+	bool		  scrolled_back;
+	int		  window_width, window_height, timer_count;
+	uint64_t	  time;
+};
+
+extern struct terminal *term;
+
+void init_screen(void);
+void damage(int, int, int);
+void damage_screen(void);
+uint16_t cursor_style(void);
+uint16_t intern_style(const struct style *);
 void deinit_screen(void);
 void resize(int, int);
 void reset(void);
@@ -198,30 +612,74 @@ void nextline(void);
 void linefeed(void);
 void carriagereturn(void);
 void print(long);
+void print_ascii(const unsigned char *, size_t);
+void scroll_view(long);
+void take_snapshot(struct snapshot *);
+void deinit_snapshot(struct snapshot *);
+
+// Returns how many columns a cell's glyph covers.
+static inline int
+cell_columns(const struct cell *cell)
+{
+	return cell->wide ? 2 : 1;
+}
+
+static inline bool *
+snapshot_highlights(const struct snapshot *snapshot, int y)
+{
+	return (bool *)&snapshot->lines[y]->cells[snapshot->width];
+}
+
+// Marks cells [start, end) of a line of width cells as needing to be redrawn.
+// The cell after the range is included too, since a double-width glyph at the
+// end of the range could have been hiding it.
+static inline void
+damage_line(struct line *line, int width, int start, int end)
+{
+	if (++end > width)
+		end = width;
+
+	if (line->damage_start >= line->damage_end) {
+		line->damage_start = start;
+		line->damage_end = end;
+	} else {
+		if (start < line->damage_start) line->damage_start = start;
+		if (end > line->damage_end) line->damage_end = end;
+	}
+}
+
+// Returns the line shown on row y, which is a copy in view while the user is
+// looking back through the history.
+static inline struct line *
+visible_line(int y)
+{
+	return term->scrollback ? term->view[y] : term->lines[y];
+}
 
 static inline bool
 getmode(long flag)
 {
-	return mode & flag;
+	return term->mode & flag;
 }
 
 static inline bool
 setmode(long flag, bool value)
 {
-	value ? (mode |= flag) : (mode &= ~flag);
+	value ? (term->mode |= flag) : (term->mode &= ~flag);
 	return value;
 }
 
 static inline void
 setlinea(int dimensions)
 {
-	lines[cursor.y]->dimensions = dimensions;
+	term->lines[term->cursor.y]->dimensions = dimensions;
+	damage(term->cursor.y, 0, term->width);
 }
 
 static inline void
 setcharset(int logical_charset, const uint32_t *physical_charset)
 {
-	cursor.logical_charsets[logical_charset] = physical_charset;
+	term->cursor.logical_charsets[logical_charset] = physical_charset;
 }
 
 static inline void
@@ -233,25 +691,121 @@ singleshift(int logical_charset __attribute__((unused)))
 static inline void
 lockingshift(int active_charset, int logical_charset)
 {
-	cursor.active_charsets[active_charset] = logical_charset;
+	term->cursor.active_charsets[active_charset] = logical_charset;
 }
 
 static inline void
 save_cursor()
 {
-	saved_cursor = cursor;
+	term->saved_cursor = term->cursor;
 }
 
 static inline void
 restore_cursor()
 {
-	cursor = saved_cursor;
+	term->cursor = term->saved_cursor;
 }
 
 static inline void
 settab()
 {
-	tabstops[cursor.x] = true;
+	term->tabstops[term->cursor.x] = true;
+}
+
+// --- packing --- //
+
+// The history and recordings write numbers seven bits at a time, least
+// significant first, with the high bit set on every byte but the last.
+// put_number() returns where the next byte goes, and get_number() moves p past
+// the number it reads; at most MAX_NUMBER_SIZE bytes are ever written.
+#define MAX_NUMBER_SIZE 10
+
+static inline unsigned char *
+put_number(unsigned char *p, uint64_t number)
+{
+	for (; number >= 0x80; number >>= 7)
+		*p++ = number | 0x80;
+
+	*p++ = number;
+	return p;
+}
+
+static inline uint64_t
+get_number(const unsigned char **p)
+{
+	uint64_t number;
+	int bits;
+
+	for (number = 0, bits = 0; **p & 0x80; bits += 7)
+		number |= (uint64_t)(*(*p)++ & 0x7F) << bits;
+
+	return number | (uint64_t)*(*p)++ << bits;
+}
+
+// Numbers the styles of the terminal that something being packed uses in the
+// order it first uses them, with a copy of each in styles, so that what is
+// packed does not hold on to entries of the style table. number_style() gives
+// the number of a style, and the style index was last numbered in the current
+// packing if stamps[index] is stamp.
+struct style_numbering {
+	struct style	styles[MAX_STYLES];
+	uint16_t	numbers[MAX_STYLES];
+	uint32_t	stamps[MAX_STYLES], stamp;
+	int		count;
+};
+
+// Forgets the styles numbered so far, for packing something new.
+static inline void
+start_numbering(struct style_numbering *n)
+{
+	if (!++n->stamp) {
+		memset(n->stamps, 0, sizeof(n->stamps));
+		n->stamp = 1;
+	}
+
+	n->count = 0;
 }
 
+static inline uint16_t
+number_style(struct style_numbering *n, uint16_t style)
+{
+	if (n->stamps[style] != n->stamp) {
+		n->stamps[style] = n->stamp;
+		n->numbers[style] = n->count;
+		n->styles[n->count++] = term->styles[style];
+	}
+
+	return n->numbers[style];
+}
+
+// --- scrollback history --- //
+
+extern struct history *history;
+
+void init_history(void);
+void deinit_history(void);
+void push_history(const struct line *);
+long history_end(void);
+long history_size(void);
+void history_line(long, struct line *);
+long search_recent(void (*)(long, const uint32_t *, int));
+long search_history(struct history *, const uint32_t *, int, long,
+	void (*)(long, const uint32_t *, int));
+void mark_history_styles(bool *);
+
+// --- search --- //
+
+extern struct search *search;
+
+void init_search(void);
+void deinit_search(void);
+void start_search(void);
+void stop_search(void);
+void search_input(const char *, int);
+void search_erase(void);
+void search_next(int);
+void search_prepare(struct pollfd *);
+void search_poll(void);
+bool highlighted(int, int);
+
 #endif // !TERMINIX_H
\ No newline at end of file
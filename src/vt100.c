@@ -18,38 +18,13 @@
 #include <string.h>
 #include "terminix.h"
 
-#define MAX_PARAMETERS 16
 #define PARAMETER_MAX 16383
 
-enum state {
-	STATE_GROUND,
-	STATE_ESCAPE,
-	STATE_ESCAPE_INTERMEDIATE,
-	STATE_CSI_ENTRY,
-	STATE_CSI_PARAM,
-	STATE_CSI_INTERMEDIATE,
-	STATE_CSI_IGNORE,
-	STATE_DCS_ENTRY,
-	STATE_DCS_PARAM,
-	STATE_DCS_INTERMEDIATE,
-	STATE_DCS_PASSTHROUGH,
-	STATE_DCS_IGNORE,
-	STATE_OSC_STRING,
-	STATE_SOS_STRING,
-	STATE_PM_STRING,
-	STATE_APC_STRING
-};
-
-static enum state state;
-static unsigned char intermediates[2];
-static unsigned short parameters[MAX_PARAMETERS];
-static unsigned char parameter_index;
-static char osc[512];
-static size_t osc_size, osc_data_offset;
-
 // VT100 with Processor Option, Advanced Video Option, and Graphics Option
 static const char DEVICE_ATTRS[] = "\x1B\x5B\x3F\x31\x3B\x37\x63";
 
+static void enter(int);
+static void execute_c1(unsigned char);
 static void collect(unsigned char);
 static void param(unsigned char);
 static void esc_dispatch(unsigned char);
@@ -68,119 +43,103 @@ static void osc_end(void);
 static void change_colors(const char *);
 static void change_color(int, const char *);
 
-#define COND(condition, action) \
-	do { if (condition) { action; return; } } while(0)
-
-#define NEXT(target) (state = STATE_##target)
+#define NEXT(target) (term->parser.state = VT100_##target)
 
 void
 vt100(long byte)
 {
+	unsigned short transition;
+
 	// TODO : cleanup to the way OSC strings are handled to be more
 	// compliant with the behavior of DEC terminals
 
-	switch (byte) {
-	/*CAN  */ case 0x18: NEXT(GROUND); return;
-	/*SUB  */ case 0x1A: print(0xFFFD); NEXT(GROUND); return;
-	/*ESC  */ case 0x1B:
-		if (state == STATE_OSC_STRING) osc_end();
-		NEXT(ESCAPE);
-		return;
-	/*IND  */ case 0x84: newline(); return;
-	/*NEL  */ case 0x85: nextline(); return;
-	/*HTS  */ case 0x88: settab(); return;
-	/*RI   */ case 0x8D: revline(); return;
-	/*SS2  */ case 0x8E: singleshift(G2); return;
-	/*SS3  */ case 0x8F: singleshift(G3); return;
-	/*DCS  */ case 0x90: NEXT(DCS_ENTRY); return;
-	/*SOS  */ case 0x98: NEXT(SOS_STRING); return;
-	/*DECID*/ case 0x9A: ptwrite("%s", DEVICE_ATTRS); return;
-	/*CSI  */ case 0x9B: NEXT(CSI_ENTRY); return;
-	/*ST   */ case 0x9C: osc_end(); NEXT(GROUND); return;
-	/*OSC  */ case 0x9D: osc_start(); NEXT(OSC_STRING); return;
-	/*PM   */ case 0x9E: NEXT(PM_STRING); return;
-	/*APC  */ case 0x9F: NEXT(APC_STRING); return;
-	}
+	transition = vt100_transitions[term->parser.state][
+		byte < VT100_INPUTS - 1 ? byte : VT100_INPUTS - 1];
 
-	switch (state) {
-	case STATE_GROUND:
-		COND(byte <= 0x1F, execute(byte));
-		print(byte);
-		break;
-	case STATE_ESCAPE:
-		memset(intermediates, 0, sizeof(intermediates));
-		parameter_index = 0;
-		memset(parameters, 0, sizeof(parameters));
-
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte <= 0x2F, collect(byte); NEXT(ESCAPE_INTERMEDIATE));
-		COND(byte == 0x50, NEXT(DCS_ENTRY));
-		COND(byte == 0x58, NEXT(SOS_STRING));
-		COND(byte == 0x5B, NEXT(CSI_ENTRY));
-		COND(byte == 0x5D, osc_start(); NEXT(OSC_STRING));
-		COND(byte == 0x5E, NEXT(PM_STRING));
- 		COND(byte == 0x5F, NEXT(APC_STRING));
-		COND(byte <= 0x7E, esc_dispatch(byte));
-		break;
-	case STATE_ESCAPE_INTERMEDIATE:
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte <= 0x2F, collect(byte));
-		COND(byte <= 0x7E, esc_dispatch(byte));
-		break;
-	case STATE_CSI_ENTRY:
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte <= 0x2F, collect(byte); NEXT(CSI_INTERMEDIATE));
-		COND(byte == 0x3A, NEXT(CSI_IGNORE));
-		COND(byte <= 0x3B, param(byte); NEXT(CSI_PARAM));
-		COND(byte <= 0x3F, collect(byte); NEXT(CSI_PARAM));
-		COND(byte <= 0x7E, csi_dispatch(byte));
-		break;
-	case STATE_CSI_PARAM:
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte <= 0x2F, collect(byte); NEXT(CSI_INTERMEDIATE));
-		COND(byte == 0x3A, NEXT(CSI_IGNORE));
-		COND(byte <= 0x3B, param(byte));
-		COND(byte <= 0x3F, NEXT(CSI_IGNORE));
-		COND(byte <= 0x7E, csi_dispatch(byte));
-		break;
-	case STATE_CSI_INTERMEDIATE:
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte <= 0x2F, collect(byte));
-		COND(byte <= 0x3F, NEXT(CSI_IGNORE));
-		COND(byte <= 0x7E, csi_dispatch(byte));
+	switch (transition & 0xFF) {
+	case VT100_DO_EXECUTE:
+		if (byte < 0x80)
+			execute(byte);
+		else
+			execute_c1(byte);
 		break;
-	case STATE_CSI_IGNORE:
-		COND(byte <= 0x1F, execute(byte));
-		COND(byte >= 0x40 && byte <= 0x7E, NEXT(GROUND));
+	case VT100_DO_PRINT: print(byte); break;
+	case VT100_DO_SUBSTITUTE: print(0xFFFD); break;
+	case VT100_DO_COLLECT: collect(byte); break;
+	case VT100_DO_PARAM: param(byte); break;
+	case VT100_DO_ESC_DISPATCH: esc_dispatch(byte); break;
+	case VT100_DO_CSI_DISPATCH: csi_dispatch(byte); break;
+	case VT100_DO_OSC_PUT: osc_put(byte); break;
+	case VT100_DO_OSC_END: osc_end(); break;
+	}
+
+	if (transition >> 8)
+		enter((transition >> 8) - 1);
+}
+
+static void
+enter(int target)
+{
+	term->parser.state = target;
+
+	switch (target) {
+	case VT100_ESCAPE:
+	case VT100_CSI_ENTRY:
+	case VT100_DCS_ENTRY:
+		memset(term->parser.intermediates, 0,
+			sizeof(term->parser.intermediates));
+		term->parser.parameter_index = 0;
+		memset(term->parser.parameters, 0,
+			sizeof(term->parser.parameters));
 		break;
-	case STATE_DCS_ENTRY:
-	case STATE_DCS_PARAM:
-	case STATE_DCS_INTERMEDIATE:
-	case STATE_DCS_PASSTHROUGH:
-	case STATE_DCS_IGNORE:
+	case VT100_DCS_PASSTHROUGH:
 		warnx("TODO : Device Control Strings");
 		break;
-	case STATE_OSC_STRING:
-		COND(byte == 0x07, osc_end(); NEXT(GROUND));
-		COND(byte >= 0x20, osc_put(byte));
-		break;
-	case STATE_SOS_STRING:
-	case STATE_PM_STRING:
-	case STATE_APC_STRING:
-		// ignore everything
+	case VT100_OSC_STRING:
+		osc_start();
 		break;
 	}
 }
 
+static void
+execute_c1(unsigned char byte)
+{
+	switch (byte) {
+	/*IND  */ case 0x84: newline(); break;
+	/*NEL  */ case 0x85: nextline(); break;
+	/*HTS  */ case 0x88: settab(); break;
+	/*RI   */ case 0x8D: revline(); break;
+	/*SS2  */ case 0x8E: singleshift(G2); break;
+	/*SS3  */ case 0x8F: singleshift(G3); break;
+	/*DECID*/ case 0x9A: ptputs(DEVICE_ATTRS); break;
+	}
+}
+
+// Prints the printable ASCII at the start of buffer if nothing is being
+// parsed, and returns how many bytes were printed.
+size_t
+vt100_text(const unsigned char *buffer, size_t size)
+{
+	size_t n;
+
+	if (term->parser.state != VT100_GROUND)
+		return 0;
+
+	if ((n = printable_run(buffer, size)))
+		print_ascii(buffer, n);
+
+	return n;
+}
+
 static void
 collect(unsigned char byte)
 {
-	if (!intermediates[0])
-		intermediates[0] = byte;
-	else if (!intermediates[1])
-		intermediates[1] = byte;
+	if (!term->parser.intermediates[0])
+		term->parser.intermediates[0] = byte;
+	else if (!term->parser.intermediates[1])
+		term->parser.intermediates[1] = byte;
 	else
-		intermediates[0] = 255;
+		term->parser.intermediates[0] = 255;
 }
 
 static void
@@ -188,18 +147,18 @@ param(unsigned char byte)
 {
 	unsigned long param;
 
-	if (parameter_index == MAX_PARAMETERS)
+	if (term->parser.parameter_index == MAX_PARAMETERS)
 		return;
 
 	if (byte == ';') {
-		parameter_index++;
+		term->parser.parameter_index++;
 		return;
 	}
 
-	param = parameters[parameter_index];
+	param = term->parser.parameters[term->parser.parameter_index];
 	param = param * 10 + (byte - 0x30);
 	if (param > PARAMETER_MAX) param = PARAMETER_MAX;
-	parameters[parameter_index] = param;
+	term->parser.parameters[term->parser.parameter_index] = param;
 }
 
 // [1] XTerm*hpLowerleftBugCompat
@@ -209,9 +168,9 @@ esc_dispatch(unsigned char byte)
 {
 	NEXT(GROUND);
 
-	switch (intermediates[0]) {
+	switch (term->parser.intermediates[0]) {
 	case 0:
-		if (intermediates[1]) break;
+		if (term->parser.intermediates[1]) break;
 		switch (byte) {
 		/*DECBI  */ case '6': warnx("TODO : Back Index"); return;
 		/*DECSC  */ case '7': save_cursor(); return;
@@ -222,14 +181,14 @@ esc_dispatch(unsigned char byte)
 		/*DECKPNM*/ case '>': setmode(DECKPAM, false); return;
 		/*IND    */ case 'D': newline(); return;
 		/*NEL    */ case 'E': nextline(); return;
-		/*[1]    */ case 'F': warpto(0, scroll_bottom); return;
+		/*[1]    */ case 'F': warpto(0, term->scroll_bottom); return;
 		/*HTS    */ case 'H': settab(); return;
 		/*SCS    */ case 'I': warnx("TODO : Designate Character Set"); return;
 		/*RI     */ case 'M': revline(); return;
 		/*SS2    */ case 'N': singleshift(G2); return;
 		/*SS3    */ case 'O': singleshift(G3); return;
 		/*SCODFK */ case 'Q': warnx("TODO : SCO Define Function Key"); return;
-		/*DECID  */ case 'Z': ptwrite("%s", DEVICE_ATTRS); return;
+		/*DECID  */ case 'Z': ptputs(DEVICE_ATTRS); return;
 		/*ST     */ case'\\': /* nothing to do */ return;
 		/*RIS    */ case 'c': reset(); return;
 		/*LS2    */ case 'n': lockingshift(GL, G2); return;
@@ -242,14 +201,14 @@ esc_dispatch(unsigned char byte)
 		}
 		break;
 	case ' ':
-		if (intermediates[1]) break;
+		if (term->parser.intermediates[1]) break;
 		switch (byte) {
 		/*S7C1T*/ case 'F': setmode(S8C1T, false); return;
 		/*S8C1T*/ case 'G': setmode(S8C1T, true); return;
 		}
 		break;
 	case '#':
-		if (intermediates[1]) break;
+		if (term->parser.intermediates[1]) break;
 		switch (byte) {
 		/*DECDHL*/ case '3': setlinea(DOUBLE_HEIGHT_TOP); return;
 		/*DECDHL*/ case '4': setlinea(DOUBLE_HEIGHT_BOTTOM); return;
@@ -259,7 +218,7 @@ esc_dispatch(unsigned char byte)
 		}
 		break;
 	case '%':
-		switch (intermediates[1]) {
+		switch (term->parser.intermediates[1]) {
 		case 0:
 			switch (byte) {
 			case '@': setmode(UTF8, false); return;
@@ -276,16 +235,20 @@ esc_dispatch(unsigned char byte)
 		}
 		break;
 	case '(':
-		setcharset(G0, get_charset_94(intermediates[1], byte));
+		setcharset(G0, get_charset_94(term->parser.intermediates[1],
+			byte));
 		return;
 	case ')':
-		setcharset(G1, get_charset_94(intermediates[1], byte));
+		setcharset(G1, get_charset_94(term->parser.intermediates[1],
+			byte));
 		return;
 	case '*':
-		setcharset(G2, get_charset_94(intermediates[1], byte));
+		setcharset(G2, get_charset_94(term->parser.intermediates[1],
+			byte));
 		return;
 	case '+':
-		setcharset(G3, get_charset_94(intermediates[1], byte));
+		setcharset(G3, get_charset_94(term->parser.intermediates[1],
+			byte));
 		return;
 	case '-':
 		setcharset(G1, get_charset_96(byte));
@@ -301,7 +264,8 @@ esc_dispatch(unsigned char byte)
 		return;
 	}
 
-	unrecognized_escape(intermediates[0], intermediates[1], byte);
+	unrecognized_escape(term->parser.intermediates[0],
+		term->parser.intermediates[1], byte);
 }
 
 static const uint32_t *
@@ -379,27 +343,29 @@ get_charset_96(unsigned char c)
 	return NULL; // TODO : should we do a no-op instead?
 }
 
-#define DEFAULT(i, default) (parameters[(i)] ? parameters[(i)] : (default))
+#define DEFAULT(i, default) (term->parser.parameters[(i)] ? \
+	term->parser.parameters[(i)] : (default))
 static void
 csi_dispatch(unsigned char byte)
 {
 	NEXT(GROUND);
 
-	if (intermediates[0] == 255 || intermediates[1]) {
+	if (term->parser.intermediates[0] == 255 ||
+		term->parser.intermediates[1]) {
 		warnx("too many intermediates in CSI sequence");
 		return;
 	}
 
-	if (intermediates[0] == 0x3F) {
+	if (term->parser.intermediates[0] == 0x3F) {
 		csi_dispatch_private(byte);
 		return;
 	}
 
-	if (intermediates[0])
+	if (term->parser.intermediates[0])
 		return;
 
-	if (parameter_index == MAX_PARAMETERS)
-		parameter_index = MAX_PARAMETERS - 1;
+	if (term->parser.parameter_index == MAX_PARAMETERS)
+		term->parser.parameter_index = MAX_PARAMETERS - 1;
 
 	switch (byte) {
 	/*ICH    */ case '@': insert_characters(DEFAULT(0, 1)); break;
@@ -409,21 +375,21 @@ csi_dispatch(unsigned char byte)
 	/*CUB    */ case 'D': move_cursor(byte, DEFAULT(0, 1)); break;
 	/*CUP    */ case 'H':
 	/*HVP    */ case 'f':
-		warpto(parameters[1] - 1, parameters[0] - 1 + (getmode(DECOM) ? scroll_top : 0));
+		warpto(term->parser.parameters[1] - 1, term->parser.parameters[0] - 1 + (getmode(DECOM) ? term->scroll_top : 0));
 		break;
-	/*ED     */ case 'J': erase_display(parameters[0]); break;
-	/*EL     */ case 'K': erase_line(parameters[0]); break;
+	/*ED     */ case 'J': erase_display(term->parser.parameters[0]); break;
+	/*EL     */ case 'K': erase_line(term->parser.parameters[0]); break;
 	/*DCH    */ case 'P': delete_characters(DEFAULT(0, 1)); break;
 	/*ECH    */ case 'X': erase_characters(DEFAULT(0, 1)); break;
 	/*DA     */ case 'c':
-		if (parameters[0] == 0)
-			ptwrite("%s", DEVICE_ATTRS);
+		if (term->parser.parameters[0] == 0)
+			ptputs(DEVICE_ATTRS);
 		break;
 	/*TBC    */ case 'g':
-		if (!parameters[0])
-			tabstops[cursor.x] = false;
-		else if (parameters[0] == 3)
-			memset(tabstops, 0, screen_width * sizeof(bool));
+		if (!term->parser.parameters[0])
+			term->tabstops[term->cursor.x] = false;
+		else if (term->parser.parameters[0] == 3)
+			memset(term->tabstops, 0, term->width * sizeof(bool));
 		break;
 	/*SM     */ case 'h': set_ansi_mode(true); break;
 	/*RM     */ case 'l': set_ansi_mode(false); break;
@@ -431,14 +397,15 @@ csi_dispatch(unsigned char byte)
 	/*DSR    */ case 'n': device_status_report(); break;
 	/*DECLL  */ case 'q': configure_leds(); break;
 	/*DECSTBM*/ case 'r':
-		if (!parameters[0]) parameters[0] = 1;
-		if (!parameters[1] || parameters[1] > screen_height)
-			parameters[1] = screen_height;
-
-		if (parameters[0] < parameters[1]) {
-			scroll_top = parameters[0] - 1;
-			scroll_bottom = parameters[1] - 1;
-			warpto(0, getmode(DECOM) ? scroll_top : 0);
+		if (!term->parser.parameters[0]) term->parser.parameters[0] = 1;
+		if (!term->parser.parameters[1] ||
+			term->parser.parameters[1] > term->height)
+			term->parser.parameters[1] = term->height;
+
+		if (term->parser.parameters[0] < term->parser.parameters[1]) {
+			term->scroll_top = term->parser.parameters[0] - 1;
+			term->scroll_bottom = term->parser.parameters[1] - 1;
+			warpto(0, getmode(DECOM) ? term->scroll_top : 0);
 		}
 		break;
 	default:
@@ -461,11 +428,12 @@ set_ansi_mode(bool value)
 {
 	int i;
 
-	for (i = 0; i <= parameter_index; i++)
-		if (parameters[i] == 20)
+	for (i = 0; i <= term->parser.parameter_index; i++)
+		if (term->parser.parameters[i] == 20)
 			setmode(LNM, value);
 		else
-			warnx("set mode %i=%i", parameters[i], value);
+			warnx("set mode %i=%i", term->parser.parameters[i],
+				value);
 }
 
 static void
@@ -473,22 +441,35 @@ set_dec_mode(bool value)
 {
 	int i;
 
-	for (i = 0; i <= parameter_index; i++)
-		switch (parameters[i]) {
+	for (i = 0; i <= term->parser.parameter_index; i++)
+		switch (term->parser.parameters[i]) {
 		case 1: setmode(DECCKM, value); break;
 		case 2: setmode(DECANM, value); break;
-		case 3: resize(value ? 132 : 80, screen_height); break;
+		case 3:
+			// Changing the number of columns also clears the
+			// screen and homes the cursor.
+			resize(value ? 132 : 80, term->height);
+			erase_display(2);
+			term->cursor.x = term->cursor.y = 0;
+			term->cursor.last_column = false;
+			break;
 		case 4: setmode(DECSCLM, value); break;
-		case 5: setmode(DECSCNM, value); break;
+		case 5:
+			if (getmode(DECSCNM) != value)
+				damage_screen();
+			setmode(DECSCNM, value);
+			break;
 		case 6:
-			warpto(0, setmode(DECOM, value) ? scroll_top : 0);
+			warpto(0, setmode(DECOM, value) ? term->scroll_top : 0);
 			break;
 		case 7: setmode(DECAWM, value); break;
 		case 8: setmode(DECARM, value); break;
 		case 9: setmode(DECINLM, value); break;
 		case 25: setmode(DECTCEM, value); break;
+		case 2026: setmode(SYNC, value); break;
 		default:
-			warnx("set mode ?%i=%i", parameters[i], value);
+			warnx("set mode ?%i=%i", term->parser.parameters[i],
+				value);
 			break;
 		}
 }
@@ -496,12 +477,14 @@ set_dec_mode(bool value)
 static void
 select_graphic_rendition()
 {
-	struct cell attrs;
+	const unsigned short *parameters;
+	struct style attrs;
 	int i, parameter;
 
-	attrs = cursor.attrs;
+	parameters = term->parser.parameters;
+	attrs = term->cursor.attrs;
 
-	for (i = 0; i <= parameter_index; i++) {
+	for (i = 0; i <= term->parser.parameter_index; i++) {
 		parameter = parameters[i];
 
 		if (parameter >= 10 && parameter <= 19) {
@@ -522,7 +505,7 @@ select_graphic_rendition()
 			switch (parameter) {
 			case 0:
 				attrs = default_attrs;
-				cursor.conceal = false;
+				term->cursor.conceal = false;
 				break;
 			case 1: attrs.intensity = INTENSITY_BOLD; break;
 			case 2: attrs.intensity = INTENSITY_FAINT; break;
@@ -531,7 +514,7 @@ select_graphic_rendition()
 			case 5: attrs.blink = BLINK_SLOW; break;
 			case 6: attrs.blink = BLINK_FAST; break;
 			case 7: attrs.negative = true; break;
-			case 8: cursor.conceal = true; break;
+			case 8: term->cursor.conceal = true; break;
 			case 9: attrs.crossed_out = true; break;
 			case 20: attrs.fraktur = true; break;
 			case 21: attrs.underline = UNDERLINE_DOUBLE; break;
@@ -543,10 +526,10 @@ select_graphic_rendition()
 			case 24: attrs.underline = UNDERLINE_NONE; break;
 			case 25: attrs.blink = BLINK_NONE; break;
 			case 27: attrs.negative = false; break;
-			case 28: cursor.conceal = false; break;
+			case 28: term->cursor.conceal = false; break;
 			case 29: attrs.crossed_out = false; break;
 			case 38: case 48:
-				if (i++ == parameter_index) return;
+				if (i++ == term->parser.parameter_index) return;
 
 				switch (parameters[i++]) {
 				case 2:
@@ -592,20 +575,24 @@ select_graphic_rendition()
 		}
 	}
 
-	cursor.attrs = attrs;
+	term->cursor.attrs = attrs;
 }
 
 static void
 device_status_report()
 {
-	if (parameters[0] == 5)
+	if (term->parser.parameters[0] == 5)
 		// VT100 Ready, No malfunctions detected
-		ptwrite("\x1B\x5B\x30\x6E");
-	else if (parameters[0] == 6)
+		ptputs("\x1B\x5B\x30\x6E");
+	else if (term->parser.parameters[0] == 6) {
 		// Cursor Position Report
-		ptwrite("\x1B\x5B%d\x3B%d\x52",
-			(getmode(DECOM) ? cursor.y - scroll_top : cursor.y) + 1,
-			cursor.x + 1);
+		ptputs("\x1B\x5B");
+		ptputn((getmode(DECOM) ? term->cursor.y - term->scroll_top :
+			term->cursor.y) + 1);
+		ptputs("\x3B");
+		ptputn(term->cursor.x + 1);
+		ptputs("\x52");
+	}
 }
 
 static void
@@ -613,8 +600,8 @@ configure_leds()
 {
 	int i;
 
-	for (i = 0; i <= parameter_index; i++)
-		switch (parameters[i]) {
+	for (i = 0; i <= term->parser.parameter_index; i++)
+		switch (term->parser.parameters[i]) {
 		case 0: warnx("TODO : Clear LEDs"); break;
 		case 1: warnx("TODO : LED 1 On"); break;
 		case 2: warnx("TODO : LED 2 On"); break;
@@ -623,24 +610,25 @@ configure_leds()
 		}
 }
 
-#define OSC_IS(prefix) (!strncmp(prefix ";", osc, sizeof(prefix)))
+#define OSC_IS(prefix) \
+	(!strncmp(prefix ";", term->parser.osc, sizeof(prefix)))
 
 static void
 osc_start()
 {
-	memset(osc, 0, sizeof(osc));
-	osc_size = 0;
-	osc_data_offset = 0;
+	memset(term->parser.osc, 0, sizeof(term->parser.osc));
+	term->parser.osc_size = 0;
+	term->parser.osc_data_offset = 0;
 }
 
 static void
 osc_put(unsigned char byte)
 {
-	if (osc_size < sizeof(osc) - 2) {
-		osc[osc_size++] = byte;
+	if (term->parser.osc_size < sizeof(term->parser.osc) - 2) {
+		term->parser.osc[term->parser.osc_size++] = byte;
 
-		if (!osc_data_offset && byte == ';')
-			osc_data_offset = osc_size;
+		if (!term->parser.osc_data_offset && byte == ';')
+			term->parser.osc_data_offset = term->parser.osc_size;
 	}
 }
 
@@ -649,7 +637,7 @@ osc_end()
 {
 	const char *data;
 
-	data = &osc[osc_data_offset];
+	data = &term->parser.osc[term->parser.osc_data_offset];
 
 	if (OSC_IS("0")) {
 		wmname(data);
@@ -686,5 +674,6 @@ change_color(int index, const char *name)
 		return;
 	}
 
-	wmparsecolor(&palette[index], name);
+	wmparsecolor(&term->palette[index], name);
+	damage_screen();
 }
\ No newline at end of file
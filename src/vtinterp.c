@@ -15,12 +15,24 @@
 
 #include <ctype.h>
 #include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "terminix.h"
 
-static char sequence_size, sequence_index;
-static long code_point;
+static size_t (*scan_printable)(const unsigned char *, size_t);
 
 static void describe_byte(char *, size_t, unsigned char);
+static bool start_sequence(unsigned char);
+static size_t scan_printable_scalar(const unsigned char *, size_t);
+#if defined(__x86_64__) || defined(__i386__)
+static size_t scan_printable_sse2(const unsigned char *, size_t);
+static size_t scan_printable_avx2(const unsigned char *, size_t);
+#elif defined(__ARM_NEON)
+static size_t scan_printable_neon(const unsigned char *, size_t);
+#endif
 static void interp(long);
 
 void
@@ -51,7 +63,7 @@ void
 execute(unsigned char byte)
 {
 	switch (byte) {
-	/*ENQ*/ case 0x05: ptwrite("%s", answerback); break;
+	/*ENQ*/ case 0x05: ptputs(answerback); break;
 	/*BEL*/ case 0x07: wmbell(); break;
 	/*BS */ case 0x08: move_cursor(0x44, 1); break;
 	/*HT */ case 0x09: tab(); break;
@@ -61,8 +73,8 @@ execute(unsigned char byte)
 	/*CR */ case 0x0D: carriagereturn(); break;
 	/*SO */ case 0x0E: lockingshift(GL, G1); break;
 	/*SI */ case 0x0F: lockingshift(GL, G0); break;
-	/*DC1*/ case 0x11: setmode(XOFF, false); break;
-	/*DC3*/ case 0x13: setmode(XOFF, true); break;
+	/*DC1*/ case 0x11: pthold(false); break;
+	/*DC3*/ case 0x13: pthold(true); break;
 	}
 }
 
@@ -70,57 +82,181 @@ void
 vtinterp(unsigned char byte)
 {
 	if (!getmode(UTF8)) {
+		term->parser.sequence_size = 0;
 		interp(byte);
 		return;
 	}
 
-	switch (sequence_size) {
-	case 0:
-		sequence_index = 0;
-		code_point = 0;
-
-		if (!(byte & 0x80)) {
-			interp(byte);
-		} else if ((byte & 0xE0) == 0xC0) {
-			sequence_size = 2;
-			code_point = (byte & ~0xE0) << 6;
-		} else if ((byte & 0xF0) == 0xE0) {
-			sequence_size = 3;
-			code_point = (byte & ~0xF0) << 12;
-		} else if ((byte & 0xF8) == 0xF0) {
-			sequence_size = 4;
-			code_point = (byte & ~0xF8) << 18;
-		} else {
-			sequence_size = 0;
-			interp(0xFFFD);
+	if (term->parser.sequence_size) {
+		if (byte >= term->parser.sequence_lower &&
+			byte <= term->parser.sequence_upper) {
+			term->parser.code_point =
+				term->parser.code_point << 6 | (byte & 0x3F);
+			term->parser.sequence_lower = 0x80;
+			term->parser.sequence_upper = 0xBF;
+
+			if (!--term->parser.sequence_size)
+				interp(term->parser.code_point);
+
+			return;
 		}
 
-		break;
-	case 2:
-		interp(code_point | (byte & ~0xC0));
-		sequence_size = 0;
-		break;
-	case 3:
-		switch (sequence_index++) {
-		case 0: code_point |= (byte & ~0xC0) << 6; break;
-		default:
-			interp(code_point | (byte & ~0xC0));
-			sequence_size = 0;
-			break;
+		// The sequence was cut short; replace the part we got and
+		// start over with this byte.
+		term->parser.sequence_size = 0;
+		interp(0xFFFD);
+	}
+
+	if (byte < 0x80)
+		interp(byte);
+	else if (!start_sequence(byte))
+		interp(0xFFFD);
+}
+
+// Sets up decoding of the sequence that byte leads, limiting the first
+// continuation byte so that overlong forms, surrogates and code points past
+// U+10FFFF are rejected. Returns false if byte cannot start a sequence.
+static bool
+start_sequence(unsigned char byte)
+{
+	term->parser.sequence_lower = 0x80;
+	term->parser.sequence_upper = 0xBF;
+
+	if (byte >= 0xC2 && byte <= 0xDF) {
+		term->parser.sequence_size = 1;
+		term->parser.code_point = byte & 0x1F;
+	} else if (byte >= 0xE0 && byte <= 0xEF) {
+		term->parser.sequence_size = 2;
+		term->parser.code_point = byte & 0x0F;
+
+		if (byte == 0xE0) term->parser.sequence_lower = 0xA0;
+		if (byte == 0xED) term->parser.sequence_upper = 0x9F;
+	} else if (byte >= 0xF0 && byte <= 0xF4) {
+		term->parser.sequence_size = 3;
+		term->parser.code_point = byte & 0x07;
+
+		if (byte == 0xF0) term->parser.sequence_lower = 0x90;
+		if (byte == 0xF4) term->parser.sequence_upper = 0x8F;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Interprets a whole buffer. Runs of printable ASCII outside of any escape or
+// UTF-8 sequence are handed to the ANSI parser in one piece.
+void
+vtinterp_buf(const unsigned char *buffer, size_t size)
+{
+	size_t i, n;
+
+	for (i = 0; i < size; i += n) {
+		n = 0;
+
+		if (!term->parser.sequence_size && getmode(DECANM))
+			n = vt100_text(&buffer[i], size - i);
+
+		if (!n) {
+			vtinterp(buffer[i]);
+			n = 1;
 		}
-		break;
-	case 4:
-		switch (sequence_index++) {
-		case 0: code_point |= (byte & ~0xC0) << 12; break;
-		case 1: code_point |= (byte & ~0xC0) << 6; break;
-		default:
-			interp(code_point | (byte & ~0xC0));
-			sequence_size = 0;
+	}
+}
+
+// Returns how many bytes at the start of buffer are printable ASCII, checking
+// a vector at a time with the widest instructions the processor has.
+size_t
+printable_run(const unsigned char *buffer, size_t size)
+{
+	if (!scan_printable) {
+		scan_printable = scan_printable_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2"))
+			scan_printable = scan_printable_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			scan_printable = scan_printable_sse2;
+#elif defined(__ARM_NEON)
+		scan_printable = scan_printable_neon;
+#endif
+	}
+
+	return scan_printable(buffer, size);
+}
+
+static size_t
+scan_printable_scalar(const unsigned char *buffer, size_t size)
+{
+	size_t n;
+
+	for (n = 0; n < size && buffer[n] >= 0x20 && buffer[n] <= 0x7E; n++)
+		;
+
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// As signed bytes, everything from 0x80 up is negative, so one comparison
+// finds the bytes from 0x20 to 0x7F and another takes out DEL.
+__attribute__((target("sse2"))) static size_t
+scan_printable_sse2(const unsigned char *buffer, size_t size)
+{
+	__m128i block;
+	unsigned mask;
+	size_t n;
+
+	for (n = 0; n + 16 <= size; n += 16) {
+		block = _mm_loadu_si128((const __m128i *)&buffer[n]);
+		mask = _mm_movemask_epi8(_mm_andnot_si128(
+			_mm_cmpeq_epi8(block, _mm_set1_epi8(0x7F)),
+			_mm_cmpgt_epi8(block, _mm_set1_epi8(0x1F))));
+
+		if (mask != 0xFFFF)
+			return n + __builtin_ctz(~mask);
+	}
+
+	return n + scan_printable_scalar(&buffer[n], size - n);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_printable_avx2(const unsigned char *buffer, size_t size)
+{
+	__m256i block;
+	unsigned mask;
+	size_t n;
+
+	for (n = 0; n + 32 <= size; n += 32) {
+		block = _mm256_loadu_si256((const __m256i *)&buffer[n]);
+		mask = _mm256_movemask_epi8(_mm256_andnot_si256(
+			_mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7F)),
+			_mm256_cmpgt_epi8(block, _mm256_set1_epi8(0x1F))));
+
+		if (mask != 0xFFFFFFFF)
+			return n + __builtin_ctz(~mask);
+	}
+
+	return n + scan_printable_sse2(&buffer[n], size - n);
+}
+#elif defined(__ARM_NEON)
+static size_t
+scan_printable_neon(const unsigned char *buffer, size_t size)
+{
+	uint8x16_t block;
+	size_t n;
+
+	for (n = 0; n + 16 <= size; n += 16) {
+		block = vld1q_u8(&buffer[n]);
+
+		if (vminvq_u8(vandq_u8(vcgeq_u8(block, vdupq_n_u8(0x20)),
+			vcleq_u8(block, vdupq_n_u8(0x7E)))) != 0xFF)
 			break;
-		}
-		break;
 	}
+
+	return n + scan_printable_scalar(&buffer[n], size - n);
 }
+#endif
 
 static void
 interp(long code_point)
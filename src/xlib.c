@@ -19,110 +19,270 @@
 #include <X11/XKBlib.h>
 #include "terminix.h"
 
-int window_width, window_height;
+// Each session's window has its own input context and keeps track of which
+// keys are held down in it. A ConfigureNotify is only taken note of in
+// configured, width and height, and acted on once the events that came with it
+// have all been handled.
+struct window {
+	Window	 window;
+	XIC	 xic;
+	bool	 keystate[256];
+	char	*title;
+	bool	 showing_status, configured;
+	int	 width, height;
+};
+
+struct window *win;
 
 static Display *display;
 static Atom utf8_string, wm_protocols, wm_delete_window, net_wm_name,
 	net_wm_icon_name;
 static Colormap colormap;
-static Window window;
+static XVisualInfo visual_info;
 static XIM xim;
-static XIC xic;
-static bool keystate[256];
+static bool started, new_window;
 
 static void init_x11(void);
 static void init_xkb(void);
 static void init_xim(void);
+static void create_window(void);
+static void create_ic(void);
+static bool find_window(Window);
+static void handle_configure(int, int);
 static void handle_key(XKeyEvent *);
+static void handle_search_key(XKeyEvent *, KeySym, const char *, int);
+static void set_name(const char *);
 static void kpam(char);
 
+// Without a window there is no X connection either, and everything below that
+// would use it does nothing instead. Sessions opened before this, so that their
+// shells could start while we connected, get their windows now.
 void
 wminit()
 {
-	init_x11();
-	init_xkb();
-	init_xim();
+	struct session *s, *current;
 
-	glinit(display, window);
+	if (headless) {
+		glinit(NULL);
+	} else {
+		init_x11();
+		init_xkb();
+		glinit(display);
+	}
+
+	started = true;
+	current = session;
+
+	for (s = sessions; s; s = s->next) {
+		switch_session(s);
+		wmopen();
+	}
+
+	switch_session(current);
 }
 
 void
 wmkill()
 {
-	if (xic) XDestroyIC(xic);
 	if (xim) XCloseIM(xim);
 	if (display) XCloseDisplay(display);
 }
 
+// Opens a window for the current session, the size of its screen.
+void
+wmopen()
+{
+	if (!started)
+		return;
+
+	if (!(win = session->win = calloc(1, sizeof(*win))))
+		pdie("failed to allocate window memory");
+
+	session->window_width = term->width * CHARWIDTH;
+	session->window_height = term->height * CHARHEIGHT;
+
+	if (!display) {
+		glopen(0);
+		return;
+	}
+
+	create_window();
+	glopen(win->window);
+}
+
+// Closes the current session's window, once the renderer is done with it.
+void
+wmclose()
+{
+	if (!win)
+		return;
+
+	glclose();
+
+	if (win->xic) XDestroyIC(win->xic);
+	if (win->window) XDestroyWindow(display, win->window);
+
+	free(win->title);
+	free(win);
+	win = session->win = NULL;
+}
+
+// Fills in pfd for the X connection and returns whether events are already
+// waiting in Xlib's queue, in which case the caller must not block on it.
+bool
+wmprepare(struct pollfd *pfd)
+{
+	if (!display) {
+		pfd->fd = -1;
+		return false;
+	}
+
+	pfd->fd = ConnectionNumber(display);
+	pfd->events = POLLIN;
+
+	return XPending(display);
+}
+
+// Handles every event waiting, each for the session whose window it is for,
+// which leaves some other session current.
 void
 wmpoll()
 {
+	struct session *s;
 	XEvent event;
 
-	while (XPending(display)) {
+	while (display && XPending(display)) {
 		XNextEvent(display, &event);
 
 		if (XFilterEvent(&event, None))
 			continue;
 
+		if (event.type == MappingNotify) {
+			switch (event.xmapping.request) {
+			case MappingModifier:
+			case MappingKeyboard:
+				XRefreshKeyboardMapping(&event.xmapping);
+				break;
+			}
+
+			continue;
+		}
+
+		if (!find_window(event.xany.window))
+			continue;
+
 		switch (event.type) {
+		case Expose:
+			session->redraw = true;
+			break;
+		case VisibilityNotify:
+			session->window_visible = event.xvisibility.state !=
+				VisibilityFullyObscured;
+			break;
+		case MapNotify:
+			session->window_visible = true;
+			break;
+		case UnmapNotify:
+			session->window_visible = false;
+			break;
+		// Window managers send these all the time while the window is
+		// dragged to a new size, so only the last one is acted on.
+		case ConfigureNotify:
+			win->width = event.xconfigure.width;
+			win->height = event.xconfigure.height;
+			win->configured = true;
+			break;
 		case KeyPress:
 			handle_key(&event.xkey);
-			keystate[event.xkey.keycode] = true;
+			win->keystate[event.xkey.keycode] = true;
+			pttyped();
 			break;
 		case KeyRelease:
-			keystate[event.xkey.keycode] = false;
+			win->keystate[event.xkey.keycode] = false;
 			break;
 		case FocusIn:
-			XSetICFocus(xic);
+			create_ic();
+			XSetICFocus(win->xic);
 			break;
 		case FocusOut:
-			XUnsetICFocus(xic);
+			if (win->xic) XUnsetICFocus(win->xic);
 			break;
 		case ClientMessage:
-			if (event.xclient.message_type == wm_protocols && (Atom)event.xclient.data.l[0] == wm_delete_window)
-				exit(EXIT_SUCCESS);
-			break;
-		case MappingNotify:
-			switch (event.xmapping.request) {
-			case MappingModifier:
-			case MappingKeyboard:
-				XRefreshKeyboardMapping(&event.xmapping);
-				break;
-			}
+			if (event.xclient.message_type == wm_protocols &&
+				(Atom)event.xclient.data.l[0] ==
+				wm_delete_window)
+				session->closed = true;
 			break;
 		}
 	}
+
+	for (s = sessions; s; s = s->next) {
+		if (s->win && s->win->configured) {
+			switch_session(s);
+			win->configured = false;
+			handle_configure(win->width, win->height);
+		}
+	}
+
+	// A window asked for from the keyboard opens once the events for the
+	// one it was asked from have been dealt with.
+	if (new_window) {
+		new_window = false;
+		open_session(NULL);
+	}
+}
+
+void
+wmname(const char *name)
+{
+	free(win->title);
+
+	if (!(win->title = strdup(name)))
+		pdie("failed to allocate title");
+
+	if (!win->showing_status)
+		set_name(win->title);
 }
 
+// Shows status in place of the title, or the title again if status is NULL.
 void
-wmname(const char *title)
+wmstatus(const char *status)
 {
-	XChangeProperty(display, window, net_wm_name, utf8_string, 8,
-		PropModeReplace, (const unsigned char *)title, strlen(title));
+	win->showing_status = status;
+	set_name(status ? status : win->title);
 }
 
 void
 wmiconname(const char *name)
 {
-	XChangeProperty(display, window, net_wm_icon_name, utf8_string, 8,
-		PropModeReplace, (const unsigned char *)name, strlen(name));
+	if (display)
+		XChangeProperty(display, win->window, net_wm_icon_name,
+			utf8_string, 8, PropModeReplace,
+			(const unsigned char *)name, strlen(name));
 }
 
 void
 wmresize()
 {
-	window_width = screen_width * CHARWIDTH;
-	window_height = screen_height * CHARHEIGHT;
+	// Nothing needs doing before the window is open, or if the screen was
+	// resized to fit the window.
+	if (!win || (session->window_width / CHARWIDTH == term->width &&
+		session->window_height / CHARHEIGHT == term->height))
+		return;
+
+	session->window_width = term->width * CHARWIDTH;
+	session->window_height = term->height * CHARHEIGHT;
 
 	if (display)
-		XResizeWindow(display, window, window_width, window_height);
+		XResizeWindow(display, win->window, session->window_width,
+			session->window_height);
 }
 
 void
 wmbell()
 {
-	XBell(display, 0);
+	if (display)
+		XBell(display, 0);
 }
 
 void
@@ -130,7 +290,7 @@ wmparsecolor(struct color *colorp, const char *name)
 {
 	XColor color;
 
-	if (XParseColor(display, colormap, name, &color)) {
+	if (display && XParseColor(display, colormap, name, &color)) {
 		colorp->r = color.red >> 8;
 		colorp->g = color.green >> 8;
 		colorp->b = color.blue >> 8;
@@ -143,11 +303,9 @@ wmparsecolor(struct color *colorp, const char *name)
 static void
 init_x11()
 {
-	XVisualInfo visual_info;
-	XSetWindowAttributes attrs;
-	XSizeHints *normal_hints;
-	XWMHints *hints;
-	XClassHint *class_hint;
+	// EGL talks to the display from the render thread as well.
+	if (!XInitThreads())
+		die("failed to initialize Xlib for threads");
 
 	if (!(display = XOpenDisplay(NULL)))
 		die("failed to connect to X server");
@@ -166,15 +324,25 @@ init_x11()
 		die("failed to find compatible visual");
 
 	colormap = XCreateColormap(display, DefaultRootWindow(display), visual_info.visual, AllocNone);
+}
+
+static void
+create_window()
+{
+	XSetWindowAttributes attrs;
+	XSizeHints *normal_hints;
+	XWMHints *hints;
+	XClassHint *class_hint;
 
 	attrs.background_pixel = 0;
 	attrs.border_pixel = 0;
-	attrs.event_mask = KeyPressMask|KeyReleaseMask|FocusChangeMask;
+	attrs.event_mask = KeyPressMask|KeyReleaseMask|FocusChangeMask|
+		ExposureMask|VisibilityChangeMask|StructureNotifyMask;
 	attrs.colormap = colormap;
 
-	window = XCreateWindow(display, DefaultRootWindow(display), 0, 0,
-		window_width, window_height, 0, visual_info.depth, InputOutput,
-		visual_info.visual,
+	win->window = XCreateWindow(display, DefaultRootWindow(display), 0, 0,
+		session->window_width, session->window_height, 0,
+		visual_info.depth, InputOutput, visual_info.visual,
 		CWBackPixel|CWBorderPixel|CWEventMask|CWColormap, &attrs);
 
 	if (!(normal_hints = XAllocSizeHints()))
@@ -191,11 +359,13 @@ init_x11()
 		pdie("failed to allocate XClassHint");
 	}
 
-	normal_hints->flags = PMinSize|PMaxSize;
-	normal_hints->min_width = window_width;
-	normal_hints->min_height = window_height;
-	normal_hints->max_width = window_width;
-	normal_hints->max_height = window_height;
+	normal_hints->flags = PMinSize|PBaseSize|PResizeInc;
+	normal_hints->min_width = CHARWIDTH;
+	normal_hints->min_height = CHARHEIGHT;
+	normal_hints->base_width = 0;
+	normal_hints->base_height = 0;
+	normal_hints->width_inc = CHARWIDTH;
+	normal_hints->height_inc = CHARHEIGHT;
 
 	hints->flags = InputHint|StateHint;
 	hints->input = true;
@@ -204,19 +374,51 @@ init_x11()
 	class_hint->res_name = instance_name;
 	class_hint->res_class = "Terminix";
 
-	XStoreName(display, window, "Terminix");
-	XSetIconName(display, window, "Terminix");
-	XSetWMNormalHints(display, window, normal_hints);
-	XSetWMHints(display, window, hints);
-	XSetClassHint(display, window, class_hint);
-	XSetWMProtocols(display, window, &wm_delete_window, 1);
-	XMapWindow(display, window);
+	XStoreName(display, win->window, "Terminix");
+	XSetIconName(display, win->window, "Terminix");
+	XSetWMNormalHints(display, win->window, normal_hints);
+	XSetWMHints(display, win->window, hints);
+	XSetClassHint(display, win->window, class_hint);
+	XSetWMProtocols(display, win->window, &wm_delete_window, 1);
+	XMapWindow(display, win->window);
 
 	XFree(hints);
 	XFree(normal_hints);
 	XFree(class_hint);
 }
 
+// Opening the input method can take a while if it has to talk to an input
+// method server, so it waits until a window first has the focus, or a key is
+// pressed in one that somehow never got it.
+static void
+create_ic()
+{
+	if (win->xic)
+		return;
+
+	if (!xim)
+		init_xim();
+
+	if (!(win->xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing|XIMStatusNothing, XNClientWindow, win->window, NULL)))
+		die("failed to create input method context");
+}
+
+// Makes the session the window belongs to current, and returns whether there
+// is one.
+static bool
+find_window(Window window)
+{
+	struct session *s;
+
+	for (s = sessions; s; s = s->next)
+		if (s->win && s->win->window == window) {
+			switch_session(s);
+			return true;
+		}
+
+	return false;
+}
+
 static void
 init_xkb()
 {
@@ -245,9 +447,27 @@ init_xim()
 
 	if (!(xim = XOpenIM(display, NULL, NULL, NULL)))
 		die("failed to open X Input Method");
+}
 
-	if (!(xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing|XIMStatusNothing, XNClientWindow, window, NULL)))
-		die("failed to create input method context");
+// Fits the screen to a new window size. Window managers that ignore the resize
+// increments can leave part of a cell over, which is left blank.
+static void
+handle_configure(int width, int height)
+{
+	int columns, rows;
+
+	if (width == session->window_width && height == session->window_height)
+		return;
+
+	session->window_width = width;
+	session->window_height = height;
+	columns = width / CHARWIDTH > 0 ? width / CHARWIDTH : 1;
+	rows = height / CHARHEIGHT > 0 ? height / CHARHEIGHT : 1;
+
+	if (columns != term->width || rows != term->height)
+		resize(columns, rows);
+
+	session->redraw = true;
 }
 
 static void
@@ -258,61 +478,111 @@ handle_key(XKeyEvent *event)
 	KeySym keysym;
 	Status status;
 
-	bufsize = Xutf8LookupString(xic, event, buffer, sizeof(buffer) - 1, &keysym, &status);
+	create_ic();
+	bufsize = Xutf8LookupString(win->xic, event, buffer, sizeof(buffer) - 1, &keysym, &status);
 
 	if (status == XBufferOverflow) {
 		warnx("buffer overflow in Xutf8LookupString");
 		return;
 	}
 
-	if (status == XLookupNone || getmode(XOFF) || (!getmode(DECARM) && keystate[event->keycode]))
+	if (status == XLookupNone || (!getmode(DECARM) && win->keystate[event->keycode]))
+		return;
+
+	if (session->searching) {
+		handle_search_key(event, status == XLookupChars ? NoSymbol :
+			keysym, buffer, status == XLookupKeySym ? 0 : bufsize);
 		return;
+	}
 
 	if (status == XLookupKeySym || status == XLookupBoth) {
 		switch (keysym) {
+		case XK_F:
+		case XK_f:
+			if ((event->state & (ControlMask | ShiftMask)) !=
+				(ControlMask | ShiftMask))
+				break;
+
+			start_search();
+			return;
+		case XK_P:
+		case XK_p:
+			if ((event->state & (ControlMask | ShiftMask)) !=
+				(ControlMask | ShiftMask))
+				break;
+
+			toggle_hud();
+			return;
+		case XK_N:
+		case XK_n:
+			if ((event->state & (ControlMask | ShiftMask)) !=
+				(ControlMask | ShiftMask))
+				break;
+
+			new_window = true;
+			return;
 		case XK_Pause:
 			if (event->state & ShiftMask)
 				warnx("TODO : transmit answerback");
 			else
-				// TODO : check this line still works
-				ptwrite((mode ^= PAUSED) & PAUSED ? "\x13" : "\x11");
+				ptpause();
 			return;
 		case XK_Break: ptbreak(event->state & ShiftMask); break;
 		case XK_Print: warnx("TODO : print screen"); break;
 		case XK_Menu: warnx("TODO : SETUP"); break;
-		case XK_Home: ptwrite("\33[1~"); return;
-		case XK_Insert: ptwrite("\33[2~"); return;
-		case XK_End: ptwrite("\33[4~"); return;
-		case XK_Page_Up: ptwrite("\33[5~"); return;
-		case XK_Page_Down: ptwrite("\33[6~"); return;
-		case XK_F1: ptwrite(getmode(DECANM) ? "\33OP" : "\33P"); return;
-		case XK_F2: ptwrite(getmode(DECANM) ? "\33OQ" : "\33Q"); return;
-		case XK_F3: ptwrite(getmode(DECANM) ? "\33OR" : "\33R"); return;
-		case XK_F4: ptwrite(getmode(DECANM) ? "\33OS" : "\33S"); return;
+		case XK_Home:
+			if (event->state & ShiftMask)
+				scroll_view(history_size());
+			else
+				ptputs("\33[1~");
+			return;
+		case XK_Insert: ptputs("\33[2~"); return;
+		case XK_End:
+			if (event->state & ShiftMask)
+				scroll_view(-term->scrollback);
+			else
+				ptputs("\33[4~");
+			return;
+		case XK_Page_Up:
+			if (event->state & ShiftMask)
+				scroll_view(term->height);
+			else
+				ptputs("\33[5~");
+			return;
+		case XK_Page_Down:
+			if (event->state & ShiftMask)
+				scroll_view(-term->height);
+			else
+				ptputs("\33[6~");
+			return;
+		case XK_F1: ptputs(getmode(DECANM) ? "\33OP" : "\33P"); return;
+		case XK_F2: ptputs(getmode(DECANM) ? "\33OQ" : "\33Q"); return;
+		case XK_F3: ptputs(getmode(DECANM) ? "\33OR" : "\33R"); return;
+		case XK_F4: ptputs(getmode(DECANM) ? "\33OS" : "\33S"); return;
 		// TODO : the rest of the function keys
 		}
 
 		if (keysym >= XK_Left && keysym <= XK_Down) {
 			if (!getmode(DECANM))
 				switch (keysym) {
-				case XK_Up: ptwrite("\33A"); break;
-				case XK_Down: ptwrite("\33B"); break;
-				case XK_Right: ptwrite("\33C"); break;
-				case XK_Left: ptwrite("\33D"); break;
+				case XK_Up: ptputs("\33A"); break;
+				case XK_Down: ptputs("\33B"); break;
+				case XK_Right: ptputs("\33C"); break;
+				case XK_Left: ptputs("\33D"); break;
 				}
 			else if (getmode(DECCKM))
 				switch (keysym) {
-				case XK_Up: ptwrite("\33OA"); break;
-				case XK_Down: ptwrite("\33OB"); break;
-				case XK_Right: ptwrite("\33OC"); break;
-				case XK_Left: ptwrite("\33OD"); break;
+				case XK_Up: ptputs("\33OA"); break;
+				case XK_Down: ptputs("\33OB"); break;
+				case XK_Right: ptputs("\33OC"); break;
+				case XK_Left: ptputs("\33OD"); break;
 				}
 			else
 				switch (keysym) {
-				case XK_Up: ptwrite("\33[A"); break;
-				case XK_Down: ptwrite("\33[B"); break;
-				case XK_Right: ptwrite("\33[C"); break;
-				case XK_Left: ptwrite("\33[D"); break;
+				case XK_Up: ptputs("\33[A"); break;
+				case XK_Down: ptputs("\33[B"); break;
+				case XK_Right: ptputs("\33[C"); break;
+				case XK_Left: ptputs("\33[D"); break;
 				}
 
 			return;
@@ -341,17 +611,56 @@ handle_key(XKeyEvent *event)
 
 		if (bufsize == 1 && buffer[0] == '\r') {
 			if (event->state & ShiftMask)
-				ptwrite("\n");
+				ptputs("\n");
 			else
-				ptwrite(getmode(LNM) ? "\r\n" : "\r");
+				ptputs(getmode(LNM) ? "\r\n" : "\r");
 		} else {
-			ptwrite("%s", buffer);
+			ptwrite(buffer, bufsize);
 		}
 	}
 }
 
+// While searching, typing edits the query instead of going to the terminal.
+static void
+handle_search_key(XKeyEvent *event, KeySym keysym, const char *buffer,
+	int bufsize)
+{
+	switch (keysym) {
+	case XK_Escape: stop_search(); return;
+	case XK_BackSpace: search_erase(); return;
+	case XK_Return:
+	case XK_KP_Enter:
+		search_next(event->state & ShiftMask ? -1 : 1);
+		return;
+	case XK_Up: search_next(1); return;
+	case XK_Down: search_next(-1); return;
+	}
+
+	if (bufsize && !(event->state & ControlMask))
+		search_input(buffer, bufsize);
+}
+
+static void
+set_name(const char *name)
+{
+	if (!display)
+		return;
+
+	if (name)
+		XChangeProperty(display, win->window, net_wm_name,
+			utf8_string, 8, PropModeReplace,
+			(const unsigned char *)name, strlen(name));
+	else
+		XDeleteProperty(display, win->window, net_wm_name);
+}
+
 static void
 kpam(char c)
 {
-	ptwrite("\33%c%c", getmode(DECANM) ? 'O' : '?', c);
+	char sequence[3];
+
+	sequence[0] = '\33';
+	sequence[1] = getmode(DECANM) ? 'O' : '?';
+	sequence[2] = c;
+	ptwrite(sequence, sizeof(sequence));
 }
\ No newline at end of file